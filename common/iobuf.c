@@ -60,6 +60,12 @@
    test "armored_key_8192" in armor.test! */
 #define IOBUF_BUFFER_SIZE  8192
 
+/* The size of the buffer used for reading a file opened with
+   iobuf_open and for writing a file created with iobuf_create.
+   Filters pushed on an input stream use buffers of
+   IOBUF_BUFFER_SIZE.  */
+#define IOBUF_FILE_BUFFER_SIZE  (64*1024)
+
 /*-- End configurable part.  --*/
 
 
@@ -1306,7 +1312,13 @@ iobuf_open (const char *fname)
     return iobuf_fdopen (translate_file_handle (fd, 0), "rb");
   else if ((fp = fd_cache_open (fname, "rb")) == GNUPG_INVALID_FD)
     return NULL;
-  a = iobuf_alloc (1, IOBUF_BUFFER_SIZE);
+#if defined(HAVE_POSIX_FADVISE) && !defined(HAVE_W32_SYSTEM)
+  /* Files are almost always read sequentially; tell the kernel so
+     that it can use a larger readahead window.  */
+  if (!print_only)
+    posix_fadvise (fp, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  a = iobuf_alloc (1, IOBUF_FILE_BUFFER_SIZE);
   fcx = xmalloc (sizeof *fcx + strlen (fname));
   fcx->fp = fp;
   fcx->print_only_name = print_only;
@@ -1441,7 +1453,7 @@ iobuf_create (const char *fname)
     return iobuf_fdopen (translate_file_handle (fd, 1), "wb");
   else if ((fp = direct_open (fname, "wb")) == GNUPG_INVALID_FD)
     return NULL;
-  a = iobuf_alloc (2, IOBUF_BUFFER_SIZE);
+  a = iobuf_alloc (2, IOBUF_FILE_BUFFER_SIZE);
   fcx = xmalloc (sizeof *fcx + strlen (fname));
   fcx->fp = fp;
   fcx->print_only_name = print_only;
@@ -1628,6 +1640,7 @@ iobuf_push_filter2 (iobuf_t a,
   else
     {				/* allocate a fresh buffer for the new
                                    stream */
+      a->d.size = IOBUF_BUFFER_SIZE;
       a->d.buf = xmalloc (a->d.size);
       a->d.len = 0;
       a->d.start = 0;
@@ -1977,6 +1990,28 @@ iobuf_read (iobuf_t a, void *buffer, unsigned int buflen)
 	  if (buf)
 	    buf += size;
 	}
+      if (buf && buflen - n >= a->d.size && a->use == 1
+          && a->filter == file_filter
+          && !a->filter_eof && !a->error)
+	{
+	  /* The caller wants at least a full buffer: let the file
+	     filter read directly into the caller's buffer instead of
+	     copying it through our buffer.  EOF and errors are left
+	     to underflow.  */
+	  size_t len = buflen - n;
+	  int rc;
+
+	  rc = file_filter (a->filter_ov, IOBUFCTRL_UNDERFLOW, a->chain,
+			    buf, &len);
+	  if (!rc && len)
+	    {
+	      n += len;
+	      buf += len;
+	      continue;
+	    }
+	  if (rc && rc != -1)
+	    a->error = rc;
+	}
       if (n < buflen)
 	{
 	  if ((c = underflow (a)) == -1)
@@ -2076,6 +2111,41 @@ iobuf_write (iobuf_t a, const void *buffer, unsigned int buflen)
 }
 
 
+/****************
+ * Copy all data from SOURCE to DEST until SOURCE is at EOF.  The data
+ * is read directly into the buffer of DEST so that the filters of
+ * both pipelines always work on full buffers and no intermediate
+ * buffer is needed.  If R_NBYTES is not NULL the number of copied
+ * bytes is stored there.  Returns 0 on success or the error code of
+ * the flush operation.
+ */
+int
+iobuf_copy (iobuf_t dest, iobuf_t source, off_t *r_nbytes)
+{
+  off_t nbytes = 0;
+  int n, rc = 0;
+
+  if (dest->directfp || source->directfp)
+    BUG ();
+
+  for (;;)
+    {
+      if (dest->d.len == dest->d.size && (rc = iobuf_flush (dest)))
+        break;
+      n = iobuf_read (source, dest->d.buf + dest->d.len,
+                      dest->d.size - dest->d.len);
+      if (n == -1)
+        break;
+      dest->d.len += n;
+      nbytes += n;
+    }
+
+  if (r_nbytes)
+    *r_nbytes = nbytes;
+  return rc;
+}
+
+
 int
 iobuf_writestr (iobuf_t a, const char *buf)
 {
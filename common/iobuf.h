@@ -147,6 +147,7 @@ unsigned iobuf_read_line (iobuf_t a, byte ** addr_of_buffer,
 int iobuf_peek (iobuf_t a, byte * buf, unsigned buflen);
 int iobuf_writebyte (iobuf_t a, unsigned c);
 int iobuf_write (iobuf_t a, const void *buf, unsigned buflen);
+int iobuf_copy (iobuf_t dest, iobuf_t source, off_t *r_nbytes);
 int iobuf_writestr (iobuf_t a, const char *buf);
 
 void iobuf_flush_temp (iobuf_t temp);
@@ -195,17 +195,21 @@ int
 is_file_compressed (const char *s, int *ret_rc)
 {
     iobuf_t a;
-    byte buf[4];
-    int i, rc = 0;
+    byte buf[6];
+    int i, n, rc = 0;
     int overflow;
 
     struct magic_compress_s {
         size_t len;
-        byte magic[4];
+        byte magic[6];
     } magic[] = {
         { 3, { 0x42, 0x5a, 0x68, 0x00 } }, /* bzip2 */
         { 3, { 0x1f, 0x8b, 0x08, 0x00 } }, /* gzip */
         { 4, { 0x50, 0x4b, 0x03, 0x04 } }, /* (pk)zip */
+        { 6, { 0xfd, 0x37, 0x7a, 0x58, 0x5a, 0x00 } }, /* xz */
+        { 6, { 0x37, 0x7a, 0xbc, 0xaf, 0x27, 0x1c } }, /* 7z */
+        { 4, { 0x28, 0xb5, 0x2f, 0xfd } }, /* zstd */
+        { 4, { 0x4c, 0x5a, 0x49, 0x50 } }, /* lzip */
     };
 
     if ( iobuf_is_pipe_filename (s) || !ret_rc )
@@ -222,13 +226,14 @@ is_file_compressed (const char *s, int *ret_rc)
         goto leave;
     }
 
-    if ( iobuf_read( a, buf, 4 ) == -1 ) {
+    if ( (n = iobuf_read( a, buf, DIM (buf) )) == -1 ) {
         *ret_rc = a->error;
         goto leave;
     }
 
     for ( i = 0; i < DIM( magic ); i++ ) {
-        if ( !memcmp( buf, magic[i].magic, magic[i].len ) ) {
+        if ( n >= magic[i].len
+             && !memcmp( buf, magic[i].magic, magic[i].len ) ) {
             *ret_rc = 0;
             rc = 1;
             break;
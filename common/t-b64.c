@@ -28,6 +28,7 @@
 #include <config.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "util.h"
 
@@ -145,11 +146,160 @@ test_b64dec_file (const char *fname)
 
 
 
+/* The straightforward byte at a time CRC as formerly used by
+   b64enc.c and armor.c.  */
+static u32
+reference_crc24 (u32 crc, const unsigned char *p, size_t n)
+{
+  static u32 crc_table[256];
+  static int initialized;
+  int i, j;
+  u32 t;
+
+  if (!initialized)
+    {
+      for (i=j=0; j < 128; j++ )
+        {
+          t = crc_table[j];
+          if ( (t & 0x00800000) )
+            {
+              t <<= 1;
+              crc_table[i++] = t ^ 0x864CFB;
+              crc_table[i++] = t;
+            }
+          else
+            {
+              t <<= 1;
+              crc_table[i++] = t;
+              crc_table[i++] = t ^ 0x864CFB;
+            }
+        }
+      initialized = 1;
+    }
+
+  for (; n; p++, n--)
+    crc = (crc << 8) ^ crc_table[((crc >> 16)&0xff) ^ *p];
+  return crc & 0x00ffffff;
+}
+
+
+static ssize_t
+null_writer (void *cookie, const void *buffer, size_t size)
+{
+  (void)cookie;
+  (void)buffer;
+  return size;
+}
+
+
+static void
+show_rate (const char *what, clock_t start, size_t nbytes)
+{
+  double secs = (double)(clock () - start) / CLOCKS_PER_SEC;
+
+  if (secs <= 0)
+    secs = 1.0 / CLOCKS_PER_SEC;
+  printf ("%-16s %8.1f MiB/s\n", what, nbytes / secs / (1024.0*1024.0));
+}
+
+
+/* Check the CRC against the reference implementation and print the
+   throughput of the CRC, the encoder and the decoder.  */
+static void
+run_benchmark (void)
+{
+  static const char bintoasc[] = ("ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                  "abcdefghijklmnopqrstuvwxyz"
+                                  "0123456789+/");
+  const size_t datalen = 16 * 1024 * 1024;
+  const int rounds = 8;
+  es_cookie_io_functions_t null_io = { NULL, null_writer, NULL, NULL };
+  unsigned char *data;
+  char *text, *work;
+  size_t i, n, textlen, nbytes;
+  struct b64state state;
+  estream_t fp;
+  clock_t start;
+  u32 crc1, crc2;
+  int round;
+
+  data = xmalloc (datalen);
+  for (i=0; i < datalen; i++)
+    data[i] = rand ();
+
+  for (n=0; n < 100; n++)
+    if (reference_crc24 (0xB704CE, data, n) != crc24_update (0xB704CE, data, n))
+      fail ((int)n);
+
+  start = clock ();
+  for (crc1=0xB704CE, round=0; round < rounds; round++)
+    crc1 = reference_crc24 (crc1, data, datalen);
+  show_rate ("crc24 (bytewise)", start, rounds * datalen);
+  start = clock ();
+  for (crc2=0xB704CE, round=0; round < rounds; round++)
+    crc2 = crc24_update (crc2, data, datalen);
+  show_rate ("crc24", start, rounds * datalen);
+  if (crc1 != crc2)
+    fail (100);
+
+  fp = es_fopencookie (NULL, "w", null_io);
+  if (!fp)
+    fail (101);
+  start = clock ();
+  if (b64enc_start_es (&state, fp, "PGP MESSAGE"))
+    fail (102);
+  for (round=0; round < rounds; round++)
+    for (i=0; i < datalen; i += 8192)
+      if (b64enc_write (&state, data + i, 8192))
+        fail (103);
+  if (b64enc_finish (&state))
+    fail (104);
+  show_rate ("b64enc", start, rounds * datalen);
+  es_fclose (fp);
+
+  /* Build a base64 text with lines of 64 characters.  */
+  textlen = datalen / 3 * 4 + datalen / 48 + 1;
+  text = xmalloc (textlen);
+  for (i=n=0; i + 3 <= datalen; i += 3)
+    {
+      text[n++] = bintoasc[data[i] >> 2];
+      text[n++] = bintoasc[((data[i] << 4) & 060) | (data[i+1] >> 4)];
+      text[n++] = bintoasc[((data[i+1] << 2) & 074) | (data[i+2] >> 6)];
+      text[n++] = bintoasc[data[i+2] & 077];
+      if (!((i + 3) % 48))
+        text[n++] = '\n';
+    }
+  textlen = n;
+  work = xmalloc (textlen);
+
+  start = clock ();
+  for (round=0; round < rounds; round++)
+    {
+      memcpy (work, text, textlen);
+      if (b64dec_start (&state, NULL))
+        fail (105);
+      if (b64dec_proc (&state, work, textlen, &nbytes))
+        fail (106);
+      if (b64dec_finish (&state))
+        fail (107);
+    }
+  show_rate ("b64dec", start, rounds * textlen);
+  if (nbytes != datalen / 3 * 3 || memcmp (work, data, nbytes))
+    fail (108);
+
+  xfree (work);
+  xfree (text);
+  xfree (data);
+}
+
+
+
 int
 main (int argc, char **argv)
 {
   int do_encode = 0;
   int do_decode = 0;
+  int do_bench = 0;
 
   if (argc)
     { argc--; argv++; }
@@ -169,8 +319,15 @@ main (int argc, char **argv)
       do_decode = 1;
       argc--; argv++;
     }
+  else if (argc && !strcmp (argv[0], "--bench"))
+    {
+      do_bench = 1;
+      argc--; argv++;
+    }
 
-  if (do_encode)
+  if (do_bench)
+    run_benchmark ();
+  else if (do_encode)
     test_b64enc_file (argc? *argv: NULL);
   else if (do_decode)
     test_b64dec_file (argc? *argv: NULL);
@@ -0,0 +1,524 @@
+/* t-iobuf.c - Module tests for iobuf.c
+ *	Copyright (C) 2012 Free Software Foundation, Inc.
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+
+   Without arguments the test creates a few files in the current
+   directory and compares what iobuf_get and iobuf_read return with
+   what read(2) returns for them.  For manual tests
+
+     t-iobuf --bench FILE
+
+   reads FILE in several ways and prints the throughput and, on
+   systems providing /proc/self/io, the number of read system calls
+   per GiB.
+
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "iobuf.h"
+
+#define pass()  do { ; } while(0)
+#define fail(a)  do { fprintf (stderr, "%s:%d: test %d failed\n",\
+                               __FILE__,__LINE__, (a));          \
+                     errcount++;                                 \
+                   } while(0)
+
+/* This needs to match IOBUF_FILE_BUFFER_SIZE of iobuf.c.  */
+#define FILEBUFSIZE  (64*1024)
+
+static int verbose;
+static int errcount;
+
+
+/* Create the file FNAME with LEN bytes of test data and return what
+   read(2) returns for it.  Returns NULL on error.  */
+static char *
+create_file (const char *fname, size_t len)
+{
+  FILE *fp;
+  char *buffer;
+  size_t i, n;
+  ssize_t nread;
+  int fd;
+
+  fp = fopen (fname, "wb");
+  if (!fp)
+    {
+      fprintf (stderr, "can't create '%s': %s\n", fname, strerror (errno));
+      return NULL;
+    }
+  for (i=0; i < len; i++)
+    putc ((i * 7 + (i >> 9)) & 0xff, fp);
+  if (fclose (fp))
+    {
+      fprintf (stderr, "error writing '%s': %s\n", fname, strerror (errno));
+      return NULL;
+    }
+
+  buffer = xmalloc (len + 1);
+  fd = open (fname, O_RDONLY);
+  if (fd == -1)
+    {
+      fprintf (stderr, "can't open '%s': %s\n", fname, strerror (errno));
+      xfree (buffer);
+      return NULL;
+    }
+  for (n=0; (nread = read (fd, buffer + n, len + 1 - n)) > 0; n += nread)
+    ;
+  close (fd);
+  if (nread < 0 || n != len)
+    {
+      fprintf (stderr, "error reading '%s'\n", fname);
+      xfree (buffer);
+      return NULL;
+    }
+  return buffer;
+}
+
+
+/* Open FNAME for a test.  */
+static iobuf_t
+open_file (const char *fname)
+{
+  iobuf_t inp;
+
+  inp = iobuf_open (fname);
+  if (!inp)
+    fprintf (stderr, "can't open '%s': %s\n", fname, strerror (errno));
+  return inp;
+}
+
+
+/* Consume a few bytes so that the buffer is partly used and then ask
+   for much more than a buffer in one call.  */
+static void
+test_partial_then_large (void)
+{
+  const char fname[] = "t-iobuf-1.tmp";
+  size_t len = 3 * FILEBUFSIZE + 1000;
+  char *expected, *buffer;
+  iobuf_t inp;
+  int c, i, n;
+
+  expected = create_file (fname, len);
+  if (!expected)
+    {
+      fail (1);
+      return;
+    }
+  buffer = xmalloc (len + 4096);
+
+  inp = open_file (fname);
+  if (!inp)
+    fail (2);
+  else
+    {
+      for (i=0; i < 10; i++)
+        if ((c = iobuf_get (inp)) != (unsigned char)expected[i])
+          fail (3);
+      n = iobuf_read (inp, buffer, len + 4096);
+      if (n != len - 10)
+        fail (4);
+      else if (memcmp (buffer, expected + 10, n))
+        fail (5);
+      if (iobuf_read (inp, buffer, len) != -1)
+        fail (6);
+      iobuf_close (inp);
+    }
+
+  /* The same but the first bytes are consumed by a small read and the
+     large read asks for exactly the rest.  */
+  inp = open_file (fname);
+  if (!inp)
+    fail (7);
+  else
+    {
+      n = iobuf_read (inp, buffer, 100);
+      if (n != 100 || memcmp (buffer, expected, 100))
+        fail (8);
+      n = iobuf_read (inp, buffer, len - 100);
+      if (n != len - 100)
+        fail (9);
+      else if (memcmp (buffer, expected + 100, n))
+        fail (10);
+      if (iobuf_get (inp) != -1)
+        fail (11);
+      iobuf_close (inp);
+    }
+
+  xfree (buffer);
+  xfree (expected);
+  remove (fname);
+}
+
+
+/* Read a file whose EOF is exactly at a buffer boundary.  */
+static void
+test_eof_at_boundary (void)
+{
+  const char fname[] = "t-iobuf-2.tmp";
+  size_t len = 2 * FILEBUFSIZE;
+  char *expected, *buffer;
+  iobuf_t inp;
+  size_t off;
+  int c, n;
+
+  expected = create_file (fname, len);
+  if (!expected)
+    {
+      fail (20);
+      return;
+    }
+  buffer = xmalloc (FILEBUFSIZE);
+
+  /* In chunks of the buffer size.  */
+  inp = open_file (fname);
+  if (!inp)
+    fail (21);
+  else
+    {
+      for (off=0; (n = iobuf_read (inp, buffer, FILEBUFSIZE)) != -1; off += n)
+        {
+          if (n != FILEBUFSIZE || off + n > len)
+            {
+              fail (22);
+              break;
+            }
+          if (memcmp (buffer, expected + off, n))
+            fail (23);
+        }
+      if (off != len)
+        fail (24);
+      if (iobuf_get (inp) != -1)
+        fail (25);
+      iobuf_close (inp);
+    }
+
+  /* Byte by byte.  */
+  inp = open_file (fname);
+  if (!inp)
+    fail (26);
+  else
+    {
+      for (off=0; (c = iobuf_get (inp)) != -1; off++)
+        if (off >= len || c != (unsigned char)expected[off])
+          {
+            fail (27);
+            break;
+          }
+      if (off != len)
+        fail (28);
+      if (iobuf_read (inp, buffer, FILEBUFSIZE) != -1)
+        fail (29);
+      iobuf_close (inp);
+    }
+
+  /* The first buffer is used up by iobuf_get and the rest read
+     directly.  */
+  inp = open_file (fname);
+  if (!inp)
+    fail (30);
+  else
+    {
+      for (off=0; off < FILEBUFSIZE; off++)
+        if (iobuf_get (inp) != (unsigned char)expected[off])
+          {
+            fail (31);
+            break;
+          }
+      n = iobuf_read (inp, buffer, FILEBUFSIZE);
+      if (n != FILEBUFSIZE)
+        fail (32);
+      else if (memcmp (buffer, expected + FILEBUFSIZE, n))
+        fail (33);
+      if (iobuf_read (inp, buffer, FILEBUFSIZE) != -1)
+        fail (34);
+      iobuf_close (inp);
+    }
+
+  xfree (buffer);
+  xfree (expected);
+  remove (fname);
+}
+
+
+/* Mix iobuf_get with small and large reads.  */
+static void
+test_mixed_reads (void)
+{
+  static const int sizes[] = { 1, 70000, 3, FILEBUFSIZE, 100, 1,
+                               2 * FILEBUFSIZE, 4095, 1, 0 };
+  const char fname[] = "t-iobuf-3.tmp";
+  size_t len = 7 * FILEBUFSIZE + 333;
+  char *expected, *buffer;
+  iobuf_t inp;
+  size_t off;
+  int c, i, j, n;
+
+  expected = create_file (fname, len);
+  if (!expected)
+    {
+      fail (40);
+      return;
+    }
+  buffer = xmalloc (2 * FILEBUFSIZE);
+
+  inp = open_file (fname);
+  if (!inp)
+    fail (41);
+  else
+    {
+      off = 0;
+      for (i=0; off < len; i = sizes[i+1]? i+1 : 0)
+        {
+          if (sizes[i] < 4)
+            {
+              /* Use iobuf_get for very small sizes.  */
+              for (j=0; j < sizes[i] && off < len; j++, off++)
+                if ((c = iobuf_get (inp)) != (unsigned char)expected[off])
+                  {
+                    if (verbose)
+                      fprintf (stderr, "iobuf_get at %lu: %d\n",
+                               (unsigned long)off, c);
+                    fail (42);
+                    goto leave;
+                  }
+              continue;
+            }
+          n = iobuf_read (inp, buffer, sizes[i]);
+          if (n == -1 || n > sizes[i]
+              || (n < sizes[i] && off + n != len))
+            {
+              if (verbose)
+                fprintf (stderr, "iobuf_read of %d at %lu: %d\n",
+                         sizes[i], (unsigned long)off, n);
+              fail (43);
+              goto leave;
+            }
+          if (memcmp (buffer, expected + off, n))
+            {
+              fail (44);
+              goto leave;
+            }
+          off += n;
+        }
+      if (off != len)
+        fail (45);
+      if (iobuf_get (inp) != -1)
+        fail (46);
+      if (iobuf_read (inp, buffer, 2 * FILEBUFSIZE) != -1)
+        fail (47);
+    leave:
+      iobuf_close (inp);
+    }
+
+  xfree (buffer);
+  xfree (expected);
+  remove (fname);
+}
+
+
+/* Return the number of read system calls done by this process or -1
+   if that is not known.  */
+static long
+read_syscalls (void)
+{
+  FILE *fp;
+  char line[100];
+  long n = -1;
+
+  fp = fopen ("/proc/self/io", "r");
+  if (!fp)
+    return -1;
+  while (fgets (line, sizeof line, fp))
+    if (!strncmp (line, "syscr:", 6))
+      {
+        n = strtol (line + 6, NULL, 10);
+        break;
+      }
+  fclose (fp);
+  return n;
+}
+
+
+static void
+show_result (const char *what, clock_t start, long syscalls,
+             unsigned long long nbytes)
+{
+  double secs = (double)(clock () - start) / CLOCKS_PER_SEC;
+  double gib = nbytes / (1024.0*1024.0*1024.0);
+
+  if (secs <= 0)
+    secs = 1.0 / CLOCKS_PER_SEC;
+  printf ("%-24s %8.1f MiB/s", what, nbytes / secs / (1024.0*1024.0));
+  if (syscalls >= 0 && gib > 0)
+    printf ("  %10.0f reads/GiB", syscalls / gib);
+  putchar ('\n');
+}
+
+
+/* Read FNAME with read(2) in chunks of IOBUF_BUFFER_SIZE as done by
+   the file filter of old.  */
+static unsigned long long
+bench_plain_read (const char *fname)
+{
+  char buffer[8192];
+  unsigned long long total = 0;
+  int fd;
+  ssize_t n;
+
+  fd = open (fname, O_RDONLY);
+  if (fd == -1)
+    {
+      fprintf (stderr, "can't open '%s': %s\n", fname, strerror (errno));
+      fail (101);
+      return 0;
+    }
+  while ((n = read (fd, buffer, sizeof buffer)) > 0)
+    total += n;
+  if (n < 0)
+    fail (102);
+  close (fd);
+  return total;
+}
+
+
+/* Read FNAME via iobuf_read in chunks of CHUNKSIZE.  */
+static unsigned long long
+bench_iobuf_read (const char *fname, size_t chunksize)
+{
+  iobuf_t inp;
+  char *buffer;
+  unsigned long long total = 0;
+  int n;
+
+  inp = iobuf_open (fname);
+  if (!inp)
+    {
+      fprintf (stderr, "can't open '%s': %s\n", fname, strerror (errno));
+      fail (103);
+      return 0;
+    }
+  buffer = xmalloc (chunksize);
+  while ((n = iobuf_read (inp, buffer, chunksize)) != -1)
+    total += n;
+  iobuf_close (inp);
+  xfree (buffer);
+  return total;
+}
+
+
+/* Read FNAME byte by byte using iobuf_get.  */
+static unsigned long long
+bench_iobuf_get (const char *fname)
+{
+  iobuf_t inp;
+  unsigned long long total = 0;
+
+  inp = iobuf_open (fname);
+  if (!inp)
+    {
+      fprintf (stderr, "can't open '%s': %s\n", fname, strerror (errno));
+      fail (104);
+      return 0;
+    }
+  while (iobuf_get (inp) != -1)
+    total++;
+  iobuf_close (inp);
+  return total;
+}
+
+
+static void
+run_benchmark (const char *fname)
+{
+  unsigned long long n, expected;
+  clock_t start;
+  long syscalls;
+
+  start = clock ();
+  syscalls = read_syscalls ();
+  expected = bench_plain_read (fname);
+  show_result ("read (8 KiB)", start,
+               syscalls < 0? -1 : read_syscalls () - syscalls, expected);
+
+  start = clock ();
+  syscalls = read_syscalls ();
+  n = bench_iobuf_get (fname);
+  show_result ("iobuf_get", start,
+               syscalls < 0? -1 : read_syscalls () - syscalls, n);
+  if (n != expected)
+    fail (105);
+
+  start = clock ();
+  syscalls = read_syscalls ();
+  n = bench_iobuf_read (fname, 8192);
+  show_result ("iobuf_read (8 KiB)", start,
+               syscalls < 0? -1 : read_syscalls () - syscalls, n);
+  if (n != expected)
+    fail (106);
+
+  start = clock ();
+  syscalls = read_syscalls ();
+  n = bench_iobuf_read (fname, 1024*1024);
+  show_result ("iobuf_read (1 MiB)", start,
+               syscalls < 0? -1 : read_syscalls () - syscalls, n);
+  if (n != expected)
+    fail (107);
+}
+
+
+
+int
+main (int argc, char **argv)
+{
+  if (argc)
+    { argc--; argv++; }
+  if (argc && !strcmp (argv[0], "--verbose"))
+    {
+      verbose = 1;
+      argc--; argv++;
+    }
+
+  if (!argc)
+    {
+      test_partial_then_large ();
+      test_eof_at_boundary ();
+      test_mixed_reads ();
+    }
+  else if (argc == 2 && !strcmp (argv[0], "--bench"))
+    run_benchmark (argv[1]);
+  else
+    {
+      fputs ("usage: t-iobuf [--verbose] [--bench FILE]\n", stderr);
+      return 1;
+    }
+
+  return !!errcount;
+}
@@ -167,6 +167,7 @@ gpg_error_t b64enc_start_es (struct b64state *state, estream_t fp,
 gpg_error_t b64enc_write (struct b64state *state,
                           const void *buffer, size_t nbytes);
 gpg_error_t b64enc_finish (struct b64state *state);
+u32 crc24_update (u32 crc, const void *buffer, size_t length);
 
 gpg_error_t b64dec_start (struct b64state *state, const char *title);
 gpg_error_t b64dec_proc (struct b64state *state, void *buffer, size_t length,
@@ -40,12 +40,6 @@
 #define MAX_LINELEN 20000
 
 #define CRCINIT 0xB704CE
-#define CRCPOLY 0X864CFB
-#define CRCUPDATE(a,c) do {						    \
-			a = ((a) << 8) ^ crc_table[((a)&0xff >> 16) ^ (c)]; \
-			a &= 0x00ffffff;				    \
-		    } while(0)
-static u32 crc_table[256];
 static byte bintoasc[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
 			 "abcdefghijklmnopqrstuvwxyz"
 			 "0123456789+/";
@@ -163,25 +157,9 @@ push_armor_filter (armor_filter_context_t *afx, iobuf_t iobuf)
 static void
 initialize(void)
 {
-    int i, j;
-    u32 t;
+    int i;
     byte *s;
 
-    /* init the crc lookup table */
-    crc_table[0] = 0;
-    for(i=j=0; j < 128; j++ ) {
-	t = crc_table[j];
-	if( t & 0x00800000 ) {
-	    t <<= 1;
-	    crc_table[i++] = t ^ CRCPOLY;
-	    crc_table[i++] = t;
-	}
-	else {
-	    t <<= 1;
-	    crc_table[i++] = t;
-	    crc_table[i++] = t ^ CRCPOLY;
-	}
-    }
     /* build the helptable for radix64 to bin conversion */
     for(i=0; i < 256; i++ )
 	asctobin[i] = 255; /* used to detect invalid characters */
@@ -754,7 +732,7 @@ radix64_read( armor_filter_context_t *afx, IOBUF a, size_t *retn,
     int checkcrc=0;
     int rc = 0;
     size_t n = 0;
-    int  idx, i, onlypad=0;
+    int  idx, onlypad=0;
     u32 crc;
 
     crc = afx->crc;
@@ -762,6 +740,25 @@ radix64_read( armor_filter_context_t *afx, IOBUF a, size_t *retn,
     val = afx->radbuf[0];
     for( n=0; n < size; ) {
 
+	/* Fast path for complete groups of four valid characters;
+	   everything else is handled one character at a time.  */
+	if( !idx ) {
+	    while( afx->buffer_pos + 4 <= afx->buffer_len && n + 3 <= size ) {
+		const byte *p = afx->buffer + afx->buffer_pos;
+		byte c0 = asctobin[p[0]], c1 = asctobin[p[1]];
+		byte c2 = asctobin[p[2]], c3 = asctobin[p[3]];
+
+		if( (c0 | c1 | c2 | c3) & 0x80 )
+		    break;
+		buf[n++] = (c0 << 2) | (c1 >> 4);
+		buf[n++] = (c1 << 4) | (c2 >> 2);
+		buf[n++] = (c2 << 6) | c3;
+		afx->buffer_pos += 4;
+	    }
+	    if( n >= size )
+		break;
+	}
+
 	if( afx->buffer_pos < afx->buffer_len )
 	    c = afx->buffer[afx->buffer_pos++];
 	else { /* read the next line */
@@ -820,9 +817,7 @@ radix64_read( armor_filter_context_t *afx, IOBUF a, size_t *retn,
 	idx = (idx+1) % 4;
     }
 
-    for(i=0; i < n; i++ )
-	crc = (crc << 8) ^ crc_table[((crc >> 16)&0xff) ^ buf[i]];
-    crc &= 0x00ffffff;
+    crc = crc24_update (crc, buf, n);
     afx->crc = crc;
     afx->idx = idx;
     afx->radbuf[0] = val;
@@ -947,6 +942,8 @@ armor_filter( void *opaque, int control,
     armor_filter_context_t *afx = opaque;
     int rc=0, i, c;
     byte radbuf[3];
+    byte outbuf[4*256+64];
+    size_t outlen;
     int  idx, idx2;
     size_t n=0;
     u32 crc;
@@ -1126,29 +1123,45 @@ armor_filter( void *opaque, int control,
 	for(i=0; i < idx; i++ )
 	    radbuf[i] = afx->radbuf[i];
 
-	for(i=0; i < size; i++ )
-	    crc = (crc << 8) ^ crc_table[((crc >> 16)&0xff) ^ buf[i]];
-	crc &= 0x00ffffff;
-
-	for( ; size; buf++, size-- ) {
-	    radbuf[idx++] = *buf;
-	    if( idx > 2 ) {
+	crc = crc24_update (crc, buf, size);
+
+	/* Complete a pending group, then encode full groups directly
+	   from BUF.  The output is collected in OUTBUF so that we don't
+	   need to call iobuf_put for each character.  */
+	outlen = 0;
+	while( size ) {
+	    const byte *g;
+
+	    if( idx || size < 3 ) {
+		radbuf[idx++] = *buf++;
+		size--;
+		if( idx < 3 )
+		    continue;
+		g = radbuf;
 		idx = 0;
-		c = bintoasc[(*radbuf >> 2) & 077];
-		iobuf_put(a, c);
-		c = bintoasc[(((*radbuf<<4)&060)|((radbuf[1] >> 4)&017))&077];
-		iobuf_put(a, c);
-		c = bintoasc[(((radbuf[1]<<2)&074)|((radbuf[2]>>6)&03))&077];
-		iobuf_put(a, c);
-		c = bintoasc[radbuf[2]&077];
-		iobuf_put(a, c);
-		if( ++idx2 >= (64/4) )
-		  { /* pgp doesn't like 72 here */
-		    iobuf_writestr(a,afx->eol);
-		    idx2=0;
-		  }
+	    }
+	    else {
+		g = buf;
+		buf += 3;
+		size -= 3;
+	    }
+	    outbuf[outlen++] = bintoasc[(g[0] >> 2) & 077];
+	    outbuf[outlen++] = bintoasc[(((g[0]<<4)&060)|((g[1] >> 4)&017))&077];
+	    outbuf[outlen++] = bintoasc[(((g[1]<<2)&074)|((g[2]>>6)&03))&077];
+	    outbuf[outlen++] = bintoasc[g[2]&077];
+	    if( ++idx2 >= (64/4) )
+	      { /* pgp doesn't like 72 here */
+		for(i=0; i < sizeof afx->eol && afx->eol[i]; i++ )
+		    outbuf[outlen++] = afx->eol[i];
+		idx2=0;
+	      }
+	    if( outlen > sizeof outbuf - 8 ) {
+		iobuf_write (a, outbuf, outlen);
+		outlen = 0;
 	    }
 	}
+	if( outlen )
+	    iobuf_write (a, outbuf, outlen);
 	for(i=0; i < idx; i++ )
 	    afx->radbuf[i] = radbuf[i];
 	afx->idx = idx;
@@ -1490,8 +1503,8 @@ unarmor_pump (UnarmorPump x, int c)
     }
 
     if ( !(rval & ~255) ) { /* compute the CRC */
-        x->crc = (x->crc << 8) ^ crc_table[((x->crc >> 16)&0xff) ^ rval];
-        x->crc &= 0x00ffffff;
+        byte b = rval;
+        x->crc = crc24_update (x->crc, &b, 1);
     }
 
     return rval;
@@ -502,9 +502,7 @@ static int
 do_plaintext( IOBUF out, int ctb, PKT_plaintext *pt )
 {
     int i, rc = 0;
-    u32 n;
-    byte buf[1000]; /* this buffer has the plaintext! */
-    int nbytes;
+    off_t n;
 
     write_header(out, ctb, calc_plaintext( pt ) );
     iobuf_put(out, pt->mode );
@@ -515,14 +513,7 @@ do_plaintext( IOBUF out, int ctb, PKT_plaintext *pt )
     if (rc)
       return rc;
 
-    n = 0;
-    while( (nbytes=iobuf_read(pt->buf, buf, 1000)) != -1 ) {
-      rc = iobuf_write (out, buf, nbytes);
-      if (rc)
-        break;
-      n += nbytes;
-    }
-    wipememory(buf,1000); /* burn the buffer */
+    rc = iobuf_copy (out, pt->buf, &n);
     if( (ctb&0x40) && !pt->len )
       iobuf_set_partial_block_mode(out, 0 ); /* turn off partial */
     if( pt->len && n != pt->len )
@@ -1093,8 +1084,12 @@ do_signature( IOBUF out, int ctb, PKT_signature *sig )
 {
   int rc = 0;
   int n, i;
-  IOBUF a = iobuf_temp();
+  IOBUF a;
+
+  if ((rc = sig_parse_data (sig)))
+    return rc;
 
+  a = iobuf_temp();
   if ( !sig->version )
     iobuf_put( a, 3 );
   else
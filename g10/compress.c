@@ -52,6 +52,12 @@
 #define BYTEF_CAST(a) (a)
 #endif
 
+/* After this amount of input we check whether deflate achieves
+   anything at all.  If it saves less than COMPRESS_PROBE_MINSAVE
+   percent, the rest of the data is sent as stored blocks.  */
+#define COMPRESS_PROBE_SIZE    (1024*1024)
+#define COMPRESS_PROBE_MINSAVE 2
+
 
 
 int compress_filter_bz2( void *opaque, int control,
@@ -131,6 +137,42 @@ do_compress( compress_filter_context_t *zfx, z_stream *zs, int flush, IOBUF a )
     return 0;
 }
 
+/* Switch to stored blocks if the data seen so far did not compress.
+   This is the case for already compressed or encrypted data, where
+   deflate burns a lot of CPU for nothing.  The output is still a
+   valid deflate stream.  */
+static int
+probe_compressibility (compress_filter_context_t *zfx, z_stream *zs, IOBUF a)
+{
+    int rc, zrc;
+    unsigned n;
+
+    zfx->probed = 1;
+    if( (zs->total_in / 100) * (100 - COMPRESS_PROBE_MINSAVE)
+        > zs->total_out )
+	return 0; /* Compression is worth it. */
+
+    if( DBG_FILTER )
+	log_debug("deflate: data does not compress (%lu -> %lu);"
+                  " switching to stored blocks\n",
+                  (unsigned long)zs->total_in, (unsigned long)zs->total_out);
+
+    /* Changing the parameters flushes the pending input using the old
+       level; this may need more than one output buffer.  */
+    zs->avail_in = 0;
+    do {
+	zs->next_out = BYTEF_CAST (zfx->outbuf);
+	zs->avail_out = zfx->outbufsize;
+	zrc = deflateParams( zs, Z_NO_COMPRESSION, Z_DEFAULT_STRATEGY );
+	n = zfx->outbufsize - zs->avail_out;
+	if( n && (rc=iobuf_write( a, zfx->outbuf, n )) ) {
+	    log_debug("deflate: iobuf_write failed\n");
+	    return rc;
+	}
+    } while( zrc == Z_BUF_ERROR && n );
+    return 0;
+}
+
 static void
 init_uncompress( compress_filter_context_t *zfx, z_stream *zs )
 {
@@ -261,6 +303,10 @@ compress_filter( void *opaque, int control,
 	    zfx->status = 2;
 	}
 
+	if( !zfx->probed && zs->total_in >= COMPRESS_PROBE_SIZE
+	    && (rc = probe_compressibility( zfx, zs, a )) )
+	    return rc;
+
 	zs->next_in = BYTEF_CAST (buf);
 	zs->avail_in = size;
 	rc = do_compress( zfx, zs, Z_NO_FLUSH, a );
@@ -803,19 +803,31 @@ do_export_stream (ctrl_t ctrl, iobuf_t out, strlist_t users, int secret,
       kek = NULL;
     }
 
-  while (!(err = keydb_search2 (kdbhd, desc, ndesc, &descindex)))
+  for (;;)
     {
       int skip_until_subkey = 0;
       u32 keyid[2];
       PKT_public_key *pk;
 
-      if (!users)
-        desc[0].mode = KEYDB_SEARCH_MODE_NEXT;
-
-      /* Read the keyblock. */
+      /* Read the keyblock.  If all keys are to be exported we read
+         the keyrings sequentially; this is much faster than a search
+         for each keyblock and reading it again.  */
       release_kbnode (keyblock);
       keyblock = NULL;
-      err = keydb_get_keyblock (kdbhd, &keyblock);
+      if (!users)
+        {
+          descindex = 0;
+          err = keydb_read_next_keyblock (kdbhd, &keyblock);
+          if (gpg_err_code (err) == GPG_ERR_NOT_FOUND)
+            break;
+        }
+      else
+        {
+          err = keydb_search2 (kdbhd, desc, ndesc, &descindex);
+          if (err)
+            break;
+          err = keydb_get_keyblock (kdbhd, &keyblock);
+        }
       if (err)
         {
           log_error (_("error reading keyblock: %s\n"), gpg_strerror (err));
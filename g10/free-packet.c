@@ -61,6 +61,7 @@ free_seckey_enc( PKT_signature *sig )
   for(i=0; i < n; i++ )
     mpi_release( sig->data[i] );
 
+  xfree(sig->rawdata);
   xfree(sig->revkey);
   xfree(sig->hashed);
   xfree(sig->unhashed);
@@ -235,6 +236,7 @@ copy_signature( PKT_signature *d, PKT_signature *s )
 
     if( !d )
 	d = xmalloc(sizeof *d);
+    sig_parse_data (s);
     memcpy( d, s, sizeof *d );
     n = pubkey_get_nsig( s->pubkey_algo );
     if( !n )
@@ -448,6 +450,8 @@ cmp_signatures( PKT_signature *a, PKT_signature *b )
     n = pubkey_get_nsig( a->pubkey_algo );
     if( !n )
 	return -1; /* can't compare due to unknown algorithm */
+    if( sig_parse_data (a) || sig_parse_data (b) )
+	return -1;
     for(i=0; i < n; i++ ) {
 	if( mpi_cmp( a->data[i] , b->data[i] ) )
 	    return -1;
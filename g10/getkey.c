@@ -37,6 +37,8 @@
 #include "keyserver-internal.h"
 #include "call-agent.h"
 
+/* The default size of the caches; may be changed with
+   --key-cache-size.  */
 #define MAX_PK_CACHE_ENTRIES   PK_UID_CACHE_SIZE
 #define MAX_UID_CACHE_ENTRIES  PK_UID_CACHE_SIZE
 
@@ -44,6 +46,24 @@
 #error We need the cache for key creation
 #endif
 
+/* The keyblocks matching one name as found by getkey_prefetch_names.
+   They are kept in keyring order and consumed by key_byname.  */
+struct prefetch_item_s
+{
+  struct prefetch_item_s *next;
+  kbnode_t keyblock;
+};
+
+struct prefetch_s
+{
+  struct prefetch_s *next;
+  struct prefetch_item_s *items;
+  struct prefetch_item_s **tail;
+  char name[1];
+};
+
+static struct prefetch_s *prefetch_list;
+
 struct getkey_ctx_s
 {
   int exact;
@@ -56,6 +76,7 @@ struct getkey_ctx_s
   int req_usage;
   int req_algo;
   KEYDB_HANDLE kr_handle;
+  struct prefetch_s *prefetch; /* Prefetched keyblocks or NULL.  */
   int not_allocated;
   int nitems;
   KEYDB_SEARCH_DESC items[1];
@@ -71,9 +92,18 @@ static struct
 } lkup_stats[21];
 #endif
 
+/* The public key cache and the user ID cache are hash tables keyed
+   by the key ID.  The entries of each cache are also kept in a list
+   ordered by the time of last use so that the least recently used
+   entry can be evicted when the cache is full.  */
+
+typedef struct user_id_db *user_id_db_t;
+
 typedef struct keyid_list
 {
-  struct keyid_list *next;
+  struct keyid_list *next;   /* Next key ID of the same user ID entry. */
+  struct keyid_list *hnext;  /* Next entry in the hash bucket.  */
+  user_id_db_t owner;        /* The user ID entry.  */
   u32 keyid[2];
 } *keyid_list_t;
 
@@ -81,35 +111,48 @@ typedef struct keyid_list
 #if MAX_PK_CACHE_ENTRIES
 typedef struct pk_cache_entry
 {
-  struct pk_cache_entry *next;
+  struct pk_cache_entry *next;     /* Next entry in the hash bucket.  */
+  struct pk_cache_entry *lru_prev; /* Towards the more recently used.  */
+  struct pk_cache_entry *lru_next; /* Towards the less recently used.  */
   u32 keyid[2];
   PKT_public_key *pk;
 } *pk_cache_entry_t;
-static pk_cache_entry_t pk_cache;
+static pk_cache_entry_t *pk_cache;  /* The hash table.  */
+static pk_cache_entry_t pk_cache_lru, pk_cache_lru_tail;
 static int pk_cache_entries;	/* Number of entries in pk cache.  */
 static int pk_cache_disabled;
+static unsigned long pk_cache_hits, pk_cache_misses;
 #endif
 
 #if MAX_UID_CACHE_ENTRIES < 5
 #error we really need the userid cache
 #endif
-typedef struct user_id_db
+struct user_id_db
 {
-  struct user_id_db *next;
+  struct user_id_db *lru_prev;
+  struct user_id_db *lru_next;
   keyid_list_t keyids;
   int len;
   char name[1];
-} *user_id_db_t;
-static user_id_db_t user_id_db;
+};
+static keyid_list_t *user_id_db;  /* The hash table.  */
+static user_id_db_t uid_cache_lru, uid_cache_lru_tail;
 static int uid_cache_entries;	/* Number of entries in uid cache. */
+static unsigned long uid_cache_hits, uid_cache_misses;
+
+/* Number of hash buckets of both caches; a power of 2.  */
+static unsigned int key_cache_buckets;
+#define KEY_CACHE_HASH(kid) ((kid)[1] & (key_cache_buckets - 1))
 
 static void merge_selfsigs (kbnode_t keyblock);
+static void release_prefetch (struct prefetch_s *pf);
 static int lookup (getkey_ctx_t ctx, kbnode_t *ret_keyblock, int want_secret);
 
-#if 0
-static void
-print_stats ()
+/* Print statistics about the key lookups and the caches.  */
+void
+getkey_print_stats (void)
 {
+#if 0
   int i;
   for (i = 0; i < DIM (lkup_stats); i++)
     {
@@ -120,8 +163,117 @@ print_stats ()
 		 lkup_stats[i].okay_count,
 		 lkup_stats[i].nokey_count, lkup_stats[i].error_count);
     }
+#endif
+#if MAX_PK_CACHE_ENTRIES
+  log_info ("pk cache: %d entries, %lu hits, %lu misses\n",
+            pk_cache_entries, pk_cache_hits, pk_cache_misses);
+#endif
+  log_info ("uid cache: %d entries, %lu hits, %lu misses\n",
+            uid_cache_entries, uid_cache_hits, uid_cache_misses);
+}
+
+
+/* Return the maximum number of entries of each cache.  */
+static int
+key_cache_size (void)
+{
+  if (!opt.key_cache_size)
+    return MAX_UID_CACHE_ENTRIES;
+  return opt.key_cache_size < 5? 5 : opt.key_cache_size;
 }
+
+
+/* Allocate the hash tables on first use.  */
+static void
+init_key_caches (void)
+{
+  unsigned int n;
+
+  if (key_cache_buckets)
+    return;
+
+  /* Aim for an average chain length of about 2 if the cache is
+     full.  */
+  for (n = 64; n < 65536 && n < key_cache_size () / 2; n *= 2)
+    ;
+  key_cache_buckets = n;
+#if MAX_PK_CACHE_ENTRIES
+  pk_cache = xcalloc (n, sizeof *pk_cache);
 #endif
+  user_id_db = xcalloc (n, sizeof *user_id_db);
+}
+
+
+#if MAX_PK_CACHE_ENTRIES
+static void
+pk_cache_lru_unlink (pk_cache_entry_t ce)
+{
+  if (ce->lru_prev)
+    ce->lru_prev->lru_next = ce->lru_next;
+  else
+    pk_cache_lru = ce->lru_next;
+  if (ce->lru_next)
+    ce->lru_next->lru_prev = ce->lru_prev;
+  else
+    pk_cache_lru_tail = ce->lru_prev;
+}
+
+static void
+pk_cache_lru_push (pk_cache_entry_t ce)
+{
+  ce->lru_prev = NULL;
+  ce->lru_next = pk_cache_lru;
+  if (pk_cache_lru)
+    pk_cache_lru->lru_prev = ce;
+  else
+    pk_cache_lru_tail = ce;
+  pk_cache_lru = ce;
+}
+
+/* Return the cached public key with KEYID or NULL.  */
+static PKT_public_key *
+lookup_pk_cache (u32 *keyid)
+{
+  pk_cache_entry_t ce;
+
+  if (!key_cache_buckets)
+    return NULL;
+  for (ce = pk_cache[KEY_CACHE_HASH (keyid)]; ce; ce = ce->next)
+    if (ce->keyid[0] == keyid[0] && ce->keyid[1] == keyid[1])
+      {
+        pk_cache_hits++;
+        if (ce != pk_cache_lru)
+          {
+            pk_cache_lru_unlink (ce);
+            pk_cache_lru_push (ce);
+          }
+        return ce->pk;
+      }
+  pk_cache_misses++;
+  return NULL;
+}
+
+/* Remove the least recently used entry from the pk cache.  */
+static void
+evict_pk_cache_entry (void)
+{
+  pk_cache_entry_t ce = pk_cache_lru_tail;
+  pk_cache_entry_t *cep;
+
+  if (!ce)
+    return;
+  pk_cache_lru_unlink (ce);
+  for (cep = &pk_cache[KEY_CACHE_HASH (ce->keyid)]; *cep; cep = &(*cep)->next)
+    if (*cep == ce)
+      {
+        *cep = ce->next;
+        break;
+      }
+  free_public_key (ce->pk);
+  xfree (ce);
+  pk_cache_entries--;
+}
+#endif /*MAX_PK_CACHE_ENTRIES*/
 
 
 void
@@ -148,7 +300,8 @@ cache_public_key (PKT_public_key * pk)
   else
     return; /* Don't know how to get the keyid.  */
 
-  for (ce = pk_cache; ce; ce = ce->next)
+  init_key_caches ();
+  for (ce = pk_cache[KEY_CACHE_HASH (keyid)]; ce; ce = ce->next)
     if (ce->keyid[0] == keyid[0] && ce->keyid[1] == keyid[1])
       {
 	if (DBG_CACHE)
@@ -156,18 +309,13 @@ cache_public_key (PKT_public_key * pk)
 	return;
       }
 
-  if (pk_cache_entries >= MAX_PK_CACHE_ENTRIES)
-    {
-      /* fixme: Use another algorithm to free some cache slots.  */
-      pk_cache_disabled = 1;
-      if (opt.verbose > 1)
-	log_info (_("too many entries in pk cache - disabled\n"));
-      return;
-    }
+  if (pk_cache_entries >= key_cache_size ())
+    evict_pk_cache_entry ();
   pk_cache_entries++;
   ce = xmalloc (sizeof *ce);
-  ce->next = pk_cache;
-  pk_cache = ce;
+  ce->next = pk_cache[KEY_CACHE_HASH (keyid)];
+  pk_cache[KEY_CACHE_HASH (keyid)] = ce;
+  pk_cache_lru_push (ce);
   ce->pk = copy_public_key (NULL, pk);
   ce->keyid[0] = keyid[0];
   ce->keyid[1] = keyid[1];
@@ -227,6 +375,76 @@ release_keyid_list (keyid_list_t k)
     }
 }
 
+static void
+uid_cache_lru_unlink (user_id_db_t r)
+{
+  if (r->lru_prev)
+    r->lru_prev->lru_next = r->lru_next;
+  else
+    uid_cache_lru = r->lru_next;
+  if (r->lru_next)
+    r->lru_next->lru_prev = r->lru_prev;
+  else
+    uid_cache_lru_tail = r->lru_prev;
+}
+
+static void
+uid_cache_lru_push (user_id_db_t r)
+{
+  r->lru_prev = NULL;
+  r->lru_next = uid_cache_lru;
+  if (uid_cache_lru)
+    uid_cache_lru->lru_prev = r;
+  else
+    uid_cache_lru_tail = r;
+  uid_cache_lru = r;
+}
+
+/* Return the user ID cache entry for KEYID or NULL.  */
+static user_id_db_t
+lookup_user_id (u32 *keyid)
+{
+  keyid_list_t a;
+
+  if (!key_cache_buckets)
+    return NULL;
+  for (a = user_id_db[KEY_CACHE_HASH (keyid)]; a; a = a->hnext)
+    if (a->keyid[0] == keyid[0] && a->keyid[1] == keyid[1])
+      {
+        uid_cache_hits++;
+        if (a->owner != uid_cache_lru)
+          {
+            uid_cache_lru_unlink (a->owner);
+            uid_cache_lru_push (a->owner);
+          }
+        return a->owner;
+      }
+  uid_cache_misses++;
+  return NULL;
+}
+
+/* Remove the least recently used entry from the user ID cache.  */
+static void
+evict_user_id (void)
+{
+  user_id_db_t r = uid_cache_lru_tail;
+  keyid_list_t a, *ap;
+
+  if (!r)
+    return;
+  uid_cache_lru_unlink (r);
+  for (a = r->keyids; a; a = a->next)
+    for (ap = &user_id_db[KEY_CACHE_HASH (a->keyid)]; *ap; ap = &(*ap)->hnext)
+      if (*ap == a)
+        {
+          *ap = a->hnext;
+          break;
+        }
+  release_keyid_list (r->keyids);
+  xfree (r);
+  uid_cache_entries--;
+}
+
 /****************
  * Store the association of keyid and userid
  * Feed only public keys to this function.
@@ -237,33 +455,30 @@ cache_user_id (KBNODE keyblock)
   user_id_db_t r;
   const char *uid;
   size_t uidlen;
-  keyid_list_t keyids = NULL;
+  keyid_list_t a, b, keyids = NULL;
   KBNODE k;
 
+  init_key_caches ();
   for (k = keyblock; k; k = k->next)
     {
       if (k->pkt->pkttype == PKT_PUBLIC_KEY
 	  || k->pkt->pkttype == PKT_PUBLIC_SUBKEY)
 	{
-	  keyid_list_t a = xmalloc_clear (sizeof *a);
+	  a = xmalloc_clear (sizeof *a);
 	  /* Hmmm: For a long list of keyids it might be an advantage
 	   * to append the keys.  */
 	  keyid_from_pk (k->pkt->pkt.public_key, a->keyid);
 	  /* First check for duplicates.  */
-	  for (r = user_id_db; r; r = r->next)
+	  for (b = user_id_db[KEY_CACHE_HASH (a->keyid)]; b; b = b->hnext)
 	    {
-	      keyid_list_t b = r->keyids;
-	      for (b = r->keyids; b; b = b->next)
+	      if (b->keyid[0] == a->keyid[0]
+		  && b->keyid[1] == a->keyid[1])
 		{
-		  if (b->keyid[0] == a->keyid[0]
-		      && b->keyid[1] == a->keyid[1])
-		    {
-		      if (DBG_CACHE)
-			log_debug ("cache_user_id: already in cache\n");
-		      release_keyid_list (keyids);
-		      xfree (a);
-		      return;
-		    }
+		  if (DBG_CACHE)
+		    log_debug ("cache_user_id: already in cache\n");
+		  release_keyid_list (keyids);
+		  xfree (a);
+		  return;
 		}
 	    }
 	  /* Now put it into the cache.  */
@@ -277,21 +492,19 @@ cache_user_id (KBNODE keyblock)
 
   uid = get_primary_uid (keyblock, &uidlen);
 
-  if (uid_cache_entries >= MAX_UID_CACHE_ENTRIES)
-    {
-      /* fixme: use another algorithm to free some cache slots */
-      r = user_id_db;
-      user_id_db = r->next;
-      release_keyid_list (r->keyids);
-      xfree (r);
-      uid_cache_entries--;
-    }
+  if (uid_cache_entries >= key_cache_size ())
+    evict_user_id ();
   r = xmalloc (sizeof *r + uidlen - 1);
   r->keyids = keyids;
   r->len = uidlen;
   memcpy (r->name, uid, r->len);
-  r->next = user_id_db;
-  user_id_db = r;
+  for (a = keyids; a; a = a->next)
+    {
+      a->owner = r;
+      a->hnext = user_id_db[KEY_CACHE_HASH (a->keyid)];
+      user_id_db[KEY_CACHE_HASH (a->keyid)] = a;
+    }
+  uid_cache_lru_push (r);
   uid_cache_entries++;
 }
 
@@ -300,21 +513,25 @@ void
 getkey_disable_caches ()
 {
 #if MAX_PK_CACHE_ENTRIES
-  {
-    pk_cache_entry_t ce, ce2;
+  while (pk_cache_entries)
+    evict_pk_cache_entry ();
+  pk_cache_disabled = 1;
+#endif
+  /* The primary user ID may change as well.  */
+  while (uid_cache_entries)
+    evict_user_id ();
+}
 
-    for (ce = pk_cache; ce; ce = ce2)
-      {
-	ce2 = ce->next;
-	free_public_key (ce->pk);
-	xfree (ce);
-      }
-    pk_cache_disabled = 1;
-    pk_cache_entries = 0;
-    pk_cache = NULL;
-  }
+
+/* Enable the caches again after getkey_disable_caches.  This is used
+   by the server after an import so that the following commands can
+   still make use of the caches.  */
+void
+getkey_enable_caches (void)
+{
+#if MAX_PK_CACHE_ENTRIES
+  pk_cache_disabled = 0;
 #endif
-  /* fixme: disable user id cache ? */
 }
 
 
@@ -344,14 +561,11 @@ get_pubkey (PKT_public_key * pk, u32 * keyid)
       /* Try to get it from the cache.  We don't do this when pk is
          NULL as it does not guarantee that the user IDs are
          cached. */
-      pk_cache_entry_t ce;
-      for (ce = pk_cache; ce; ce = ce->next)
+      PKT_public_key *cpk = lookup_pk_cache (keyid);
+      if (cpk)
 	{
-	  if (ce->keyid[0] == keyid[0] && ce->keyid[1] == keyid[1])
-	    {
-	      copy_public_key (pk, ce->pk);
-	      return 0;
-	    }
+	  copy_public_key (pk, cpk);
+	  return 0;
 	}
     }
 #endif
@@ -415,16 +629,12 @@ get_pubkey_fast (PKT_public_key * pk, u32 * keyid)
 #if MAX_PK_CACHE_ENTRIES
   {
     /* Try to get it from the cache */
-    pk_cache_entry_t ce;
+    PKT_public_key *cpk = lookup_pk_cache (keyid);
 
-    for (ce = pk_cache; ce; ce = ce->next)
+    if (cpk)
       {
-	if (ce->keyid[0] == keyid[0] && ce->keyid[1] == keyid[1])
-	  {
-	    if (pk)
-	      copy_public_key (pk, ce->pk);
-	    return 0;
-	  }
+        copy_public_key (pk, cpk);
+        return 0;
       }
   }
 #endif
@@ -567,6 +777,19 @@ leave:
 }
 
 
+/* Return true if MODE searches by key ID or fingerprint.  Such
+   searches are not restricted to usable keys.  */
+static int
+is_keyid_mode (KeydbSearchMode mode)
+{
+  return (mode == KEYDB_SEARCH_MODE_SHORT_KID
+          || mode == KEYDB_SEARCH_MODE_LONG_KID
+          || mode == KEYDB_SEARCH_MODE_FPR16
+          || mode == KEYDB_SEARCH_MODE_FPR20
+          || mode == KEYDB_SEARCH_MODE_FPR);
+}
+
+
 /* Try to get the pubkey by the userid.  This function looks for the
  * first pubkey certificate which has the given name in a user_id.  If
  * PK has the pubkey algo set, the function will only return a pubkey
@@ -626,16 +849,32 @@ key_byname (GETKEY_CTX *retctx, strlist_t namelist,
 	      xfree (ctx);
 	      return gpg_err_code (err); /* FIXME: remove gpg_err_code.  */
 	    }
-	  if (!include_unusable
-	      && ctx->items[n].mode != KEYDB_SEARCH_MODE_SHORT_KID
-	      && ctx->items[n].mode != KEYDB_SEARCH_MODE_LONG_KID
-	      && ctx->items[n].mode != KEYDB_SEARCH_MODE_FPR16
-	      && ctx->items[n].mode != KEYDB_SEARCH_MODE_FPR20
-	      && ctx->items[n].mode != KEYDB_SEARCH_MODE_FPR)
+	  if (!include_unusable && !is_keyid_mode (ctx->items[n].mode))
 	    ctx->items[n].skipfnc = skip_unusable;
 	}
     }
 
+  /* Take the result of an earlier getkey_prefetch_names if there is
+     one for this name.  Searches which need to continue with the
+     keyring or return the handle are not served that way.  */
+  if (prefetch_list && namelist && !namelist->next
+      && !retctx && !ret_kdbhd && !want_secret && !include_unusable)
+    {
+      struct prefetch_s *pf, *pfprev;
+
+      for (pfprev = NULL, pf = prefetch_list; pf; pfprev = pf, pf = pf->next)
+        if (!strcmp (pf->name, namelist->d))
+          {
+            if (pfprev)
+              pfprev->next = pf->next;
+            else
+              prefetch_list = pf->next;
+            pf->next = NULL;
+            ctx->prefetch = pf;
+            break;
+          }
+    }
+
   ctx->want_secret = want_secret;
   ctx->kr_handle = keydb_new ();
   if (!ret_kb)
@@ -928,12 +1167,157 @@ get_pubkey_end (GETKEY_CTX ctx)
       memset (&ctx->kbpos, 0, sizeof ctx->kbpos);
       keydb_release (ctx->kr_handle);
       free_strlist (ctx->extra_list);
+      release_prefetch (ctx->prefetch);
       if (!ctx->not_allocated)
 	xfree (ctx);
     }
 }
 
 
+static void
+release_prefetch (struct prefetch_s *pf)
+{
+  struct prefetch_s *pf2;
+  struct prefetch_item_s *item, *item2;
+
+  for (; pf; pf = pf2)
+    {
+      pf2 = pf->next;
+      for (item = pf->items; item; item = item2)
+        {
+          item2 = item->next;
+          release_kbnode (item->keyblock);
+          xfree (item);
+        }
+      xfree (pf);
+    }
+}
+
+
+static gpg_error_t
+prefetch_cb (void *opaque, size_t descindex, kbnode_t keyblock)
+{
+  struct prefetch_s **table = opaque;
+  struct prefetch_item_s *item;
+
+  item = xtrycalloc (1, sizeof *item);
+  if (!item)
+    {
+      gpg_error_t err = gpg_error_from_syserror ();
+      release_kbnode (keyblock);
+      return err;
+    }
+  item->keyblock = keyblock;
+  *table[descindex]->tail = item;
+  table[descindex]->tail = &item->next;
+  return 0;
+}
+
+
+/* Look up all public keys for the user IDs in NAMES with a single
+   pass over the key databases.  The found keyblocks are remembered so
+   that a following get_pubkey_byname for one of these names (with
+   INCLUDE_UNUSABLE not set) does not need to search again; each
+   remembered result is used only once.  This is meant for callers
+   which resolve many names at once, like the recipient list.  Only
+   user ID and mail address specifications are prefetched; key IDs
+   and fingerprints are better looked up one by one using the key
+   index.  Errors are not fatal; the names are then looked up the
+   usual way.  Call getkey_prefetch_release to drop the results not
+   used.  */
+void
+getkey_prefetch_names (strlist_t names)
+{
+  gpg_error_t err;
+  strlist_t r;
+  size_t n, ndesc;
+  KEYDB_SEARCH_DESC *desc;
+  struct prefetch_s **table;
+  KEYDB_HANDLE hd;
+  int done;
+
+  getkey_prefetch_release ();
+
+  for (n = 0, r = names; r; r = r->next)
+    n++;
+  if (!n)
+    return;
+
+  desc = xtrycalloc (n, sizeof *desc);
+  table = xtrycalloc (n, sizeof *table);
+  if (!desc || !table)
+    {
+      xfree (desc);
+      xfree (table);
+      return;
+    }
+
+  err = 0;
+  for (ndesc = 0, r = names; r && !err; r = r->next)
+    {
+      if (classify_user_id (r->d, &desc[ndesc], 1))
+        continue;  /* Let key_byname report the error.  */
+      switch (desc[ndesc].mode)
+        {
+        case KEYDB_SEARCH_MODE_EXACT:
+        case KEYDB_SEARCH_MODE_SUBSTR:
+        case KEYDB_SEARCH_MODE_MAIL:
+        case KEYDB_SEARCH_MODE_MAILSUB:
+        case KEYDB_SEARCH_MODE_MAILEND:
+        case KEYDB_SEARCH_MODE_WORDS:
+          break;
+        default:
+          continue;  /* Not worth a full scan.  */
+        }
+      desc[ndesc].skipfnc = skip_unusable;
+      table[ndesc] = xtrycalloc (1, sizeof **table + strlen (r->d));
+      if (!table[ndesc])
+        err = gpg_error_from_syserror ();
+      else
+        {
+          strcpy (table[ndesc]->name, r->d);
+          table[ndesc]->tail = &table[ndesc]->items;
+          ndesc++;
+        }
+    }
+
+  /* A single name is found as fast by the usual search.  */
+  done = 0;
+  if (!err && ndesc > 1)
+    {
+      hd = keydb_new ();
+      err = keydb_search_batch (hd, desc, ndesc, prefetch_cb, table);
+      keydb_release (hd);
+      done = !err;
+    }
+
+  for (n = 0; n < ndesc; n++)
+    {
+      if (!done)
+        release_prefetch (table[n]);
+      else
+        {
+          table[n]->next = prefetch_list;
+          prefetch_list = table[n];
+        }
+    }
+  if (err)
+    log_info ("prefetching keys failed: %s\n", gpg_strerror (err));
+
+  xfree (table);
+  xfree (desc);
+}
+
+
+/* Release the results of getkey_prefetch_names.  */
+void
+getkey_prefetch_release (void)
+{
+  release_prefetch (prefetch_list);
+  prefetch_list = NULL;
+}
+
+
 /* Search for a key with the given fingerprint.
  * FIXME:
  * We should replace this with the _byname function.  This can be done
@@ -2440,6 +2824,24 @@ found:
 }
 
 
+/* Move the next keyblock from the prefetched results of CTX to
+   CTX->KEYBLOCK.  Returns GPG_ERR_NOT_FOUND if there are no more.  */
+static gpg_error_t
+next_prefetched (getkey_ctx_t ctx)
+{
+  struct prefetch_item_s *item = ctx->prefetch->items;
+
+  if (!item)
+    return gpg_error (GPG_ERR_NOT_FOUND);
+  ctx->prefetch->items = item->next;
+  if (!item->next)
+    ctx->prefetch->tail = &ctx->prefetch->items;
+  ctx->keyblock = item->keyblock;
+  xfree (item);
+  return 0;
+}
+
+
 /* The main function to lookup a key.  On success the found keyblock
    is stored at RET_KEYBLOCK and also in CTX.  If WANT_SECRET is true
    a corresponding secret key is required.  */
@@ -2450,7 +2852,9 @@ lookup (getkey_ctx_t ctx, kbnode_t *ret_keyblock, int want_secret)
   int no_suitable_key = 0;
 
   rc = 0;
-  while (!(rc = keydb_search (ctx->kr_handle, ctx->items, ctx->nitems)))
+  while (!(rc = (ctx->prefetch
+                 ? next_prefetched (ctx)
+                 : keydb_search (ctx->kr_handle, ctx->items, ctx->nitems))))
     {
       /* If we are searching for the first key we have to make sure
          that the next iteration does not do an implicit reset.
@@ -2458,7 +2862,8 @@ lookup (getkey_ctx_t ctx, kbnode_t *ret_keyblock, int want_secret)
       if (ctx->nitems && ctx->items->mode == KEYDB_SEARCH_MODE_FIRST)
 	ctx->items->mode = KEYDB_SEARCH_MODE_NEXT;
 
-      rc = keydb_get_keyblock (ctx->kr_handle, &ctx->keyblock);
+      if (!ctx->keyblock)
+        rc = keydb_get_keyblock (ctx->kr_handle, &ctx->keyblock);
       if (rc)
 	{
 	  log_error ("keydb_get_keyblock failed: %s\n", g10_errstr (rc));
@@ -2642,18 +3047,12 @@ get_user_id_string (u32 * keyid)
   /* Try it two times; second pass reads from key resources.  */
   do
     {
-      for (r = user_id_db; r; r = r->next)
+      r = lookup_user_id (keyid);
+      if (r)
 	{
-	  keyid_list_t a;
-	  for (a = r->keyids; a; a = a->next)
-	    {
-	      if (a->keyid[0] == keyid[0] && a->keyid[1] == keyid[1])
-		{
-		  p = xmalloc (keystrlen () + 1 + r->len + 1);
-		  sprintf (p, "%s %.*s", keystr (keyid), r->len, r->name);
-		  return p;
-		}
-	    }
+	  p = xmalloc (keystrlen () + 1 + r->len + 1);
+	  sprintf (p, "%s %.*s", keystr (keyid), r->len, r->name);
+	  return p;
 	}
     }
   while (++pass < 2 && !get_pubkey (NULL, keyid));
@@ -2682,20 +3081,13 @@ get_long_user_id_string (u32 * keyid)
   /* Try it two times; second pass reads from key resources.  */
   do
     {
-      for (r = user_id_db; r; r = r->next)
+      r = lookup_user_id (keyid);
+      if (r)
 	{
-	  keyid_list_t a;
-	  for (a = r->keyids; a; a = a->next)
-	    {
-	      if (a->keyid[0] == keyid[0] && a->keyid[1] == keyid[1])
-		{
-		  p = xmalloc (r->len + 20);
-		  sprintf (p, "%08lX%08lX %.*s",
-			   (ulong) keyid[0], (ulong) keyid[1],
-			   r->len, r->name);
-		  return p;
-		}
-	    }
+	  p = xmalloc (r->len + 20);
+	  sprintf (p, "%08lX%08lX %.*s",
+		   (ulong) keyid[0], (ulong) keyid[1], r->len, r->name);
+	  return p;
 	}
     }
   while (++pass < 2 && !get_pubkey (NULL, keyid));
@@ -2714,19 +3106,13 @@ get_user_id (u32 * keyid, size_t * rn)
   /* Try it two times; second pass reads from key resources.  */
   do
     {
-      for (r = user_id_db; r; r = r->next)
+      r = lookup_user_id (keyid);
+      if (r)
 	{
-	  keyid_list_t a;
-	  for (a = r->keyids; a; a = a->next)
-	    {
-	      if (a->keyid[0] == keyid[0] && a->keyid[1] == keyid[1])
-		{
-		  p = xmalloc (r->len);
-		  memcpy (p, r->name, r->len);
-		  *rn = r->len;
-		  return p;
-		}
-	    }
+	  p = xmalloc (r->len);
+	  memcpy (p, r->name, r->len);
+	  *rn = r->len;
+	  return p;
 	}
     }
   while (++pass < 2 && !get_pubkey (NULL, keyid));
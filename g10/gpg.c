@@ -56,6 +56,7 @@
 #include "asshelp.h"
 #include "call-dirmngr.h"
 #include "../common/init.h"
+#include "../kbx/keybox.h"
 
 #if defined(HAVE_DOSISH_SYSTEM) || defined(__CYGWIN__)
 #define MY_O_BINARY  O_BINARY
@@ -119,6 +120,7 @@ enum cmd_and_opt_values
     aFastImport,
     aVerify,
     aVerifyFiles,
+    aVerifyManifest,
     aListSigs,
     aSendKeys,
     aRecvKeys,
@@ -333,6 +335,9 @@ enum cmd_and_opt_values
     oNoSigCreateCheck,
     oAutoCheckTrustDB,
     oNoAutoCheckTrustDB,
+    oTrustDBCacheSize,
+    oTrustDBMmap,
+    oKeyCacheSize,
     oPreservePermissions,
     oDefaultPreferenceList,
     oDefaultKeyserverURL,
@@ -388,6 +393,7 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_c (aDecryptFiles, "decrypt-files", "@"),
   ARGPARSE_c (aVerify, "verify"   , N_("verify a signature")),
   ARGPARSE_c (aVerifyFiles, "verify-files" , "@" ),
+  ARGPARSE_c (aVerifyManifest, "verify-manifest" , "@" ),
   ARGPARSE_c (aListKeys, "list-keys", N_("list keys")),
   ARGPARSE_c (aListKeys, "list-public-keys", "@" ),
   ARGPARSE_c (aListSigs, "list-sigs", N_("list keys and signatures")),
@@ -701,6 +707,11 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_s_n (oNoSigCreateCheck,   "no-sig-create-check", "@"),
   ARGPARSE_s_n (oAutoCheckTrustDB, "auto-check-trustdb", "@"),
   ARGPARSE_s_n (oNoAutoCheckTrustDB, "no-auto-check-trustdb", "@"),
+  ARGPARSE_s_u (oTrustDBCacheSize, "trustdb-cache-size", "@"),
+  ARGPARSE_s_n (oTrustDBMmap, "trustdb-mmap",
+                N_("map the trustdb into memory"
+                   " (gpg dies if the file gets truncated)")),
+  ARGPARSE_s_u (oKeyCacheSize, "key-cache-size", "@"),
   ARGPARSE_s_n (oMergeOnly,	  "merge-only", "@" ),
   ARGPARSE_s_n (oAllowSecretKeyImport, "allow-secret-key-import", "@"),
   ARGPARSE_s_n (oTryAllSecrets,  "try-all-secrets", "@"),
@@ -1963,6 +1974,9 @@ main (int argc, char **argv)
     /* Use our own logging handler for Libcgrypt.  */
     setup_libgcrypt_logging ();
 
+    /* The keybox library shall use Libgcrypt's allocators.  */
+    keybox_set_malloc_hooks (gcry_malloc, gcry_realloc, gcry_free);
+
     /* Put random number into secure memory */
     gcry_control (GCRYCTL_USE_SECURE_RNDPOOL);
 
@@ -2211,6 +2225,7 @@ main (int argc, char **argv)
 
 	  case aVerifyFiles: multifile=1; /* fall through */
 	  case aVerify: set_cmd( &cmd, aVerify); break;
+	  case aVerifyManifest: set_cmd (&cmd, aVerifyManifest); break;
 
           case aServer:
             set_cmd (&cmd, pargs.r_opt);
@@ -2852,6 +2867,11 @@ main (int argc, char **argv)
           case oNoExpensiveTrustChecks: opt.no_expensive_trust_checks=1; break;
           case oAutoCheckTrustDB: opt.no_auto_check_trustdb=0; break;
           case oNoAutoCheckTrustDB: opt.no_auto_check_trustdb=1; break;
+	  case oTrustDBCacheSize:
+            opt.trustdb_cache_size = pargs.r.ret_ulong;
+            break;
+	  case oTrustDBMmap: opt.trustdb_mmap = 1; break;
+	  case oKeyCacheSize: opt.key_cache_size = pargs.r.ret_ulong; break;
           case oPreservePermissions: opt.preserve_permissions=1; break;
           case oDefaultPreferenceList:
 	    opt.def_preference_list = pargs.r.ret_str;
@@ -3447,6 +3467,11 @@ main (int argc, char **argv)
     if( rc )
 	log_error(_("failed to initialize the TrustDB: %s\n"), g10_errstr(rc));
 
+    /* The signature cache lives in the home directory as the trustdb
+       does.  */
+    if (!opt.no_sig_cache)
+      sig_cache_enable ();
+
 
     switch (cmd)
       {
@@ -3608,6 +3633,13 @@ main (int argc, char **argv)
 	  }
 	break;
 
+      case aVerifyManifest:
+	if (argc > 1)
+	  wrong_args ("--verify-manifest [manifest]");
+	if ((rc = verify_manifest (ctrl, argc? *argv : NULL)))
+	  log_error ("verify manifest failed: %s\n", g10_errstr (rc));
+	break;
+
       case aDecrypt:
         if (multifile)
 	  decrypt_messages (ctrl, argc, argv);
@@ -4107,7 +4139,10 @@ g10_exit( int rc )
     }
   if (opt.debug)
     gcry_control (GCRYCTL_DUMP_SECMEM_STATS );
+  if (DBG_CACHE)
+    getkey_print_stats ();
 
+  sig_cache_flush ();
   emergency_cleanup ();
 
   rc = rc? rc : log_get_errorcount(0)? 2 : g10_errors_seen? 1 : 0;
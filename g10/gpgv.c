@@ -50,6 +50,7 @@
 #include "status.h"
 #include "call-agent.h"
 #include "../common/init.h"
+#include "../kbx/keybox.h"
 
 
 enum cmd_and_opt_values {
@@ -62,6 +63,7 @@ enum cmd_and_opt_values {
   oStatusFD,
   oLoggerFD,
   oHomedir,
+  oVerifyManifest,
   aTest
 };
 
@@ -79,6 +81,8 @@ static ARGPARSE_OPTS opts[] = {
                 N_("|FD|write status info to this FD")),
   ARGPARSE_s_i (oLoggerFD, "logger-fd", "@"),
   ARGPARSE_s_s (oHomedir, "homedir", "@"),
+  ARGPARSE_s_s (oVerifyManifest, "verify-manifest",
+                N_("|FILE|verify all signatures listed in FILE")),
 
   ARGPARSE_end ()
 };
@@ -144,6 +148,7 @@ main( int argc, char **argv )
   strlist_t nrings = NULL;
   unsigned configlineno;
   ctrl_t ctrl;
+  const char *manifest = NULL;
 
   set_strusage (my_strusage);
   log_set_prefix ("gpgv", 1);
@@ -152,6 +157,8 @@ main( int argc, char **argv )
   i18n_init();
   init_common_subsystems (&argc, &argv);
 
+  keybox_set_malloc_hooks (gcry_malloc, gcry_realloc, gcry_free);
+
   gnupg_init_signals (0, NULL);
 
   opt.command_fd = -1; /* no command fd */
@@ -186,10 +193,14 @@ main( int argc, char **argv )
           break;
         case oHomedir: opt.homedir = pargs.r.ret_str; break;
         case oIgnoreTimeConflict: opt.ignore_time_conflict = 1; break;
+        case oVerifyManifest: manifest = pargs.r.ret_str; break;
         default : pargs.err = ARGPARSE_PRINT_ERROR; break;
 	}
     }
 
+  if (manifest && argc)
+    log_error (_("no file arguments allowed with --verify-manifest\n"));
+
   if (log_get_errorcount (0))
     g10_exit(2);
 
@@ -206,7 +217,12 @@ main( int argc, char **argv )
 
   ctrl = xcalloc (1, sizeof *ctrl);
 
-  if ((rc = verify_signatures (ctrl, argc, argv)))
+  if (manifest)
+    {
+      if ((rc = verify_manifest (ctrl, manifest)))
+        log_error ("verify manifest failed: %s\n", g10_errstr (rc));
+    }
+  else if ((rc = verify_signatures (ctrl, argc, argv)))
     log_error("verify signatures failed: %s\n", g10_errstr(rc) );
 
   xfree (ctrl);
@@ -73,6 +73,8 @@ static int import_secret_one (ctrl_t ctrl, const char *fname, KBNODE keyblock,
                               struct stats_s *stats, unsigned int options);
 static int import_revoke_cert( const char *fname, KBNODE node,
                                struct stats_s *stats);
+static void take_sig_cache (KBNODE keyblock, KBNODE keyblock_orig,
+                            u32 *keyid);
 static int chk_self_sigs( const char *fname, KBNODE keyblock,
 			  PKT_public_key *pk, u32 *keyid, int *non_self );
 static int delete_inv_parts( const char *fname, KBNODE keyblock,
@@ -171,10 +173,17 @@ import_keys_internal (ctrl_t ctrl, iobuf_t inp, char **fnames, int nnames,
 {
     int i, rc = 0;
     struct stats_s *stats = stats_handle;
+    int in_transaction = 0;
+    gpg_error_t err;
 
     if (!stats)
         stats = import_new_stats_handle ();
 
+    /* Collect all changes to the keyrings and write them at the end
+       instead of rewriting the keyring for each key.  */
+    if (!opt.dry_run)
+      in_transaction = !keydb_begin_transaction ();
+
     if (inp) {
       rc = import (ctrl, inp, "[stream]", stats, fpr, fpr_len, options);
     }
@@ -210,6 +219,15 @@ import_keys_internal (ctrl_t ctrl, iobuf_t inp, char **fnames, int nnames,
 	        break;
 	}
     }
+    if (in_transaction) {
+        err = keydb_commit_transaction ();
+        if (err) {
+            log_error ("keydb_commit_transaction failed: %s\n",
+                       gpg_strerror (err));
+            if (!rc)
+                rc = err;
+        }
+    }
     if (!stats_handle) {
         import_print_stats (stats);
         import_release_stats_handle (stats);
@@ -783,9 +801,11 @@ import_one (ctrl_t ctrl,
 	    int from_sk )
 {
     PKT_public_key *pk;
-    PKT_public_key *pk_orig;
+    PKT_public_key *pk_orig = NULL;
     KBNODE node, uidnode;
     KBNODE keyblock_orig = NULL;
+    KEYDB_HANDLE orig_hd;
+    int orig_located, orig_rc;
     u32 keyid[2];
     int rc = 0;
     int new_key = 0;
@@ -837,6 +857,29 @@ import_one (ctrl_t ctrl,
 
     collapse_uids(&keyblock);
 
+    /* Read our copy of the key, if we have one.  This is done only
+       once: it is used to take over the status of signatures we
+       already verified and later to merge the new key into it.  */
+    orig_hd = keydb_new ();
+    {
+        byte afp[MAX_FINGERPRINT_LEN];
+        size_t an;
+
+        fingerprint_from_pk (pk, afp, &an);
+        while (an < MAX_FINGERPRINT_LEN)
+            afp[an++] = 0;
+        rc = keydb_search_fpr (orig_hd, afp);
+    }
+    orig_located = !rc;
+    if (orig_located)
+      rc = keydb_get_keyblock (orig_hd, &keyblock_orig);
+    orig_rc = rc;
+    rc = 0;
+
+    /* Don't verify again what we already verified for our copy.  */
+    if (keyblock_orig)
+      take_sig_cache (keyblock, keyblock_orig, keyid);
+
     /* Clean the key that we're about to import, to cut down on things
        that we have to clean later.  This has no practical impact on
        the end result, but does result in less logging which might
@@ -853,7 +896,10 @@ import_one (ctrl_t ctrl,
 
     rc = chk_self_sigs( fname, keyblock , pk, keyid, &non_self );
     if( rc )
-	return rc== -1? 0:rc;
+      {
+	rc = rc == -1? 0 : rc;
+	goto leave;
+      }
 
     /* If we allow such a thing, mark unsigned uids as valid */
     if( opt.allow_non_selfsigned_uid )
@@ -873,7 +919,7 @@ import_one (ctrl_t ctrl,
 	if( !opt.quiet )
 	  log_info(_("this may be caused by a missing self-signature\n"));
 	stats->no_user_id++;
-	return 0;
+	goto leave;
     }
 
     /* do we have this key already in one of our pubrings ? */
@@ -898,7 +944,8 @@ import_one (ctrl_t ctrl,
 	if (rc) {
 	    log_error (_("no writable keyring found: %s\n"), g10_errstr (rc));
             keydb_release (hd);
-	    return G10ERR_GENERAL;
+	    rc = G10ERR_GENERAL;
+	    goto leave;
 	}
 	if( opt.verbose > 1 )
 	    log_info (_("writing to '%s'\n"), keydb_get_resource_name (hd) );
@@ -952,25 +999,17 @@ import_one (ctrl_t ctrl,
 	    goto leave;
 	  }
 
-	/* now read the original keyblock */
-        hd = keydb_new ();
-        {
-            byte afp[MAX_FINGERPRINT_LEN];
-            size_t an;
-
-            fingerprint_from_pk (pk_orig, afp, &an);
-            while (an < MAX_FINGERPRINT_LEN)
-                afp[an++] = 0;
-            rc = keydb_search_fpr (hd, afp);
-        }
-	if( rc )
+	/* The original keyblock has already been read above.  */
+        hd = orig_hd;
+        orig_hd = NULL;
+	rc = orig_rc;
+	if (!orig_located)
 	  {
 	    log_error (_("key %s: can't locate original keyblock: %s\n"),
 		       keystr(keyid), g10_errstr(rc));
             keydb_release (hd);
 	    goto leave;
 	  }
-	rc = keydb_get_keyblock (hd, &keyblock_orig );
 	if (rc)
 	  {
 	    log_error (_("key %s: can't read original keyblock: %s\n"),
@@ -1123,6 +1162,7 @@ import_one (ctrl_t ctrl,
 
     release_kbnode( keyblock_orig );
     free_public_key( pk_orig );
+    keydb_release (orig_hd);
 
     return rc;
 }
@@ -1776,6 +1816,96 @@ import_revoke_cert( const char *fname, KBNODE node, struct stats_s *stats )
 }
 
 
+/* Return true if the signatures A and B are the same and thus have
+   the same verification status if made over the same data.  */
+static int
+same_signature_p (PKT_signature *a, PKT_signature *b)
+{
+  if (cmp_signatures (a, b)
+      || a->version != b->version
+      || a->sig_class != b->sig_class
+      || a->digest_algo != b->digest_algo
+      || a->timestamp != b->timestamp
+      || !a->hashed != !b->hashed)
+    return 0;
+  if (a->hashed
+      && (a->hashed->len != b->hashed->len
+          || memcmp (a->hashed->data, b->hashed->data, a->hashed->len)))
+    return 0;
+  return 1;
+}
+
+
+/* Return true if the nodes A and B are the same key or user ID.  */
+static int
+same_sig_context_p (KBNODE a, KBNODE b)
+{
+  if (a->pkt->pkttype != b->pkt->pkttype)
+    return 0;
+  if (a->pkt->pkttype == PKT_USER_ID)
+    return !cmp_user_ids (a->pkt->pkt.user_id, b->pkt->pkt.user_id);
+  return !cmp_public_keys (a->pkt->pkt.public_key, b->pkt->pkt.public_key);
+}
+
+
+/*
+ * Take the cached status of the self-signatures in KEYBLOCK from
+ * KEYBLOCK_ORIG, our copy of the key as read by the caller.  Only
+ * signatures which are in our copy with the same user ID or subkey
+ * are considered.  Re-importing known keys (e.g. from a keyserver
+ * dump) then does not need to verify any of their self-signatures in
+ * chk_self_sigs.
+ */
+static void
+take_sig_cache (KBNODE keyblock, KBNODE keyblock_orig, u32 *keyid)
+{
+  KBNODE node, onode, ctx, octx;
+  PKT_signature *sig, *osig;
+
+  if (opt.no_sig_cache || !same_sig_context_p (keyblock, keyblock_orig))
+    return;
+
+  ctx = keyblock;
+  for (node = keyblock->next; node; node = node->next)
+    {
+      if (node->pkt->pkttype == PKT_USER_ID
+          || node->pkt->pkttype == PKT_PUBLIC_SUBKEY)
+        {
+          ctx = node;
+          continue;
+        }
+      if (node->pkt->pkttype != PKT_SIGNATURE)
+        continue;
+      sig = node->pkt->pkt.signature;
+      if (sig->flags.checked
+          || sig->keyid[0] != keyid[0] || sig->keyid[1] != keyid[1])
+        continue;
+
+      octx = keyblock_orig;
+      for (onode = keyblock_orig->next; onode; onode = onode->next)
+        {
+          if (onode->pkt->pkttype == PKT_USER_ID
+              || onode->pkt->pkttype == PKT_PUBLIC_SUBKEY)
+            {
+              octx = onode;
+              continue;
+            }
+          if (onode->pkt->pkttype != PKT_SIGNATURE)
+            continue;
+          osig = onode->pkt->pkt.signature;
+          if (osig->flags.checked
+              && same_signature_p (sig, osig)
+              && same_sig_context_p (ctx, octx))
+            {
+              sig->flags.checked = 1;
+              sig->flags.valid = osig->flags.valid;
+              break;
+            }
+        }
+    }
+}
+
+
 /*
  * Loop over the keyblock and check all self signatures.
  * Mark all user-ids with a self-signature by setting flag bit 0.
@@ -29,7 +29,11 @@
 #include "packet.h"
 #include "keydb.h"
 
-#define USE_UNUSED_NODES 1
+/* Nodes are allocated in blocks of this many.  Keyblocks with
+   thousands of signatures would otherwise need a malloc for each
+   node.  Released nodes are kept on the UNUSED_NODES list; they are
+   never given back to the system.  */
+#define NODE_BLOCK_SIZE 256
 
 static KBNODE unused_nodes;
 
@@ -38,11 +42,17 @@ alloc_node(void)
 {
     KBNODE n;
 
+    if( !unused_nodes ) {
+	int i;
+
+	n = xmalloc( NODE_BLOCK_SIZE * sizeof *n );
+	for(i=0; i < NODE_BLOCK_SIZE - 1; i++ )
+	    n[i].next = n + i + 1;
+	n[i].next = NULL;
+	unused_nodes = n;
+    }
     n = unused_nodes;
-    if( n )
-	unused_nodes = n->next;
-    else
-	n = xmalloc( sizeof *n );
+    unused_nodes = n->next;
     n->next = NULL;
     n->pkt = NULL;
     n->flag = 0;
@@ -55,12 +65,8 @@ static void
 free_node( KBNODE n )
 {
     if( n ) {
-#if USE_UNUSED_NODES
 	n->next = unused_nodes;
 	unused_nodes = n;
-#else
-	xfree( n );
-#endif
     }
 }
 
@@ -91,15 +97,21 @@ release_kbnode( KBNODE n )
 {
     KBNODE n2;
 
-    while( n ) {
-	n2 = n->next;
-	if( !is_cloned_kbnode(n) ) {
-	    free_packet( n->pkt );
-	    xfree( n->pkt );
+    if( !n )
+	return;
+
+    /* Release the packets and then put the entire list back onto the
+       free list in one go.  */
+    for( n2 = n; ; n2 = n2->next ) {
+	if( !is_cloned_kbnode(n2) ) {
+	    free_packet( n2->pkt );
+	    xfree( n2->pkt );
 	}
-	free_node( n );
-	n = n2;
+	if( !n2->next )
+	    break;
     }
+    n2->next = unused_nodes;
+    unused_nodes = n;
 }
 
 
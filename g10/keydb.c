@@ -34,6 +34,7 @@
 #include "main.h" /*try_make_homedir ()*/
 #include "packet.h"
 #include "keyring.h"
+#include "../kbx/keybox.h"
 #include "keydb.h"
 #include "i18n.h"
 
@@ -42,7 +43,8 @@ static int active_handles;
 typedef enum
   {
     KEYDB_RESOURCE_TYPE_NONE = 0,
-    KEYDB_RESOURCE_TYPE_KEYRING
+    KEYDB_RESOURCE_TYPE_KEYRING,
+    KEYDB_RESOURCE_TYPE_KEYBOX
   } KeydbResourceType;
 #define MAX_KEYDB_RESOURCES 40
 
@@ -51,14 +53,28 @@ struct resource_item
   KeydbResourceType type;
   union {
     KEYRING_HANDLE kr;
+    KEYBOX_HANDLE kb;
   } u;
   void *token;
+  dotlock_t lockhandle;  /* Only used for keyboxes.  */
 };
 
 static struct resource_item all_resources[MAX_KEYDB_RESOURCES];
 static int used_resources;
+
+/* The state of the resource files as seen by keydb_check_changes.  */
+static struct
+{
+  off_t size;
+  time_t mtime;
+  u32 ino;
+} resource_stamps[MAX_KEYDB_RESOURCES];
 static void *primary_keyring=NULL;
 
+/* Set while keydb_begin_transaction is active.  The name indices of
+   the keyboxes are then updated only by keydb_commit_transaction.  */
+static int kb_in_transaction;
+
 struct keydb_handle
 {
   int locked;
@@ -71,14 +87,15 @@ struct keydb_handle
 
 static int lock_all (KEYDB_HANDLE hd);
 static void unlock_all (KEYDB_HANDLE hd);
+static void update_name_index (KEYBOX_HANDLE kb);
 
 
-/* Handle the creation of a keyring if it does not yet exist.  Take
-   into acount that other processes might have the keyring already
-   locked.  This lock check does not work if the directory itself is
-   not yet available. */
+/* Handle the creation of a keyring or a keybox if it does not yet
+   exist.  Take into acount that other processes might have the
+   keyring/keybox already locked.  This lock check does not work if
+   the directory itself is not yet available. */
 static int
-maybe_create_keyring (char *filename, int force)
+maybe_create_keyring_or_box (char *filename, int is_box, int force)
 {
   dotlock_t lockhd = NULL;
   IOBUF iobuf;
@@ -135,7 +152,7 @@ maybe_create_keyring (char *filename, int force)
 
   /* To avoid races with other instances of gpg trying to create or
      update the keyring (it is removed during an update for a short
-     time), we do the next stuff in a locked state. */
+     time), we do the next stuff in a locked state.  */
   lockhd = dotlock_create (filename, 0);
   if (!lockhd)
     {
@@ -180,17 +197,48 @@ maybe_create_keyring (char *filename, int force)
   if (!iobuf)
     {
       rc = gpg_error_from_syserror ();
-      log_error ( _("error creating keyring '%s': %s\n"),
-                  filename, strerror(errno));
+      if (is_box)
+        log_error (_("error creating keybox '%s': %s\n"),
+                   filename, gpg_strerror (rc));
+      else
+        log_error (_("error creating keyring '%s': %s\n"),
+                   filename, gpg_strerror (rc));
       goto leave;
     }
 
-  if (!opt.quiet)
-    log_info (_("keyring '%s' created\n"), filename);
-
   iobuf_close (iobuf);
   /* Must invalidate that ugly cache */
   iobuf_ioctl (NULL, IOBUF_IOCTL_INVALIDATE_CACHE, 0, filename);
+
+  /* A keybox starts with a header blob.  */
+  if (is_box)
+    {
+      FILE *fp = fopen (filename, "wb");
+
+      if (!fp)
+        rc = gpg_error_from_syserror ();
+      else
+        {
+          rc = _keybox_write_header_blob (fp);
+          if (fclose (fp) && !rc)
+            rc = gpg_error_from_syserror ();
+        }
+      if (rc)
+        {
+          log_error (_("error creating keybox '%s': %s\n"),
+                     filename, gpg_strerror (rc));
+          goto leave;
+        }
+    }
+
+  if (!opt.quiet)
+    {
+      if (is_box)
+        log_info (_("keybox '%s' created\n"), filename);
+      else
+        log_info (_("keyring '%s' created\n"), filename);
+    }
+
   rc = 0;
 
  leave:
@@ -204,9 +252,9 @@ maybe_create_keyring (char *filename, int force)
 
 
 /*
- * Register a resource (which currently may only be a keyring file).
- * The first keyring which is added by this function is
- * created if it does not exist.
+ * Register a resource (a keyring or a keybox file).  The first
+ * resource which is added by this function is created if it does not
+ * exist.
  * Note: this function may be called before secure memory is
  * available.
  * Flag 1   - Force.
@@ -230,25 +278,29 @@ keydb_add_resource (const char *url, int flags)
     force = 0;
 
   /* Do we have an URL?
-   *	gnupg-ring:filename  := this is a plain keyring
-   *	filename := See what is is, but create as plain keyring.
+   *	gnupg-ring:filename  := this is a plain keyring.
+   *	gnupg-kbx:filename   := this is a keybox file.
+   *	filename := See what is is, but create as plain keyring unless
+   *	            the name ends in ".kbx".
    */
-  if (strlen (resname) > 11)
+  if (strlen (resname) > 11 && !strncmp( resname, "gnupg-ring:", 11) )
     {
-      if (!strncmp( resname, "gnupg-ring:", 11) )
-        {
-          rt = KEYDB_RESOURCE_TYPE_KEYRING;
-          resname += 11;
-	}
+      rt = KEYDB_RESOURCE_TYPE_KEYRING;
+      resname += 11;
+    }
+  else if (strlen (resname) > 10 && !strncmp (resname, "gnupg-kbx:", 10) )
+    {
+      rt = KEYDB_RESOURCE_TYPE_KEYBOX;
+      resname += 10;
+    }
 #if !defined(HAVE_DRIVE_LETTERS) && !defined(__riscos__)
-      else if (strchr (resname, ':'))
-        {
-          log_error ("invalid key resource URL '%s'\n", url );
-          rc = gpg_error (GPG_ERR_GENERAL);
-          goto leave;
-        }
-#endif /* !HAVE_DRIVE_LETTERS && !__riscos__ */
+  else if (strlen (resname) > 11 && strchr (resname, ':'))
+    {
+      log_error ("invalid key resource URL '%s'\n", url );
+      rc = gpg_error (GPG_ERR_GENERAL);
+      goto leave;
     }
+#endif /* !HAVE_DRIVE_LETTERS && !__riscos__ */
 
   if (*resname != DIRSEP_C )
     {
@@ -272,11 +324,19 @@ keydb_add_resource (const char *url, int flags)
       if (fp)
         {
           u32 magic;
+          unsigned char verbuf[12];
+          size_t nread;
 
-          if (fread( &magic, 4, 1, fp) == 1 )
+          nread = fread (verbuf, 1, sizeof verbuf, fp);
+          if (nread >= 4)
             {
+              memcpy (&magic, verbuf, 4);
               if (magic == 0x13579ace || magic == 0xce9a5713)
                 ; /* GDBM magic - not anymore supported. */
+              else if (nread == sizeof verbuf
+                       && verbuf[4] == 1 /* Header blob.  */
+                       && !memcmp (verbuf+8, "KBXf", 4))
+                rt = KEYDB_RESOURCE_TYPE_KEYBOX;
               else
                 rt = KEYDB_RESOURCE_TYPE_KEYRING;
 	    }
@@ -285,8 +345,15 @@ keydb_add_resource (const char *url, int flags)
 
           fclose( fp );
 	}
-      else /* No file yet: create keyring.  */
-        rt = KEYDB_RESOURCE_TYPE_KEYRING;
+      else /* No file yet: create keybox or keyring.  */
+        {
+          size_t n = strlen (filename);
+
+          if (n > 4 && !strcmp (filename + n - 4, ".kbx"))
+            rt = KEYDB_RESOURCE_TYPE_KEYBOX;
+          else
+            rt = KEYDB_RESOURCE_TYPE_KEYRING;
+        }
     }
 
   switch (rt)
@@ -297,7 +364,7 @@ keydb_add_resource (const char *url, int flags)
       goto leave;
 
     case KEYDB_RESOURCE_TYPE_KEYRING:
-      rc = maybe_create_keyring (filename, force);
+      rc = maybe_create_keyring_or_box (filename, 0, force);
       if (rc)
         goto leave;
 
@@ -312,6 +379,7 @@ keydb_add_resource (const char *url, int flags)
               all_resources[used_resources].type = rt;
               all_resources[used_resources].u.kr = NULL; /* Not used here */
               all_resources[used_resources].token = token;
+              all_resources[used_resources].lockhandle = NULL;
               used_resources++;
             }
         }
@@ -325,6 +393,63 @@ keydb_add_resource (const char *url, int flags)
         }
       break;
 
+    case KEYDB_RESOURCE_TYPE_KEYBOX:
+      {
+        rc = maybe_create_keyring_or_box (filename, 1, force);
+        if (rc)
+          goto leave;
+
+        if (read_only)
+          log_info ("read-only keyboxes are not yet supported;"
+                    " '%s' will be opened read-write\n", filename);
+
+        token = keybox_register_file (filename, 0);
+        if (token)
+          {
+            if (used_resources >= MAX_KEYDB_RESOURCES)
+              rc = gpg_error (GPG_ERR_RESOURCE_LIMIT);
+            else
+              {
+                if (flags&2)
+                  primary_keyring = token;
+                all_resources[used_resources].type = rt;
+                all_resources[used_resources].u.kb = NULL; /* Not used here */
+                all_resources[used_resources].token = token;
+                all_resources[used_resources].lockhandle
+                  = dotlock_create (filename, 0);
+                if (!all_resources[used_resources].lockhandle)
+                  log_fatal ( _("can't create lock for '%s'\n"), filename);
+
+                /* Do a compress run if needed and the file is not
+                   locked.  */
+                if (!dotlock_take (all_resources[used_resources].lockhandle,
+                                   0))
+                  {
+                    KEYBOX_HANDLE kbxhd = keybox_new (token, 0);
+
+                    if (kbxhd)
+                      {
+                        keybox_compress (kbxhd);
+                        keybox_release (kbxhd);
+                      }
+                    dotlock_release
+                      (all_resources[used_resources].lockhandle);
+                  }
+
+                used_resources++;
+              }
+          }
+        else
+          {
+            /* Already registered.  We will mark it as the primary key
+               if requested.  */
+            /* FIXME: How to do that?  Change the keybox interface?  */
+            /* if (flags&2) */
+            /*   primary_keyring = token; */
+          }
+      }
+      break;
+
       default:
 	log_error ("resource type of '%s' not supported\n", url);
 	rc = gpg_error (GPG_ERR_GENERAL);
@@ -371,6 +496,19 @@ keydb_new (void)
           }
           j++;
           break;
+        case KEYDB_RESOURCE_TYPE_KEYBOX:
+          hd->active[j].type   = all_resources[i].type;
+          hd->active[j].token  = all_resources[i].token;
+          hd->active[j].lockhandle = all_resources[i].lockhandle;
+          hd->active[j].u.kb   = keybox_new_openpgp (all_resources[i].token,
+                                                     0);
+          if (!hd->active[j].u.kb)
+            {
+              xfree (hd);
+              return NULL; /* fixme: release all previously allocated handles*/
+            }
+          j++;
+          break;
         }
     }
   hd->used = j;
@@ -399,6 +537,9 @@ keydb_release (KEYDB_HANDLE hd)
         case KEYDB_RESOURCE_TYPE_KEYRING:
           keyring_release (hd->active[i].u.kr);
           break;
+        case KEYDB_RESOURCE_TYPE_KEYBOX:
+          keybox_release (hd->active[i].u.kb);
+          break;
         }
     }
 
@@ -438,6 +579,9 @@ keydb_get_resource_name (KEYDB_HANDLE hd)
     case KEYDB_RESOURCE_TYPE_KEYRING:
       s = keyring_get_resource_name (hd->active[idx].u.kr);
       break;
+    case KEYDB_RESOURCE_TYPE_KEYBOX:
+      s = keybox_get_resource_name (hd->active[idx].u.kb);
+      break;
     }
 
   return s? s: "";
@@ -459,6 +603,11 @@ lock_all (KEYDB_HANDLE hd)
         case KEYDB_RESOURCE_TYPE_KEYRING:
           rc = keyring_lock (hd->active[i].u.kr, 1);
           break;
+        case KEYDB_RESOURCE_TYPE_KEYBOX:
+          if (hd->active[i].lockhandle
+              && dotlock_take (hd->active[i].lockhandle, -1))
+            rc = gpg_error (GPG_ERR_NOT_LOCKED);
+          break;
         }
     }
 
@@ -474,6 +623,10 @@ lock_all (KEYDB_HANDLE hd)
             case KEYDB_RESOURCE_TYPE_KEYRING:
               keyring_lock (hd->active[i].u.kr, 0);
               break;
+            case KEYDB_RESOURCE_TYPE_KEYBOX:
+              if (hd->active[i].lockhandle)
+                dotlock_release (hd->active[i].lockhandle);
+              break;
             }
         }
     }
@@ -501,12 +654,194 @@ unlock_all (KEYDB_HANDLE hd)
         case KEYDB_RESOURCE_TYPE_KEYRING:
           keyring_lock (hd->active[i].u.kr, 0);
           break;
+        case KEYDB_RESOURCE_TYPE_KEYBOX:
+          /* Updates and deletions leave the old blobs in the keybox;
+             reclaim the space while we still hold the lock if there
+             is too much of it.  */
+          keybox_compress (hd->active[i].u.kb);
+          if (!kb_in_transaction)
+            update_name_index (hd->active[i].u.kb);
+          if (hd->active[i].lockhandle)
+            dotlock_release (hd->active[i].lockhandle);
+          break;
         }
     }
   hd->locked = 0;
 }
 
 
+/* Rebuild the name index of the keybox KB if it has one and the
+   keybox has been changed.  The caller must hold the lock.  */
+static void
+update_name_index (KEYBOX_HANDLE kb)
+{
+  gpg_error_t err;
+
+  err = keybox_update_name_index (kb);
+  if (err)
+    log_info (_("error updating the name index of '%s': %s\n"),
+              keybox_get_resource_name (kb), gpg_strerror (err));
+}
+
+
+static gpg_error_t
+parse_keyblock_image (iobuf_t iobuf, int pk_no, int uid_no,
+                      const u32 *sigstatus, kbnode_t *r_keyblock)
+{
+  gpg_error_t err;
+  PACKET *pkt;
+  kbnode_t keyblock = NULL;
+  kbnode_t node;
+  int in_cert, save_mode, save_lazy;
+  u32 n_sigs;
+  int pk_count, uid_count;
+
+  *r_keyblock = NULL;
+
+  pkt = xtrymalloc (sizeof *pkt);
+  if (!pkt)
+    return gpg_error_from_syserror ();
+  init_packet (pkt);
+  save_mode = set_packet_list_mode (0);
+  save_lazy = set_lazy_sig_mode (1);
+  in_cert = 0;
+  n_sigs = 0;
+  pk_count = uid_count = 0;
+  while ((err = parse_packet (iobuf, pkt)) != -1)
+    {
+      if (gpg_err_code (err) == GPG_ERR_UNKNOWN_PACKET)
+        {
+          free_packet (pkt);
+          init_packet (pkt);
+          continue;
+	}
+      if (err)
+        {
+          log_error ("parse_keyblock_image: read error: %s\n",
+                     gpg_strerror (err));
+          err = gpg_error (GPG_ERR_INV_KEYRING);
+          break;
+        }
+      if (pkt->pkttype == PKT_COMPRESSED)
+        {
+          log_error ("skipped compressed packet in keybox blob\n");
+          free_packet(pkt);
+          init_packet(pkt);
+          continue;
+        }
+      if (pkt->pkttype == PKT_RING_TRUST)
+        {
+          log_info ("skipped ring trust packet in keybox blob\n");
+          free_packet(pkt);
+          init_packet(pkt);
+          continue;
+        }
+
+      if (!in_cert && pkt->pkttype != PKT_PUBLIC_KEY)
+        {
+          log_error ("parse_keyblock_image: first packet in a keybox blob "
+                     "is not a public key packet\n");
+          err = gpg_error (GPG_ERR_INV_KEYRING);
+          break;
+        }
+      if (in_cert && (pkt->pkttype == PKT_PUBLIC_KEY
+                      || pkt->pkttype == PKT_SECRET_KEY))
+        {
+          log_error ("parse_keyblock_image: "
+                     "multiple keyblocks in a keybox blob\n");
+          err = gpg_error (GPG_ERR_INV_KEYRING);
+          break;
+        }
+      in_cert = 1;
+
+      if (pkt->pkttype == PKT_SIGNATURE && sigstatus)
+        {
+          PKT_signature *sig = pkt->pkt.signature;
+
+          n_sigs++;
+          if (n_sigs > sigstatus[0])
+            {
+              log_error ("parse_keyblock_image: "
+                         "more signatures than found in the meta data\n");
+              err = gpg_error (GPG_ERR_INV_KEYRING);
+              break;
+
+            }
+          if (sigstatus[n_sigs])
+            {
+              sig->flags.checked = 1;
+              if (sigstatus[n_sigs] == 1 )
+                ; /* missing key */
+              else if (sigstatus[n_sigs] == 2 )
+                ; /* bad signature */
+              else if (sigstatus[n_sigs] < 0x10000000)
+                ; /* bad flag */
+              else
+                {
+                  sig->flags.valid = 1;
+                  /* Fixme: Shall we set the expired flag here?  */
+                }
+            }
+        }
+
+      node = new_kbnode (pkt);
+
+      switch (pkt->pkttype)
+        {
+        case PKT_PUBLIC_KEY:
+        case PKT_PUBLIC_SUBKEY:
+        case PKT_SECRET_KEY:
+        case PKT_SECRET_SUBKEY:
+          if (++pk_count == pk_no)
+            node->flag |= 1;
+          break;
+
+        case PKT_USER_ID:
+          if (++uid_count == uid_no)
+            node->flag |= 2;
+          break;
+
+        default:
+          break;
+        }
+
+      if (!keyblock)
+        keyblock = node;
+      else
+        add_kbnode (keyblock, node);
+      pkt = xtrymalloc (sizeof *pkt);
+      if (!pkt)
+        {
+          err = gpg_error_from_syserror ();
+          break;
+        }
+      init_packet (pkt);
+    }
+  set_lazy_sig_mode (save_lazy);
+  set_packet_list_mode (save_mode);
+
+  if (err == -1 && keyblock)
+    err = 0; /* Got the entire keyblock.  */
+
+  if (!err && sigstatus && n_sigs != sigstatus[0])
+    {
+      log_error ("parse_keyblock_image: signature count does not match\n");
+      err = gpg_error (GPG_ERR_INV_KEYRING);
+    }
+
+  if (err)
+    release_kbnode (keyblock);
+  else
+    *r_keyblock = keyblock;
+  if (pkt)
+    {
+      free_packet (pkt);
+      xfree (pkt);
+    }
+  return err;
+}
+
+
 /*
  * Return the last found keyring.  Caller must free it.
  * The returned keyblock has the kbode flag bit 0 set for the node with
@@ -532,11 +867,111 @@ keydb_get_keyblock (KEYDB_HANDLE hd, KBNODE *ret_kb)
     case KEYDB_RESOURCE_TYPE_KEYRING:
       err = keyring_get_keyblock (hd->active[hd->found].u.kr, ret_kb);
       break;
+    case KEYDB_RESOURCE_TYPE_KEYBOX:
+      {
+        iobuf_t iobuf;
+        u32 *sigstatus;
+        int pk_no, uid_no;
+
+        err = keybox_get_keyblock (hd->active[hd->found].u.kb,
+                                   &iobuf, &pk_no, &uid_no, &sigstatus);
+        if (!err)
+          {
+            err = parse_keyblock_image (iobuf, pk_no, uid_no, sigstatus,
+                                        ret_kb);
+            xfree (sigstatus);
+            iobuf_close (iobuf);
+          }
+      }
+      break;
     }
 
   return err;
 }
 
+/* Build a keyblock image from KEYBLOCK.  Returns 0 on success and
+   only then stores a new iobuf object at R_IOBUF and a signature
+   status vector at R_SIGSTATUS.  */
+static gpg_error_t
+build_keyblock_image (kbnode_t keyblock, iobuf_t *r_iobuf, u32 **r_sigstatus)
+{
+  gpg_error_t err;
+  iobuf_t iobuf;
+  kbnode_t kbctx, node;
+  u32 n_sigs;
+  u32 *sigstatus;
+
+  *r_iobuf = NULL;
+  *r_sigstatus = NULL;
+
+  /* Allocate a vector for the signature cache.  This is an array of
+     u32 values with the first value giving the number of elements to
+     follow and each element descriping the cache status of the
+     signature.  */
+  for (kbctx=NULL, n_sigs=0; (node = walk_kbnode (keyblock, &kbctx, 0));)
+    if (node->pkt->pkttype == PKT_SIGNATURE)
+      n_sigs++;
+  sigstatus = xtrycalloc (1+n_sigs, sizeof *sigstatus);
+  if (!sigstatus)
+    return gpg_error_from_syserror ();
+
+  iobuf = iobuf_temp ();
+  for (kbctx = NULL, n_sigs = 0; (node = walk_kbnode (keyblock, &kbctx, 0));)
+    {
+      /* Make sure to use only packets valid on a keyblock.  */
+      switch (node->pkt->pkttype)
+        {
+        case PKT_PUBLIC_KEY:
+        case PKT_PUBLIC_SUBKEY:
+        case PKT_SIGNATURE:
+        case PKT_USER_ID:
+        case PKT_ATTRIBUTE:
+          /* Note that we don't want the ring trust packets.  They are
+             not useful. */
+          break;
+        default:
+          continue;
+        }
+
+      err = build_packet (iobuf, node->pkt);
+      if (err)
+        {
+          iobuf_close (iobuf);
+          xfree (sigstatus);
+          return err;
+        }
+
+      /* Build signature status vector.  */
+      if (node->pkt->pkttype == PKT_SIGNATURE)
+        {
+          PKT_signature *sig = node->pkt->pkt.signature;
+
+          n_sigs++;
+          /* Fixme: Detect the "missing key" status.  */
+          if (sig->flags.checked)
+            {
+              if (sig->flags.valid)
+                {
+                  if (!sig->expiredate)
+                    sigstatus[n_sigs] = 0xffffffff;
+                  else if (sig->expiredate < 0x10000000)
+                    sigstatus[n_sigs] = 0x10000000;
+                  else
+                    sigstatus[n_sigs] = sig->expiredate;
+                }
+              else
+                sigstatus[n_sigs] = 0x00000002; /* Bad signature.  */
+            }
+        }
+    }
+  sigstatus[0] = n_sigs;
+
+  *r_iobuf = iobuf;
+  *r_sigstatus = sigstatus;
+  return 0;
+}
+
+
 /*
  * Update the current keyblock with the keyblock KB
  */
@@ -566,6 +1001,23 @@ keydb_update_keyblock (KEYDB_HANDLE hd, kbnode_t kb)
     case KEYDB_RESOURCE_TYPE_KEYRING:
       rc = keyring_update_keyblock (hd->active[hd->found].u.kr, kb);
       break;
+    case KEYDB_RESOURCE_TYPE_KEYBOX:
+      {
+        iobuf_t iobuf;
+        u32 *sigstatus;
+
+        rc = build_keyblock_image (kb, &iobuf, &sigstatus);
+        if (!rc)
+          {
+            rc = keybox_update_keyblock (hd->active[hd->found].u.kb,
+                                         iobuf_get_temp_buffer (iobuf),
+                                         iobuf_get_temp_length (iobuf),
+                                         sigstatus);
+            xfree (sigstatus);
+            iobuf_close (iobuf);
+          }
+      }
+      break;
     }
 
   unlock_all (hd);
@@ -607,6 +1059,26 @@ keydb_insert_keyblock (KEYDB_HANDLE hd, kbnode_t kb)
     case KEYDB_RESOURCE_TYPE_KEYRING:
       rc = keyring_insert_keyblock (hd->active[idx].u.kr, kb);
       break;
+    case KEYDB_RESOURCE_TYPE_KEYBOX:
+      { /* We need to turn our kbnode_t list of packets into a proper
+           keyblock first.  This is required by the OpenPGP key parser
+           included in the keybox code.  Eventually we can change this
+           kludge to have the caller pass the image.  */
+        iobuf_t iobuf;
+        u32 *sigstatus;
+
+        rc = build_keyblock_image (kb, &iobuf, &sigstatus);
+        if (!rc)
+          {
+            rc = keybox_insert_keyblock (hd->active[idx].u.kb,
+                                         iobuf_get_temp_buffer (iobuf),
+                                         iobuf_get_temp_length (iobuf),
+                                         sigstatus);
+            xfree (sigstatus);
+            iobuf_close (iobuf);
+          }
+      }
+      break;
     }
 
   unlock_all (hd);
@@ -643,6 +1115,9 @@ keydb_delete_keyblock (KEYDB_HANDLE hd)
     case KEYDB_RESOURCE_TYPE_KEYRING:
       rc = keyring_delete_keyblock (hd->active[hd->found].u.kr);
       break;
+    case KEYDB_RESOURCE_TYPE_KEYBOX:
+      rc = keybox_delete (hd->active[hd->found].u.kb);
+      break;
     }
 
   unlock_all (hd);
@@ -651,6 +1126,68 @@ keydb_delete_keyblock (KEYDB_HANDLE hd)
 
 
 
+/*
+ * Start a transaction.  Until keydb_commit_transaction is called,
+ * changes to keyrings are kept in memory and the keyrings stay
+ * locked.  Keyboxes are still updated in place but their name
+ * indices are rebuilt only once by keydb_commit_transaction.
+ */
+gpg_error_t
+keydb_begin_transaction (void)
+{
+  gpg_error_t err = 0;
+  int i;
+
+  for (i=0; i < used_resources; i++)
+    if (all_resources[i].type == KEYDB_RESOURCE_TYPE_KEYRING)
+      {
+        err = keyring_begin_transaction ();
+        break;
+      }
+  if (!err)
+    kb_in_transaction = 1;
+  return err;
+}
+
+
+/*
+ * Write the changes made since keydb_begin_transaction and end the
+ * transaction.
+ */
+gpg_error_t
+keydb_commit_transaction (void)
+{
+  gpg_error_t err;
+  KEYBOX_HANDLE kb;
+  int i;
+
+  err = keyring_commit_transaction ();
+
+  if (kb_in_transaction)
+    {
+      kb_in_transaction = 0;
+      for (i=0; i < used_resources; i++)
+        {
+          if (all_resources[i].type != KEYDB_RESOURCE_TYPE_KEYBOX)
+            continue;
+          if (all_resources[i].lockhandle
+              && dotlock_take (all_resources[i].lockhandle, -1))
+            continue;
+          kb = keybox_new_openpgp (all_resources[i].token, 0);
+          if (kb)
+            {
+              update_name_index (kb);
+              keybox_release (kb);
+            }
+          if (all_resources[i].lockhandle)
+            dotlock_release (all_resources[i].lockhandle);
+        }
+    }
+
+  return err;
+}
+
+
 /*
  * Locate the default writable key resource, so that the next
  * operation (which is only relevant for inserts) will be done on this
@@ -677,10 +1214,14 @@ keydb_locate_writable (KEYDB_HANDLE hd, const char *reserved)
 	{
 	  if(hd->active[hd->current].token==primary_keyring)
 	    {
-	      if(keyring_is_writable (hd->active[hd->current].token))
+	      if (hd->active[hd->current].type == KEYDB_RESOURCE_TYPE_KEYBOX)
+                {
+                  if (keybox_is_writable (hd->active[hd->current].token))
+                    return 0;
+                }
+              else if(keyring_is_writable (hd->active[hd->current].token))
 		return 0;
-	      else
-		break;
+	      break;
 	    }
 	}
 
@@ -700,6 +1241,10 @@ keydb_locate_writable (KEYDB_HANDLE hd, const char *reserved)
           if (keyring_is_writable (hd->active[hd->current].token))
             return 0; /* found (hd->current is set to it) */
           break;
+        case KEYDB_RESOURCE_TYPE_KEYBOX:
+          if (keybox_is_writable (hd->active[hd->current].token))
+            return 0; /* found (hd->current is set to it) */
+          break;
         }
     }
 
@@ -716,13 +1261,17 @@ keydb_rebuild_caches (int noisy)
 
   for (i=0; i < used_resources; i++)
     {
-      if (!keyring_is_writable (all_resources[i].token))
-        continue;
       switch (all_resources[i].type)
         {
         case KEYDB_RESOURCE_TYPE_NONE: /* ignore */
           break;
+        case KEYDB_RESOURCE_TYPE_KEYBOX:
+          /* A keybox stores the signature status in its meta data,
+             there is no separate cache to rebuild.  */
+          break;
         case KEYDB_RESOURCE_TYPE_KEYRING:
+          if (!keyring_is_writable (all_resources[i].token))
+            continue;
           rc = keyring_rebuild_cache (all_resources[i].token,noisy);
           if (rc)
             log_error (_("failed to rebuild keyring cache: %s\n"),
@@ -734,6 +1283,59 @@ keydb_rebuild_caches (int noisy)
 
 
 
+/*
+ * Check whether one of the key resources has been changed since the
+ * last call, for example by another process, and flush the caches
+ * which depend on their contents in that case.  Returns true if the
+ * caches have been flushed.  This is used by the server before each
+ * command.
+ */
+int
+keydb_check_changes (void)
+{
+  KEYDB_HANDLE hd;
+  const char *fname;
+  struct stat st;
+  int i, changed = 0;
+
+  hd = keydb_new ();
+  if (!hd)
+    return 0;
+  for (i=0; i < hd->used; i++)
+    {
+      switch (hd->active[i].type)
+        {
+        case KEYDB_RESOURCE_TYPE_KEYRING:
+          fname = keyring_get_resource_name (hd->active[i].u.kr);
+          break;
+        case KEYDB_RESOURCE_TYPE_KEYBOX:
+          fname = keybox_get_resource_name (hd->active[i].u.kb);
+          break;
+        default:
+          fname = NULL;
+          break;
+        }
+      if (!fname || stat (fname, &st))
+        memset (&st, 0, sizeof st);
+      if (resource_stamps[i].size != st.st_size
+          || resource_stamps[i].mtime != st.st_mtime
+          || resource_stamps[i].ino != (u32)st.st_ino)
+        {
+          resource_stamps[i].size = st.st_size;
+          resource_stamps[i].mtime = st.st_mtime;
+          resource_stamps[i].ino = (u32)st.st_ino;
+          changed = 1;
+        }
+    }
+  keydb_release (hd);
+
+  if (changed)
+    keyring_flush_caches ();
+  return changed;
+}
+
+
+
 /*
  * Start the next search on this handle right at the beginning
  */
@@ -758,6 +1360,9 @@ keydb_search_reset (KEYDB_HANDLE hd)
         case KEYDB_RESOURCE_TYPE_KEYRING:
           rc = keyring_search_reset (hd->active[i].u.kr);
           break;
+        case KEYDB_RESOURCE_TYPE_KEYBOX:
+          rc = keybox_search_reset (hd->active[i].u.kb);
+          break;
         }
     }
   return rc;
@@ -792,6 +1397,10 @@ keydb_search2 (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
           rc = keyring_search (hd->active[hd->current].u.kr, desc,
                                ndesc, descindex);
           break;
+        case KEYDB_RESOURCE_TYPE_KEYBOX:
+          rc = keybox_search (hd->active[hd->current].u.kb, desc,
+                              ndesc, descindex);
+          break;
         }
       if (rc == -1 || gpg_err_code (rc) == GPG_ERR_EOF)
         {
@@ -808,6 +1417,181 @@ keydb_search2 (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
 }
 
 
+/*
+ * Search all keydb resources from the start for the keyblocks
+ * matching any of the NDESC descriptions in DESC, using a single pass
+ * over the resources.  For each matching keyblock and each
+ * description it matches, CB is called with OPAQUE, the index of the
+ * description, and a freshly read copy of the keyblock which is then
+ * owned by CB.  The node flags of that copy are set as if the
+ * keyblock had been found by a search for just that description.
+ * The skip functions of the descriptions are honored individually.
+ * The mode of the descriptions may not be FIRST or NEXT.  If CB
+ * returns an error the search is stopped and that error returned.
+ * Finding nothing is not an error.
+ */
+gpg_error_t
+keydb_search_batch (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc, size_t ndesc,
+                    gpg_error_t (*cb)(void *opaque, size_t descindex,
+                                      kbnode_t keyblock),
+                    void *opaque)
+{
+  gpg_error_t err;
+  KEYDB_SEARCH_DESC *plain;
+  size_t n, descindex;
+  kbnode_t keyblock, node;
+  int fresh;
+  u32 kid[2];
+  PKT_user_id *uid;
+
+  if (!hd || !desc || !ndesc || !cb)
+    return gpg_error (GPG_ERR_INV_ARG);
+
+  /* The search itself is done without the skip functions; otherwise
+     a keyblock would be skipped for all descriptions as soon as one
+     of them rejected the key or user ID it matched.  */
+  plain = xtrycalloc (ndesc, sizeof *plain);
+  if (!plain)
+    return gpg_error_from_syserror ();
+  for (n=0; n < ndesc; n++)
+    {
+      if (desc[n].mode == KEYDB_SEARCH_MODE_FIRST
+          || desc[n].mode == KEYDB_SEARCH_MODE_NEXT)
+        {
+          xfree (plain);
+          return gpg_error (GPG_ERR_INV_ARG);
+        }
+      plain[n] = desc[n];
+      plain[n].skipfnc = NULL;
+      plain[n].skipfncvalue = NULL;
+    }
+
+  keyblock = NULL;
+  err = keydb_search_reset (hd);
+  while (!err && !(err = keydb_search2 (hd, plain, ndesc, &descindex)))
+    {
+      fresh = 0;
+      for (n=0; n < ndesc; n++)
+        {
+          if (n == descindex && keyblock && !fresh)
+            {
+              /* The flags have been changed by a test of another
+                 description; get the keyblock as found again.  */
+              release_kbnode (keyblock);
+              keyblock = NULL;
+            }
+          if (!keyblock)
+            {
+              err = keydb_get_keyblock (hd, &keyblock);
+              if (err)
+                {
+                  log_error ("keydb_get_keyblock failed: %s\n",
+                             gpg_strerror (err));
+                  goto leave;
+                }
+              fresh = 1;
+            }
+
+          if (n == descindex)
+            {
+              /* The flags are those set by the search.  */
+              keyid_from_pk (keyblock->pkt->pkt.public_key, kid);
+              uid = NULL;
+              for (node = keyblock; node; node = node->next)
+                if ((node->flag & 2) && node->pkt->pkttype == PKT_USER_ID)
+                  {
+                    uid = node->pkt->pkt.user_id;
+                    break;
+                  }
+            }
+          else
+            {
+              fresh = 0;
+              if (keyring_match_keyblock (keyblock, desc + n, kid, &uid))
+                continue;
+            }
+
+          if (desc[n].skipfnc
+              && desc[n].skipfnc (desc[n].skipfncvalue, kid, uid))
+            continue;
+
+          err = cb (opaque, n, keyblock);
+          keyblock = NULL;
+          if (err)
+            goto leave;
+        }
+      release_kbnode (keyblock);
+      keyblock = NULL;
+    }
+  if (gpg_err_code (err) == GPG_ERR_NOT_FOUND)
+    err = 0;
+
+ leave:
+  release_kbnode (keyblock);
+  xfree (plain);
+  return err;
+}
+
+
+/*
+ * Read the next keyblock of all keydb resources in their order and
+ * store it at RET_KB.  This is the same as a search with mode NEXT
+ * followed by keydb_get_keyblock but keyrings are read only once
+ * without seeking back for each keyblock.  The handle should be
+ * fresh or reset and not be used for other searches in between.
+ * Returns GPG_ERR_NOT_FOUND after the last keyblock.
+ */
+gpg_error_t
+keydb_read_next_keyblock (KEYDB_HANDLE hd, kbnode_t *ret_kb)
+{
+  gpg_error_t rc;
+  KEYDB_SEARCH_DESC desc;
+
+  if (!hd || !ret_kb)
+    return gpg_error (GPG_ERR_INV_ARG);
+
+  *ret_kb = NULL;
+  hd->found = -1;
+  rc = -1;
+  while ((rc == -1 || gpg_err_code (rc) == GPG_ERR_EOF)
+         && hd->current >= 0 && hd->current < hd->used)
+    {
+      switch (hd->active[hd->current].type)
+        {
+        case KEYDB_RESOURCE_TYPE_NONE:
+          BUG(); /* we should never see it here */
+          break;
+        case KEYDB_RESOURCE_TYPE_KEYRING:
+          rc = keyring_read_next (hd->active[hd->current].u.kr, ret_kb);
+          break;
+        case KEYDB_RESOURCE_TYPE_KEYBOX:
+          memset (&desc, 0, sizeof desc);
+          desc.mode = KEYDB_SEARCH_MODE_NEXT;
+          /* A keybox shared with gpgsm may also hold certificates;
+             skip them.  */
+          do
+            {
+              rc = keybox_search (hd->active[hd->current].u.kb,
+                                  &desc, 1, NULL);
+              if (!rc)
+                {
+                  hd->found = hd->current;
+                  rc = keydb_get_keyblock (hd, ret_kb);
+                }
+            }
+          while (gpg_err_code (rc) == GPG_ERR_WRONG_BLOB_TYPE);
+          break;
+        }
+      if (rc == -1 || gpg_err_code (rc) == GPG_ERR_EOF)
+        hd->current++;
+    }
+
+  return ((rc == -1 || gpg_err_code (rc) == GPG_ERR_EOF)
+          ? gpg_error (GPG_ERR_NOT_FOUND)
+          : rc);
+}
+
+
 gpg_error_t
 keydb_search_first (KEYDB_HANDLE hd)
 {
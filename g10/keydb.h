@@ -140,12 +140,22 @@ gpg_error_t keydb_get_keyblock (KEYDB_HANDLE hd, KBNODE *ret_kb);
 gpg_error_t keydb_update_keyblock (KEYDB_HANDLE hd, kbnode_t kb);
 gpg_error_t keydb_insert_keyblock (KEYDB_HANDLE hd, kbnode_t kb);
 gpg_error_t keydb_delete_keyblock (KEYDB_HANDLE hd);
+gpg_error_t keydb_begin_transaction (void);
+gpg_error_t keydb_commit_transaction (void);
 gpg_error_t keydb_locate_writable (KEYDB_HANDLE hd, const char *reserved);
 void keydb_rebuild_caches (int noisy);
+int keydb_check_changes (void);
 gpg_error_t keydb_search_reset (KEYDB_HANDLE hd);
 #define keydb_search(a,b,c) keydb_search2((a),(b),(c),NULL)
 gpg_error_t keydb_search2 (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
                            size_t ndesc, size_t *descindex);
+gpg_error_t keydb_search_batch (KEYDB_HANDLE hd,
+                                KEYDB_SEARCH_DESC *desc, size_t ndesc,
+                                gpg_error_t (*cb)(void *opaque,
+                                                  size_t descindex,
+                                                  kbnode_t keyblock),
+                                void *opaque);
+gpg_error_t keydb_read_next_keyblock (KEYDB_HANDLE hd, kbnode_t *ret_kb);
 gpg_error_t keydb_search_first (KEYDB_HANDLE hd);
 gpg_error_t keydb_search_next (KEYDB_HANDLE hd);
 gpg_error_t keydb_search_kid (KEYDB_HANDLE hd, u32 *kid);
@@ -202,6 +212,8 @@ char *gpg_format_keydesc (PKT_public_key *pk, int mode, int escaped);
 /*-- getkey.c --*/
 void cache_public_key( PKT_public_key *pk );
 void getkey_disable_caches(void);
+void getkey_enable_caches (void);
+void getkey_print_stats (void);
 int get_pubkey( PKT_public_key *pk, u32 *keyid );
 int get_pubkey_fast ( PKT_public_key *pk, u32 *keyid );
 KBNODE get_pubkeyblock( u32 *keyid );
@@ -213,6 +225,8 @@ int get_pubkey_bynames( GETKEY_CTX *rx, PKT_public_key *pk,
 			strlist_t names, KBNODE *ret_keyblock );
 int get_pubkey_next( GETKEY_CTX ctx, PKT_public_key *pk, KBNODE *ret_keyblock );
 void get_pubkey_end( GETKEY_CTX ctx );
+void getkey_prefetch_names (strlist_t names);
+void getkey_prefetch_release (void);
 gpg_error_t get_seckey (PKT_public_key *pk, u32 *keyid);
 int get_pubkey_byfprint( PKT_public_key *pk, const byte *fprint,
 						 size_t fprint_len );
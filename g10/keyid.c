@@ -624,6 +624,7 @@ colon_expirestr_from_sig (PKT_signature *sig)
  * Return a byte array with the fingerprint for the given PK/SK
  * The length of the array is returned in ret_len. Caller must free
  * the array or provide an array of length MAX_FINGERPRINT_LEN.
+ * The fingerprint is cached in PK, like the keyid.
  */
 byte *
 fingerprint_from_pk (PKT_public_key *pk, byte *array, size_t *ret_len)
@@ -633,7 +634,14 @@ fingerprint_from_pk (PKT_public_key *pk, byte *array, size_t *ret_len)
   size_t len, nbytes;
   int i;
 
-  if ( pk->version < 4 )
+  if ( pk->fprlen )
+    {
+      len = pk->fprlen;
+      if (!array)
+        array = xmalloc (len);
+      memcpy (array, pk->fpr, len);
+    }
+  else if ( pk->version < 4 )
     {
       if ( is_RSA(pk->pubkey_algo) )
         {
@@ -689,6 +697,11 @@ fingerprint_from_pk (PKT_public_key *pk, byte *array, size_t *ret_len)
       gcry_md_close( md);
     }
 
+  if ( !pk->fprlen )
+    {
+      memcpy (pk->fpr, array, len);
+      pk->fprlen = len;
+    }
   *ret_len = len;
   return array;
 }
@@ -436,25 +436,16 @@ list_all (int secret)
 
   hd = keydb_new ();
   if (!hd)
-    rc = gpg_error (GPG_ERR_GENERAL);
-  else
-    rc = keydb_search_first (hd);
-  if (rc)
     {
-      if (gpg_err_code (rc) != GPG_ERR_NOT_FOUND)
-	log_error ("keydb_search_first failed: %s\n", g10_errstr (rc));
+      log_error ("keydb_new failed\n");
       goto leave;
     }
 
+  /* The keyrings are read sequentially; this is faster than a search
+     for each keyblock followed by keydb_get_keyblock.  */
   lastresname = NULL;
-  do
+  while (!(rc = keydb_read_next_keyblock (hd, &keyblock)))
     {
-      rc = keydb_get_keyblock (hd, &keyblock);
-      if (rc)
-	{
-	  log_error ("keydb_get_keyblock failed: %s\n", g10_errstr (rc));
-	  goto leave;
-	}
       if (secret && agent_probe_any_secret_key (NULL, keyblock))
         ; /* Secret key listing requested but this isn't one.  */
       else
@@ -480,9 +471,8 @@ list_all (int secret)
       release_kbnode (keyblock);
       keyblock = NULL;
     }
-  while (!(rc = keydb_search_next (hd)));
-  if (rc && gpg_err_code (rc) != GPG_ERR_NOT_FOUND)
-    log_error ("keydb_search_next failed: %s\n", g10_errstr (rc));
+  if (gpg_err_code (rc) != GPG_ERR_NOT_FOUND)
+    log_error ("keydb_read_next_keyblock failed: %s\n", g10_errstr (rc));
 
   if (opt.check_sigs && !opt.with_colons)
     print_signature_stats (&stats);
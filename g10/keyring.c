@@ -48,6 +48,8 @@ struct off_item {
 
 typedef struct off_item **OffsetHashTable;
 
+struct kr_index;
+
 
 typedef struct keyring_name *KR_NAME;
 struct keyring_name
@@ -57,6 +59,8 @@ struct keyring_name
   dotlock_t lockhd;
   int is_locked;
   int did_full_scan;
+  struct kr_index *index;  /* The persistent key index or NULL.  */
+  int index_tried;         /* Set if we tried to get the index.  */
   char fname[1];
 };
 typedef struct keyring_name const * CONST_KR_NAME;
@@ -67,6 +71,32 @@ static int active_handles;
 static OffsetHashTable kr_offtbl;
 static int kr_offtbl_ready;
 
+/* A change to a keyring queued while a transaction is active.  */
+struct kr_pending
+{
+  struct kr_pending *next;
+  struct kr_pending *next_replaced; /* Next in the same slot of
+                                       kr_replaced_tbl.  */
+  CONST_KR_NAME kr;
+  off_t offset;            /* Offset of the replaced keyblock or -1 for
+                              a new keyblock.  */
+  unsigned int n_packets;  /* Number of packets of the replaced one.  */
+  KBNODE keyblock;         /* The new keyblock or NULL if deleted.  */
+  IOBUF image;             /* The new keyblock as written to the file.  */
+};
+
+/* Set while a transaction is active.  */
+static int kr_in_transaction;
+
+/* The queued changes in the order they were made.  */
+static struct kr_pending *kr_pending;
+static struct kr_pending **kr_pending_tail = &kr_pending;
+
+/* The queued changes which replace or delete a keyblock of a keyring
+   file, hashed by the offset of that keyblock.  */
+static struct kr_pending *kr_replaced_tbl[2048];
+#define KR_REPLACED_SLOT(off)  ((u32)(off) & 0x07ff)
+
 
 struct keyring_handle
 {
@@ -76,9 +106,15 @@ struct keyring_handle
     IOBUF iobuf;
     int eof;
     int error;
+    int partial;  /* Set if the index was used to skip keyblocks.  */
+    int in_pending; /* Set if the file is done and we walk the queue.  */
+    struct kr_pending *pending; /* Next queued change to look at.  */
+    PACKET *lookahead; /* First packet of the next keyblock as read
+                          by keyring_read_next.  */
   } current;
   struct {
     CONST_KR_NAME kr;
+    struct kr_pending *pending; /* Set if found in the queue.  */
     off_t offset;
     size_t pk_no;
     size_t uid_no;
@@ -94,6 +130,11 @@ struct keyring_handle
 
 static int do_copy (int mode, const char *fname, KBNODE root,
                     off_t start_offset, unsigned int n_packets );
+static int create_tmp_file (const char *template,
+                            char **r_bakfname, char **r_tmpfname, IOBUF *r_fp);
+static int rename_tmp_file (const char *bakfname, const char *tmpfname,
+                            const char *fname);
+static int write_keyblock (IOBUF fp, KBNODE keyblock);
 
 
 
@@ -106,7 +147,6 @@ new_offset_item (void)
   return k;
 }
 
-#if 0
 static void
 release_offset_items (struct off_item *k)
 {
@@ -118,7 +158,6 @@ release_offset_items (struct off_item *k)
       xfree (k);
     }
 }
-#endif
 
 static OffsetHashTable
 new_offset_hash_table (void)
@@ -129,7 +168,6 @@ new_offset_hash_table (void)
   return tbl;
 }
 
-#if 0
 static void
 release_offset_hash_table (OffsetHashTable tbl)
 {
@@ -141,7 +179,6 @@ release_offset_hash_table (OffsetHashTable tbl)
     release_offset_items (tbl[i]);
   xfree (tbl);
 }
-#endif
 
 static struct off_item *
 lookup_offset_hash_table (OffsetHashTable tbl, u32 *kid)
@@ -193,6 +230,738 @@ update_offset_hash_table_from_kb (OffsetHashTable tbl, KBNODE node, off_t off)
     }
 }
 
+
+/*
+ * The persistent key index.
+ *
+ * To avoid a full scan of a large keyring for each process, we keep
+ * a sidecar file "<keyring>.idx" which maps the fingerprints and key
+ * IDs of all primary and subkeys to the offset of their keyblock.
+ * The index is only used as long as the size, mtime and inode number
+ * of the keyring match those recorded in the index; any change to
+ * the keyring not done by us (keyring updates always create a new
+ * file) invalidates it.  The file format is (all numbers in network
+ * byte order):
+ *
+ *   byte  4  magic "GKRI"
+ *   byte  1  version (2)
+ *   byte  3  reserved
+ *   u32      number of items
+ *   u32      high part of the keyring size
+ *   u32      low part of the keyring size
+ *   u32      mtime of the keyring
+ *   u32      inode number of the keyring (low 32 bits)
+ *
+ * followed by the items, sorted by fingerprint:
+ *
+ *   byte 20  fingerprint (v3 fingerprints are padded with zeroes)
+ *   u32      high part of the key ID
+ *   u32      low part of the key ID
+ *   u32      high part of the keyblock offset
+ *   u32      low part of the keyblock offset
+ *
+ * followed by the item numbers in the order of the key IDs:
+ *
+ *   u32      item number
+ *
+ * Both orders are checked when reading the index so that it can be
+ * used without sorting it again.
+ */
+#define KR_INDEX_MAGIC       "GKRI"
+#define KR_INDEX_VERSION     2
+#define KR_INDEX_HDRLEN      28
+#define KR_INDEX_ITEMLEN     36
+
+struct kr_index_item
+{
+  byte fpr[20];
+  u32 kid[2];
+  off_t off;
+};
+
+struct kr_index
+{
+  off_t size;              /* Size of the keyring file.  */
+  u32 mtime;               /* Modification time of the keyring file.  */
+  u32 ino;                 /* Inode number of the keyring file.  */
+  size_t nitems;           /* Number of used items.  */
+  size_t allocated;        /* Number of allocated items.  */
+  struct kr_index_item *items;    /* Sorted by fingerprint.  */
+  struct kr_index_item **bykid;   /* Sorted by key ID.  */
+};
+
+
+static u32
+kr_get32 (const byte *p)
+{
+  return (((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | p[3]);
+}
+
+static void
+kr_put32 (byte *p, u32 a)
+{
+  p[0] = a >> 24;
+  p[1] = a >> 16;
+  p[2] = a >>  8;
+  p[3] = a;
+}
+
+
+static void
+release_kr_index (struct kr_index *idx)
+{
+  if (!idx)
+    return;
+  xfree (idx->items);
+  xfree (idx->bykid);
+  xfree (idx);
+}
+
+
+/* Return the name of the index file for the keyring FNAME.  */
+static char *
+kr_index_fname (const char *fname)
+{
+  char *name = xmalloc (strlen (fname) + 5);
+
+  strcpy (stpcpy (name, fname), EXTSEP_S "idx");
+  return name;
+}
+
+
+/* Fill the file identification fields of IDX from the keyring FNAME.
+   Returns 0 on success.  */
+static int
+kr_index_stat (const char *fname, struct kr_index *idx)
+{
+  struct stat st;
+
+  if (stat (fname, &st))
+    return gpg_error_from_syserror ();
+  idx->size = st.st_size;
+  idx->mtime = (u32)st.st_mtime;
+  idx->ino = (u32)st.st_ino;
+  return 0;
+}
+
+
+static int
+cmp_kr_index_fpr (const void *a_arg, const void *b_arg)
+{
+  const struct kr_index_item *a = a_arg;
+  const struct kr_index_item *b = b_arg;
+  int rc;
+
+  rc = memcmp (a->fpr, b->fpr, 20);
+  if (!rc)
+    rc = (a->off > b->off) - (a->off < b->off);
+  return rc;
+}
+
+static int
+cmp_kr_index_kid (const void *a_arg, const void *b_arg)
+{
+  const struct kr_index_item *a = *(const struct kr_index_item **)a_arg;
+  const struct kr_index_item *b = *(const struct kr_index_item **)b_arg;
+
+  if (a->kid[1] != b->kid[1])
+    return a->kid[1] > b->kid[1]? 1 : -1;
+  if (a->kid[0] != b->kid[0])
+    return a->kid[0] > b->kid[0]? 1 : -1;
+  return (a->off > b->off) - (a->off < b->off);
+}
+
+
+/* Sort the items of IDX and rebuild the key ID table.  */
+static void
+sort_kr_index (struct kr_index *idx)
+{
+  size_t n;
+
+  qsort (idx->items, idx->nitems, sizeof *idx->items, cmp_kr_index_fpr);
+  xfree (idx->bykid);
+  idx->bykid = xmalloc ((idx->nitems + 1) * sizeof *idx->bykid);
+  for (n=0; n < idx->nitems; n++)
+    idx->bykid[n] = idx->items + n;
+  qsort (idx->bykid, idx->nitems, sizeof *idx->bykid, cmp_kr_index_kid);
+}
+
+
+static void
+add_kr_index_item (struct kr_index *idx, PKT_public_key *pk, off_t off)
+{
+  struct kr_index_item *item;
+  size_t an;
+
+  if (idx->nitems == idx->allocated)
+    {
+      idx->allocated = idx->allocated? idx->allocated * 2 : 256;
+      idx->items = xrealloc (idx->items,
+                             idx->allocated * sizeof *idx->items);
+    }
+  item = idx->items + idx->nitems++;
+  fingerprint_from_pk (pk, item->fpr, &an);
+  while (an < 20)
+    item->fpr[an++] = 0;
+  keyid_from_pk (pk, item->kid);
+  item->off = off;
+}
+
+
+/* Add all keys of KEYBLOCK to IDX using OFF as their offset.  The
+   caller needs to sort the index afterwards.  */
+static void
+add_kr_index_keyblock (struct kr_index *idx, KBNODE keyblock, off_t off)
+{
+  KBNODE node;
+
+  for (node = keyblock; node; node = node->next)
+    if (node->pkt->pkttype == PKT_PUBLIC_KEY
+        || node->pkt->pkttype == PKT_PUBLIC_SUBKEY
+        || node->pkt->pkttype == PKT_SECRET_KEY
+        || node->pkt->pkttype == PKT_SECRET_SUBKEY)
+      add_kr_index_item (idx, node->pkt->pkt.public_key, off);
+}
+
+
+/* Read the index for keyring KR.  Returns NULL if there is no index
+   or it does not match the current keyring.  */
+static struct kr_index *
+read_kr_index (CONST_KR_NAME kr)
+{
+  struct kr_index *idx = NULL;
+  struct kr_index cur;
+  char *fname;
+  FILE *fp;
+  byte hdr[KR_INDEX_HDRLEN];
+  byte buf[KR_INDEX_ITEMLEN];
+  byte *seen = NULL;
+  size_t n, i, nitems;
+  off_t size;
+
+  if (kr_index_stat (kr->fname, &cur))
+    return NULL;
+
+  fname = kr_index_fname (kr->fname);
+  fp = fopen (fname, "rb");
+  if (!fp)
+    goto leave;
+  if (fread (hdr, sizeof hdr, 1, fp) != 1
+      || memcmp (hdr, KR_INDEX_MAGIC, 4) || hdr[4] != KR_INDEX_VERSION)
+    goto leave;
+  nitems = kr_get32 (hdr+8);
+  size = kr_get32 (hdr+12);
+  size = (size << 16 << 16) | kr_get32 (hdr+16);
+  if (size != cur.size
+      || kr_get32 (hdr+20) != cur.mtime
+      || kr_get32 (hdr+24) != cur.ino)
+    {
+      if (DBG_CACHE)
+        log_debug ("keyring index '%s' is stale\n", fname);
+      goto leave;
+    }
+
+  idx = xmalloc_clear (sizeof *idx);
+  *idx = cur;
+  idx->allocated = nitems + 1;
+  idx->items = xtrymalloc (idx->allocated * sizeof *idx->items);
+  if (!idx->items)
+    {
+      xfree (idx);
+      idx = NULL;
+      goto leave;
+    }
+  idx->nitems = nitems;
+  for (n=0; n < nitems; n++)
+    {
+      struct kr_index_item *item = idx->items + n;
+
+      if (fread (buf, sizeof buf, 1, fp) != 1)
+        goto bad;
+      memcpy (item->fpr, buf, 20);
+      item->kid[0] = kr_get32 (buf+20);
+      item->kid[1] = kr_get32 (buf+24);
+      item->off = kr_get32 (buf+28);
+      item->off = (item->off << 16 << 16) | kr_get32 (buf+32);
+      if (n && cmp_kr_index_fpr (item - 1, item) > 0)
+        goto bad;
+    }
+
+  idx->bykid = xtrymalloc ((nitems + 1) * sizeof *idx->bykid);
+  seen = xtrycalloc (nitems + 1, 1);
+  if (!idx->bykid || !seen)
+    goto bad;
+  for (n=0; n < nitems; n++)
+    {
+      if (fread (buf, 4, 1, fp) != 1)
+        goto bad;
+      i = kr_get32 (buf);
+      if (i >= nitems || seen[i])
+        goto bad;
+      seen[i] = 1;
+      idx->bykid[n] = idx->items + i;
+      if (n && cmp_kr_index_kid (idx->bykid + n - 1, idx->bykid + n) > 0)
+        goto bad;
+    }
+
+ leave:
+  if (fp)
+    fclose (fp);
+  xfree (seen);
+  xfree (fname);
+  return idx;
+
+ bad:
+  if (DBG_CACHE)
+    log_debug ("keyring index '%s' is corrupt\n", fname);
+  release_kr_index (idx);
+  idx = NULL;
+  goto leave;
+}
+
+
+/* Write the index IDX for keyring KR.  Errors are not fatal because
+   the index is only a cache.  */
+static void
+write_kr_index (CONST_KR_NAME kr, struct kr_index *idx)
+{
+  char *fname, *tmpfname;
+  FILE *fp;
+  byte buf[KR_INDEX_ITEMLEN];
+  size_t n;
+  mode_t oldmask;
+  int rc = 0;
+
+  if (opt.dry_run || kr->read_only)
+    return;
+
+  fname = kr_index_fname (kr->fname);
+  /* Use a process specific temporary name so that concurrent writers
+     don't clobber each other.  */
+  tmpfname = xasprintf ("%s" EXTSEP_S "%lu" EXTSEP_S "tmp",
+                        fname, (unsigned long)getpid ());
+
+  oldmask = umask (077);
+  fp = fopen (tmpfname, "wb");
+  umask (oldmask);
+  if (!fp)
+    {
+      if (opt.verbose)
+        log_info ("can't create '%s': %s\n", tmpfname, strerror (errno));
+      goto leave;
+    }
+
+  memset (buf, 0, KR_INDEX_HDRLEN);
+  memcpy (buf, KR_INDEX_MAGIC, 4);
+  buf[4] = KR_INDEX_VERSION;
+  kr_put32 (buf+8, idx->nitems);
+  kr_put32 (buf+12, (u32)(idx->size >> 16 >> 16));
+  kr_put32 (buf+16, (u32)idx->size);
+  kr_put32 (buf+20, idx->mtime);
+  kr_put32 (buf+24, idx->ino);
+  if (fwrite (buf, KR_INDEX_HDRLEN, 1, fp) != 1)
+    rc = gpg_error_from_syserror ();
+  for (n=0; !rc && n < idx->nitems; n++)
+    {
+      struct kr_index_item *item = idx->items + n;
+
+      memcpy (buf, item->fpr, 20);
+      kr_put32 (buf+20, item->kid[0]);
+      kr_put32 (buf+24, item->kid[1]);
+      kr_put32 (buf+28, (u32)(item->off >> 16 >> 16));
+      kr_put32 (buf+32, (u32)item->off);
+      if (fwrite (buf, KR_INDEX_ITEMLEN, 1, fp) != 1)
+        rc = gpg_error_from_syserror ();
+    }
+  for (n=0; !rc && n < idx->nitems; n++)
+    {
+      kr_put32 (buf, (u32)(idx->bykid[n] - idx->items));
+      if (fwrite (buf, 4, 1, fp) != 1)
+        rc = gpg_error_from_syserror ();
+    }
+  if (fclose (fp) && !rc)
+    rc = gpg_error_from_syserror ();
+  if (!rc)
+    {
+#if defined(HAVE_DOSISH_SYSTEM) || defined(__riscos__)
+      gnupg_remove (fname);
+#endif
+      if (rename (tmpfname, fname))
+        rc = gpg_error_from_syserror ();
+    }
+  if (rc)
+    {
+      if (opt.verbose)
+        log_info ("error writing keyring index '%s': %s\n",
+                  fname, gpg_strerror (rc));
+      gnupg_remove (tmpfname);
+    }
+  else if (DBG_CACHE)
+    log_debug ("keyring index '%s' written (%lu keys)\n",
+               fname, (unsigned long)idx->nitems);
+
+ leave:
+  xfree (tmpfname);
+  xfree (fname);
+}
+
+
+/* Scan the keyring KR and build a new index.  Returns NULL on
+   error.  */
+static struct kr_index *
+build_kr_index (CONST_KR_NAME kr)
+{
+  struct kr_index *idx;
+  struct kr_index after;
+  IOBUF a;
+  PACKET pkt;
+  off_t offset, main_offset = 0;
+  int rc, save_mode;
+
+  idx = xmalloc_clear (sizeof *idx);
+  if (kr_index_stat (kr->fname, idx))
+    {
+      xfree (idx);
+      return NULL;
+    }
+
+  a = iobuf_open (kr->fname);
+  if (!a)
+    {
+      xfree (idx);
+      return NULL;
+    }
+
+  init_packet (&pkt);
+  save_mode = set_packet_list_mode (0);
+  while (!(rc = search_packet (a, &pkt, &offset, 0)))
+    {
+      if (pkt.pkttype == PKT_PUBLIC_KEY || pkt.pkttype == PKT_SECRET_KEY)
+        main_offset = offset;
+      if (pkt.pkttype == PKT_PUBLIC_KEY
+          || pkt.pkttype == PKT_PUBLIC_SUBKEY
+          || pkt.pkttype == PKT_SECRET_KEY
+          || pkt.pkttype == PKT_SECRET_SUBKEY)
+        add_kr_index_item (idx, pkt.pkt.public_key, main_offset);
+      free_packet (&pkt);
+    }
+  free_packet (&pkt);
+  set_packet_list_mode (save_mode);
+  iobuf_close (a);
+
+  /* Only use the index if we read the entire keyring and nobody
+     changed it in the meantime.  */
+  if (rc != -1
+      || kr_index_stat (kr->fname, &after)
+      || after.size != idx->size
+      || after.mtime != idx->mtime
+      || after.ino != idx->ino)
+    {
+      release_kr_index (idx);
+      return NULL;
+    }
+
+  sort_kr_index (idx);
+  return idx;
+}
+
+
+/* Return the usable index for keyring KR or NULL.  The index is
+   read from disk or created on first use.  */
+static struct kr_index *
+get_kr_index (CONST_KR_NAME kr)
+{
+  KR_NAME krw = (KR_NAME)kr;
+
+  if (krw->index)
+    {
+      struct kr_index cur;
+
+      /* Make sure that the keyring has not been changed by another
+         process since we loaded the index.  */
+      if (!kr_index_stat (kr->fname, &cur)
+          && cur.size == krw->index->size
+          && cur.mtime == krw->index->mtime
+          && cur.ino == krw->index->ino)
+        return krw->index;
+      release_kr_index (krw->index);
+      krw->index = NULL;
+      krw->index_tried = 0;
+    }
+
+  if (krw->index_tried)
+    return NULL;
+  krw->index_tried = 1;
+
+  krw->index = read_kr_index (kr);
+  if (!krw->index)
+    {
+      krw->index = build_kr_index (kr);
+      if (krw->index)
+        write_kr_index (kr, krw->index);
+    }
+  return krw->index;
+}
+
+
+/* Drop the index of KR, e.g. because it turned out to be wrong.  */
+static void
+invalidate_kr_index (CONST_KR_NAME kr)
+{
+  KR_NAME krw = (KR_NAME)kr;
+  char *fname;
+
+  release_kr_index (krw->index);
+  krw->index = NULL;
+  krw->index_tried = 1;  /* Don't retry in this process.  */
+  if (!opt.dry_run && !kr->read_only)
+    {
+      fname = kr_index_fname (kr->fname);
+      gnupg_remove (fname);
+      xfree (fname);
+    }
+}
+
+
+/* Return true if DESC can be answered by the keyring index.  */
+static int
+kr_index_usable_desc (KEYDB_SEARCH_DESC *desc, size_t ndesc)
+{
+  if (ndesc != 1 || desc[0].skipfnc)
+    return 0;
+  switch (desc[0].mode)
+    {
+    case KEYDB_SEARCH_MODE_SHORT_KID:
+    case KEYDB_SEARCH_MODE_LONG_KID:
+    case KEYDB_SEARCH_MODE_FPR16:
+    case KEYDB_SEARCH_MODE_FPR20:
+    case KEYDB_SEARCH_MODE_FPR:
+      return 1;
+    default:
+      return 0;
+    }
+}
+
+
+/* Lookup DESC in IDX.  Returns 0 and stores the lowest offset of a
+   matching keyblock at R_OFF or -1 if no key matches.  */
+static int
+lookup_kr_index (struct kr_index *idx, KEYDB_SEARCH_DESC *desc, off_t *r_off)
+{
+  size_t lo, hi, mid;
+  int found = 0;
+  off_t off = 0;
+
+  if (desc->mode == KEYDB_SEARCH_MODE_SHORT_KID
+      || desc->mode == KEYDB_SEARCH_MODE_LONG_KID)
+    {
+      int longkid = (desc->mode == KEYDB_SEARCH_MODE_LONG_KID);
+
+      lo = 0;
+      hi = idx->nitems;
+      while (lo < hi)
+        {
+          mid = lo + (hi - lo) / 2;
+          if (idx->bykid[mid]->kid[1] < desc->u.kid[1])
+            lo = mid + 1;
+          else
+            hi = mid;
+        }
+      for (; lo < idx->nitems && idx->bykid[lo]->kid[1] == desc->u.kid[1];
+           lo++)
+        {
+          if (longkid && idx->bykid[lo]->kid[0] != desc->u.kid[0])
+            continue;
+          if (!found || idx->bykid[lo]->off < off)
+            off = idx->bykid[lo]->off;
+          found = 1;
+        }
+    }
+  else
+    {
+      size_t fprlen = desc->mode == KEYDB_SEARCH_MODE_FPR16? 16 : 20;
+
+      lo = 0;
+      hi = idx->nitems;
+      while (lo < hi)
+        {
+          mid = lo + (hi - lo) / 2;
+          if (memcmp (idx->items[mid].fpr, desc->u.fpr, fprlen) < 0)
+            lo = mid + 1;
+          else
+            hi = mid;
+        }
+      for (; lo < idx->nitems
+             && !memcmp (idx->items[lo].fpr, desc->u.fpr, fprlen); lo++)
+        {
+          if (!found || idx->items[lo].off < off)
+            off = idx->items[lo].off;
+          found = 1;
+        }
+    }
+
+  if (!found)
+    return -1;
+  *r_off = off;
+  return 0;
+}
+
+
+/* Check that the keyblock at OFF of keyring KR really has a key
+   matching DESC.  */
+static int
+verify_kr_index_hit (CONST_KR_NAME kr, off_t off, KEYDB_SEARCH_DESC *desc)
+{
+  IOBUF a;
+  PACKET pkt;
+  off_t pos;
+  int save_mode;
+  int first = 1;
+  int okay = 0;
+
+  a = iobuf_open (kr->fname);
+  if (!a)
+    return 0;
+  if (iobuf_seek (a, off))
+    {
+      iobuf_close (a);
+      return 0;
+    }
+
+  init_packet (&pkt);
+  save_mode = set_packet_list_mode (0);
+  while (!okay && !search_packet (a, &pkt, &pos, 0))
+    {
+      PKT_public_key *pk = pkt.pkt.public_key;
+      byte afp[MAX_FINGERPRINT_LEN];
+      size_t an;
+      u32 aki[2];
+
+      if (pkt.pkttype == PKT_PUBLIC_KEY || pkt.pkttype == PKT_SECRET_KEY)
+        {
+          if (!first)
+            break;  /* Next keyblock.  */
+          if (pos != off)
+            break;  /* Offset is not at a keyblock.  */
+          first = 0;
+        }
+      else if (first)
+        break;
+
+      fingerprint_from_pk (pk, afp, &an);
+      while (an < 20)
+        afp[an++] = 0;
+      keyid_from_pk (pk, aki);
+      switch (desc->mode)
+        {
+        case KEYDB_SEARCH_MODE_SHORT_KID:
+          okay = (desc->u.kid[1] == aki[1]);
+          break;
+        case KEYDB_SEARCH_MODE_LONG_KID:
+          okay = (desc->u.kid[0] == aki[0] && desc->u.kid[1] == aki[1]);
+          break;
+        case KEYDB_SEARCH_MODE_FPR16:
+          okay = !memcmp (desc->u.fpr, afp, 16);
+          break;
+        default:
+          okay = !memcmp (desc->u.fpr, afp, 20);
+          break;
+        }
+      free_packet (&pkt);
+    }
+  free_packet (&pkt);
+  set_packet_list_mode (save_mode);
+  iobuf_close (a);
+  return okay;
+}
+
+
+/* Prepare keyring KR for a modification.  Returns the index if it is
+   valid for the current keyring file.  The index must not be
+   modified until update_kr_index has been called.  */
+static struct kr_index *
+prepare_kr_index_update (CONST_KR_NAME kr)
+{
+  struct kr_index cur;
+  KR_NAME krw = (KR_NAME)kr;
+
+  if (!krw->index && !krw->index_tried)
+    krw->index = read_kr_index (kr);
+  if (!krw->index)
+    return NULL;
+  if (kr_index_stat (kr->fname, &cur)
+      || cur.size != krw->index->size
+      || cur.mtime != krw->index->mtime
+      || cur.ino != krw->index->ino)
+    {
+      release_kr_index (krw->index);
+      krw->index = NULL;
+      krw->index_tried = 0;
+      return NULL;
+    }
+  return krw->index;
+}
+
+
+/* Update the index of KR after a successful do_copy operation MODE
+   (1 = insert, 2 = delete, 3 = update) at OFFSET with keyblock KB.
+   IDX is the value returned by prepare_kr_index_update.  */
+static void
+update_kr_index (CONST_KR_NAME kr, struct kr_index *idx,
+                 int mode, off_t offset, KBNODE kb)
+{
+  struct kr_index cur;
+  off_t delta;
+  size_t n, m;
+  int any = 0;
+
+  if (!idx)
+    return;
+  if (kr_index_stat (kr->fname, &cur))
+    {
+      invalidate_kr_index (kr);
+      return;
+    }
+  delta = cur.size - idx->size;
+
+  if (mode == 1)
+    add_kr_index_keyblock (idx, kb, idx->size);
+  else
+    {
+      for (n=m=0; n < idx->nitems; n++)
+        {
+          if (idx->items[n].off == offset)
+            {
+              any = 1;
+              continue;
+            }
+          if (idx->items[n].off > offset)
+            idx->items[n].off += delta;
+          if (m != n)
+            idx->items[m] = idx->items[n];
+          m++;
+        }
+      idx->nitems = m;
+      if (!any)
+        {
+          /* The index does not know about this keyblock; it can't be
+             trusted anymore.  */
+          invalidate_kr_index (kr);
+          return;
+        }
+      if (mode == 3)
+        add_kr_index_keyblock (idx, kb, offset);
+    }
+
+  idx->size = cur.size;
+  idx->mtime = cur.mtime;
+  idx->ino = cur.ino;
+  sort_kr_index (idx);
+  write_kr_index (kr, idx);
+}
+
+
+
 /*
  * Register a filename for plain keyring files.  ptr is set to a
  * pointer to be used to create a handles etc, or the already-issued
@@ -225,6 +994,8 @@ keyring_register_filename (const char *fname, int read_only, void **ptr)
     kr->lockhd = NULL;
     kr->is_locked = 0;
     kr->did_full_scan = 0;
+    kr->index = NULL;
+    kr->index_tried = 0;
     /* keep a list of all issued pointers */
     kr->next = kr_names;
     kr_names = kr;
@@ -247,6 +1018,24 @@ keyring_is_writable (void *token)
 }
 
 
+/* Forget what has been learned about the contents of the keyrings.
+   This is used if another process may have changed them.  */
+void
+keyring_flush_caches (void)
+{
+  KR_NAME kr;
+
+  if (kr_offtbl)
+    {
+      release_offset_hash_table (kr_offtbl);
+      kr_offtbl = new_offset_hash_table ();
+    }
+  kr_offtbl_ready = 0;
+  for (kr=kr_names; kr; kr = kr->next)
+    kr->did_full_scan = 0;
+}
+
+
 
 /* Create a new handle for the resource associated with TOKEN.
 
@@ -275,6 +1064,10 @@ keyring_release (KEYRING_HANDLE hd)
     xfree (hd->word_match.name);
     xfree (hd->word_match.pattern);
     iobuf_close (hd->current.iobuf);
+    if (hd->current.lookahead) {
+        free_packet (hd->current.lookahead);
+        xfree (hd->current.lookahead);
+    }
     xfree (hd);
 }
 
@@ -331,7 +1124,8 @@ keyring_lock (KEYRING_HANDLE hd, int yes)
         }
     }
 
-    if (rc || !yes) {
+    /* The locks are kept until the end of a transaction.  */
+    if (rc || (!yes && !kr_in_transaction)) {
         for (kr=kr_names; kr; kr = kr->next) {
             if (!keyring_is_writable(kr))
                 continue;
@@ -349,50 +1143,43 @@ keyring_lock (KEYRING_HANDLE hd, int yes)
 
 
 
-/*
- * Return the last found keyring.  Caller must free it.
- * The returned keyblock has the kbode flag bit 0 set for the node with
- * the public key used to locate the keyblock or flag bit 1 set for
- * the user ID node.
- */
-int
-keyring_get_keyblock (KEYRING_HANDLE hd, KBNODE *ret_kb)
+/* Read a keyblock from A which must be positioned at its start.  The
+   number of packets read is stored at R_N_PACKETS; flag bit 0 is set
+   for the PK_NO_WANTED-th key and bit 1 for the UID_NO_WANTED-th user
+   ID.  The keyblock is stored at RET_KB if that is not NULL.  If
+   R_LOOKAHEAD is not NULL, the key packet starting the next keyblock
+   is stored there instead of being dropped and a packet stored there
+   is used as the first packet of the keyblock.  */
+static int
+read_keyblock (IOBUF a, size_t pk_no_wanted, size_t uid_no_wanted,
+               unsigned int *r_n_packets, PACKET **r_lookahead,
+               KBNODE *ret_kb)
 {
     PACKET *pkt;
     int rc;
     KBNODE keyblock = NULL, node, lastnode;
-    IOBUF a;
     int in_cert = 0;
     int pk_no = 0;
     int uid_no = 0;
-    int save_mode;
-
-    if (ret_kb)
-        *ret_kb = NULL;
+    int save_mode, save_lazy;
 
-    if (!hd->found.kr)
-        return -1; /* no successful search */
-
-    a = iobuf_open (hd->found.kr->fname);
-    if (!a)
-      {
-	log_error(_("can't open '%s'\n"), hd->found.kr->fname);
-	return G10ERR_KEYRING_OPEN;
-      }
-
-    if (iobuf_seek (a, hd->found.offset) ) {
-        log_error ("can't seek '%s'\n", hd->found.kr->fname);
-	iobuf_close(a);
-	return G10ERR_KEYRING_OPEN;
-    }
-
-    pkt = xmalloc (sizeof *pkt);
-    init_packet (pkt);
-    hd->found.n_packets = 0;;
+    *r_n_packets = 0;
     lastnode = NULL;
     save_mode = set_packet_list_mode(0);
-    while ((rc=parse_packet (a, pkt)) != -1) {
-        hd->found.n_packets++;
+    save_lazy = set_lazy_sig_mode (1);
+    if (r_lookahead && *r_lookahead) {
+        /* The key packet which ended the previous keyblock.  */
+        pkt = *r_lookahead;
+        *r_lookahead = NULL;
+        rc = 0;
+    }
+    else {
+        pkt = xmalloc (sizeof *pkt);
+        init_packet (pkt);
+        rc = parse_packet (a, pkt);
+    }
+    for (; rc != -1; rc = parse_packet (a, pkt)) {
+        ++*r_n_packets;
         if (rc == G10ERR_UNKNOWN_PACKET) {
 	    free_packet (pkt);
 	    init_packet (pkt);
@@ -413,7 +1200,12 @@ keyring_get_keyblock (KEYRING_HANDLE hd, KBNODE *ret_kb)
 
         if (in_cert && (pkt->pkttype == PKT_PUBLIC_KEY
                         || pkt->pkttype == PKT_SECRET_KEY)) {
-            hd->found.n_packets--; /* fix counter */
+            --*r_n_packets; /* fix counter */
+            if (r_lookahead) {
+                /* Keep it for the next call.  */
+                *r_lookahead = pkt;
+                pkt = NULL;
+            }
             break; /* ready */
         }
 
@@ -452,12 +1244,12 @@ keyring_get_keyblock (KEYRING_HANDLE hd, KBNODE *ret_kb)
           case PKT_PUBLIC_SUBKEY:
           case PKT_SECRET_KEY:
           case PKT_SECRET_SUBKEY:
-            if (++pk_no == hd->found.pk_no)
+            if (++pk_no == pk_no_wanted)
               node->flag |= 1;
             break;
 
           case PKT_USER_ID:
-            if (++uid_no == hd->found.uid_no)
+            if (++uid_no == uid_no_wanted)
               node->flag |= 2;
             break;
 
@@ -468,42 +1260,256 @@ keyring_get_keyblock (KEYRING_HANDLE hd, KBNODE *ret_kb)
         pkt = xmalloc (sizeof *pkt);
         init_packet(pkt);
     }
+    set_lazy_sig_mode (save_lazy);
     set_packet_list_mode(save_mode);
 
-    if (rc == -1 && keyblock)
-	rc = 0; /* got the entire keyblock */
+    if (rc == -1 && keyblock)
+	rc = 0; /* got the entire keyblock */
+
+    if (rc || !ret_kb)
+	release_kbnode (keyblock);
+    else {
+        /*(duplicated form the loop body)*/
+        if ( pkt && pkt->pkttype == PKT_RING_TRUST
+             && lastnode
+             && lastnode->pkt->pkttype == PKT_SIGNATURE
+             && (pkt->pkt.ring_trust->sigcache & 1) ) {
+            PKT_signature *sig = lastnode->pkt->pkt.signature;
+            sig->flags.checked = 1;
+            sig->flags.valid = !!(pkt->pkt.ring_trust->sigcache & 2);
+        }
+	*ret_kb = keyblock;
+    }
+    if (pkt) {
+        free_packet (pkt);
+        xfree (pkt);
+    }
+
+    return rc;
+}
+
+
+/*
+ * Return the last found keyring.  Caller must free it.
+ * The returned keyblock has the kbode flag bit 0 set for the node with
+ * the public key used to locate the keyblock or flag bit 1 set for
+ * the user ID node.
+ */
+int
+keyring_get_keyblock (KEYRING_HANDLE hd, KBNODE *ret_kb)
+{
+    int rc;
+    IOBUF a;
+
+    if (ret_kb)
+        *ret_kb = NULL;
+
+    if (!hd->found.kr)
+        return -1; /* no successful search */
+
+    if (hd->found.pending)
+      {
+        /* Found in the queue of a transaction.  */
+        if (!kr_in_transaction || !hd->found.pending->image)
+          return -1;
+        a = iobuf_temp_with_content
+          (iobuf_get_temp_buffer (hd->found.pending->image),
+           iobuf_get_temp_length (hd->found.pending->image));
+      }
+    else
+      {
+        a = iobuf_open (hd->found.kr->fname);
+        if (!a)
+          {
+            log_error(_("can't open '%s'\n"), hd->found.kr->fname);
+            return G10ERR_KEYRING_OPEN;
+          }
+
+        if (iobuf_seek (a, hd->found.offset) ) {
+            log_error ("can't seek '%s'\n", hd->found.kr->fname);
+            iobuf_close(a);
+            return G10ERR_KEYRING_OPEN;
+        }
+      }
+
+    rc = read_keyblock (a, hd->found.pk_no, hd->found.uid_no,
+                        &hd->found.n_packets, NULL, ret_kb);
+    iobuf_close(a);
+
+    /* Make sure that future search operations fail immediately when
+     * we know that we are working on a invalid keyring
+     */
+    if (rc == G10ERR_INV_KEYRING)
+        hd->current.error = rc;
+
+    return rc;
+}
+
+/* Store a copy of KB in the queued change P.  If KB is NULL the
+   change is turned into a deletion.  */
+static int
+set_pending_keyblock (struct kr_pending *p, KBNODE kb)
+{
+  IOBUF image = NULL;
+  IOBUF a;
+  KBNODE keyblock = NULL;
+  unsigned int n_packets;
+  int rc;
+
+  if (kb)
+    {
+      /* Keep the keyblock the way it will end up in the keyring so
+         that it reads back exactly like one from the file.  */
+      image = iobuf_temp ();
+      rc = write_keyblock (image, kb);
+      if (!rc)
+        {
+          a = iobuf_temp_with_content (iobuf_get_temp_buffer (image),
+                                       iobuf_get_temp_length (image));
+          rc = read_keyblock (a, 0, 0, &n_packets, NULL, &keyblock);
+          iobuf_close (a);
+        }
+      if (rc)
+        {
+          iobuf_close (image);
+          return rc;
+        }
+    }
+
+  release_kbnode (p->keyblock);
+  if (p->image)
+    iobuf_close (p->image);
+  p->keyblock = keyblock;
+  p->image = image;
+  return 0;
+}
+
+
+/* Queue a change of keyring KR.  OFFSET and N_PACKETS describe the
+   replaced keyblock; OFFSET is -1 to add KB as a new keyblock.  KB is
+   NULL to delete the keyblock.  */
+static int
+queue_pending (CONST_KR_NAME kr, off_t offset, unsigned int n_packets,
+               KBNODE kb)
+{
+  struct kr_pending *p;
+  int rc;
+
+  p = xmalloc_clear (sizeof *p);
+  p->kr = kr;
+  p->offset = offset;
+  p->n_packets = n_packets;
+  rc = set_pending_keyblock (p, kb);
+  if (rc)
+    {
+      xfree (p);
+      return rc;
+    }
+  *kr_pending_tail = p;
+  kr_pending_tail = &p->next;
+  if (offset != -1)
+    {
+      p->next_replaced = kr_replaced_tbl[KR_REPLACED_SLOT (offset)];
+      kr_replaced_tbl[KR_REPLACED_SLOT (offset)] = p;
+    }
+  return 0;
+}
+
+
+/* Return true if the keyblock at OFFSET of KR has been replaced or
+   deleted by a queued change.  */
+static int
+pending_replaced_p (CONST_KR_NAME kr, off_t offset)
+{
+  struct kr_pending *p;
+
+  for (p = kr_replaced_tbl[KR_REPLACED_SLOT (offset)]; p;
+       p = p->next_replaced)
+    if (p->kr == kr && p->offset == offset)
+      return 1;
+  return 0;
+}
+
+
+/* Continue the search of HD in the keyblocks queued for its keyring.
+   This is used after the end of the file has been reached and also
+   when the index tells that the key is not in the file.  */
+static int
+search_pending (KEYRING_HANDLE hd, KEYDB_SEARCH_DESC *desc,
+                size_t ndesc, size_t *descindex)
+{
+  struct kr_pending *p;
+  KBNODE node;
+  gpg_pkt_user_id_t uid;
+  u32 kid[2];
+  size_t n, i, pk_no, uid_no;
+
+  hd->found.kr = NULL;
+  hd->found.pending = NULL;
 
-    if (rc || !ret_kb)
-	release_kbnode (keyblock);
-    else {
-        /*(duplicated form the loop body)*/
-        if ( pkt && pkt->pkttype == PKT_RING_TRUST
-             && lastnode
-             && lastnode->pkt->pkttype == PKT_SIGNATURE
-             && (pkt->pkt.ring_trust->sigcache & 1) ) {
-            PKT_signature *sig = lastnode->pkt->pkt.signature;
-            sig->flags.checked = 1;
-            sig->flags.valid = !!(pkt->pkt.ring_trust->sigcache & 2);
+  p = hd->current.in_pending? hd->current.pending : kr_pending;
+  hd->current.in_pending = 1;
+  for (; p; p = p->next)
+    {
+      if (p->kr != hd->current.kr || !p->keyblock)
+        continue;
+      for (n=0; n < ndesc; n++)
+        {
+          if (keyring_match_keyblock (p->keyblock, desc + n, kid, &uid))
+            continue;
+          for (i=0; i < ndesc; i++)
+            if (desc[i].skipfnc
+                && desc[i].skipfnc (desc[i].skipfncvalue, kid, uid))
+              break;
+          if (i == ndesc)
+            goto found;
         }
-	*ret_kb = keyblock;
     }
-    free_packet (pkt);
-    xfree (pkt);
-    iobuf_close(a);
-
-    /* Make sure that future search operations fail immediately when
-     * we know that we are working on a invalid keyring
-     */
-    if (rc == G10ERR_INV_KEYRING)
-        hd->current.error = rc;
+  hd->current.pending = NULL;
+  hd->current.eof = 1;
+  return -1;
 
-    return rc;
+ found:
+  pk_no = uid_no = 0;
+  hd->found.pk_no = hd->found.uid_no = 0;
+  for (node = p->keyblock; node; node = node->next)
+    {
+      switch (node->pkt->pkttype)
+        {
+        case PKT_PUBLIC_KEY:
+        case PKT_PUBLIC_SUBKEY:
+        case PKT_SECRET_KEY:
+        case PKT_SECRET_SUBKEY:
+          pk_no++;
+          if ((node->flag & 1))
+            hd->found.pk_no = pk_no;
+          break;
+        case PKT_USER_ID:
+          uid_no++;
+          if ((node->flag & 2))
+            hd->found.uid_no = uid_no;
+          break;
+        default:
+          break;
+        }
+    }
+  hd->current.pending = p->next;
+  hd->current.eof = 0;
+  hd->found.kr = hd->current.kr;
+  hd->found.pending = p;
+  hd->found.offset = 0;
+  hd->found.n_packets = 0;
+  if (descindex)
+    *descindex = n;
+  return 0;
 }
 
+
 int
 keyring_update_keyblock (KEYRING_HANDLE hd, KBNODE kb)
 {
     int rc;
+    struct kr_index *idx;
 
     if (!hd->found.kr)
         return -1; /* no successful prior search */
@@ -511,7 +1517,7 @@ keyring_update_keyblock (KEYRING_HANDLE hd, KBNODE kb)
     if (hd->found.kr->read_only)
       return gpg_error (GPG_ERR_EACCES);
 
-    if (!hd->found.n_packets) {
+    if (!hd->found.n_packets && !hd->found.pending) {
         /* need to know the number of packets - do a dummy get_keyblock*/
         rc = keyring_get_keyblock (hd, NULL);
         if (rc) {
@@ -528,6 +1534,20 @@ keyring_update_keyblock (KEYRING_HANDLE hd, KBNODE kb)
     iobuf_close(hd->current.iobuf);
     hd->current.iobuf = NULL;
 
+    if (hd->found.pending)
+      return set_pending_keyblock (hd->found.pending, kb);
+    if (kr_in_transaction) {
+        rc = queue_pending (hd->found.kr, hd->found.offset,
+                            hd->found.n_packets, kb);
+        if (!rc) {
+            hd->found.kr = NULL;
+            hd->found.offset = 0;
+        }
+        return rc;
+    }
+
+    idx = prepare_kr_index_update (hd->found.kr);
+
     /* do the update */
     rc = do_copy (3, hd->found.kr->fname, kb,
                   hd->found.offset, hd->found.n_packets );
@@ -536,6 +1556,7 @@ keyring_update_keyblock (KEYRING_HANDLE hd, KBNODE kb)
         {
           update_offset_hash_table_from_kb (kr_offtbl, kb, 0);
         }
+      update_kr_index (hd->found.kr, idx, 3, hd->found.offset, kb);
       /* better reset the found info */
       hd->found.kr = NULL;
       hd->found.offset = 0;
@@ -548,23 +1569,26 @@ keyring_insert_keyblock (KEYRING_HANDLE hd, KBNODE kb)
 {
     int rc;
     const char *fname;
+    CONST_KR_NAME kr;
+    struct kr_index *idx = NULL;
 
     if (!hd)
-        fname = NULL;
+        kr = NULL;
     else if (hd->found.kr)
       {
-        fname = hd->found.kr->fname;
+        kr = hd->found.kr;
         if (hd->found.kr->read_only)
           return gpg_error (GPG_ERR_EACCES);
       }
     else if (hd->current.kr)
       {
-        fname = hd->current.kr->fname;
+        kr = hd->current.kr;
         if (hd->current.kr->read_only)
           return gpg_error (GPG_ERR_EACCES);
       }
     else
-        fname = hd->resource? hd->resource->fname:NULL;
+        kr = hd->resource;
+    fname = kr? kr->fname : NULL;
 
     if (!fname)
         return G10ERR_GENERAL;
@@ -576,12 +1600,19 @@ keyring_insert_keyblock (KEYRING_HANDLE hd, KBNODE kb)
     iobuf_close (hd->current.iobuf);
     hd->current.iobuf = NULL;
 
+    if (kr_in_transaction)
+      return queue_pending (kr, -1, 0, kb);
+
+    idx = prepare_kr_index_update (kr);
+
     /* do the insert */
     rc = do_copy (1, fname, kb, 0, 0 );
     if (!rc && kr_offtbl)
       {
         update_offset_hash_table_from_kb (kr_offtbl, kb, 0);
       }
+    if (!rc)
+      update_kr_index (kr, idx, 1, 0, kb);
 
     return rc;
 }
@@ -591,6 +1622,7 @@ int
 keyring_delete_keyblock (KEYRING_HANDLE hd)
 {
     int rc;
+    struct kr_index *idx;
 
     if (!hd->found.kr)
         return -1; /* no successful prior search */
@@ -598,7 +1630,7 @@ keyring_delete_keyblock (KEYRING_HANDLE hd)
     if (hd->found.kr->read_only)
       return gpg_error (GPG_ERR_EACCES);
 
-    if (!hd->found.n_packets) {
+    if (!hd->found.n_packets && !hd->found.pending) {
         /* need to know the number of packets - do a dummy get_keyblock*/
         rc = keyring_get_keyblock (hd, NULL);
         if (rc) {
@@ -616,10 +1648,25 @@ keyring_delete_keyblock (KEYRING_HANDLE hd)
     iobuf_close (hd->current.iobuf);
     hd->current.iobuf = NULL;
 
+    if (hd->found.pending)
+      return set_pending_keyblock (hd->found.pending, NULL);
+    if (kr_in_transaction) {
+        rc = queue_pending (hd->found.kr, hd->found.offset,
+                            hd->found.n_packets, NULL);
+        if (!rc) {
+            hd->found.kr = NULL;
+            hd->found.offset = 0;
+        }
+        return rc;
+    }
+
+    idx = prepare_kr_index_update (hd->found.kr);
+
     /* do the delete */
     rc = do_copy (2, hd->found.kr->fname, NULL,
                   hd->found.offset, hd->found.n_packets );
     if (!rc) {
+        update_kr_index (hd->found.kr, idx, 2, hd->found.offset, NULL);
         /* better reset the found info */
         hd->found.kr = NULL;
         hd->found.offset = 0;
@@ -644,8 +1691,16 @@ keyring_search_reset (KEYRING_HANDLE hd)
     hd->current.iobuf = NULL;
     hd->current.eof = 0;
     hd->current.error = 0;
+    hd->current.in_pending = 0;
+    hd->current.pending = NULL;
+    if (hd->current.lookahead) {
+        free_packet (hd->current.lookahead);
+        xfree (hd->current.lookahead);
+        hd->current.lookahead = NULL;
+    }
 
     hd->found.kr = NULL;
+    hd->found.pending = NULL;
     hd->found.offset = 0;
     return 0;
 }
@@ -683,6 +1738,9 @@ prepare_search (KEYRING_HANDLE hd)
     }
 
     hd->current.eof = 0;
+    hd->current.partial = 0;
+    hd->current.in_pending = 0;
+    hd->current.pending = NULL;
     hd->current.iobuf = iobuf_open (hd->current.kr->fname);
     if (!hd->current.iobuf)
       {
@@ -694,6 +1752,47 @@ prepare_search (KEYRING_HANDLE hd)
     return 0;
 }
 
+
+/*
+ * Read the keyblock following the one returned by the last call and
+ * store it at RET_KB.  Unlike a search for the next keyblock followed
+ * by keyring_get_keyblock this reads the keyring only once and
+ * without seeking.  Returns -1 after the last keyblock.  This may not
+ * be mixed with searches on the same handle without a reset.
+ */
+int
+keyring_read_next (KEYRING_HANDLE hd, KBNODE *ret_kb)
+{
+    int rc;
+    unsigned int n_packets;
+
+    *ret_kb = NULL;
+
+    if (kr_in_transaction) {
+        /* The search code knows how to merge the queued changes.  */
+        KEYDB_SEARCH_DESC desc;
+
+        memset (&desc, 0, sizeof desc);
+        desc.mode = KEYDB_SEARCH_MODE_NEXT;
+        rc = keyring_search (hd, &desc, 1, NULL);
+        if (!rc)
+            rc = keyring_get_keyblock (hd, ret_kb);
+        return rc;
+    }
+
+    rc = prepare_search (hd);
+    if (rc)
+        return rc;
+
+    rc = read_keyblock (hd->current.iobuf, 0, 0, &n_packets,
+                        &hd->current.lookahead, ret_kb);
+    if (rc == -1)
+        hd->current.eof = 1;
+    else if (rc == G10ERR_INV_KEYRING)
+        hd->current.error = rc;
+    return rc;
+}
+
 
 /* A map of the all characters valid used for word_match()
  * Valid characters are in in this table converted to uppercase.
@@ -880,6 +1979,111 @@ compare_name (int mode, const char *name, const char *uid, size_t uidlen)
 }
 
 
+/*
+ * Check whether KEYBLOCK matches the single search description DESC
+ * using the same rules as keyring_search.  On a match 0 is returned
+ * and the node flags of KEYBLOCK are set the same way
+ * keyring_get_keyblock would set them had the keyblock been found by
+ * a search for DESC: bit 0 for the matching key, bit 1 for the
+ * matching user ID.  The key ID of the primary key and the matching
+ * user ID (or NULL) are stored at R_KID and R_UID so that the caller
+ * can run the skip function.  -1 is returned if there is no match.
+ */
+int
+keyring_match_keyblock (KBNODE keyblock, KEYDB_SEARCH_DESC *desc,
+                        u32 *r_kid, gpg_pkt_user_id_t *r_uid)
+{
+  kbnode_t node;
+  PKT_public_key *pk;
+  PKT_user_id *uid;
+  byte afp[MAX_FINGERPRINT_LEN];
+  size_t an;
+  u32 aki[2];
+  int match;
+
+  *r_uid = NULL;
+  r_kid[0] = r_kid[1] = 0;
+  for (node = keyblock; node; node = node->next)
+    node->flag &= ~3;
+
+  for (node = keyblock; node; node = node->next)
+    {
+      pk = NULL;
+      uid = NULL;
+      if (   node->pkt->pkttype == PKT_PUBLIC_KEY
+          || node->pkt->pkttype == PKT_PUBLIC_SUBKEY
+          || node->pkt->pkttype == PKT_SECRET_KEY
+          || node->pkt->pkttype == PKT_SECRET_SUBKEY)
+        {
+          pk = node->pkt->pkt.public_key;
+          keyid_from_pk (pk, aki);
+          if (node == keyblock)
+            {
+              r_kid[0] = aki[0];
+              r_kid[1] = aki[1];
+            }
+        }
+      else if (node->pkt->pkttype == PKT_USER_ID)
+        uid = node->pkt->pkt.user_id;
+      else
+        continue;
+
+      match = 0;
+      switch (desc->mode)
+        {
+        case KEYDB_SEARCH_MODE_EXACT:
+        case KEYDB_SEARCH_MODE_SUBSTR:
+        case KEYDB_SEARCH_MODE_MAIL:
+        case KEYDB_SEARCH_MODE_MAILSUB:
+        case KEYDB_SEARCH_MODE_MAILEND:
+        case KEYDB_SEARCH_MODE_WORDS:
+          match = (uid && !compare_name (desc->mode, desc->u.name,
+                                         uid->name, uid->len));
+          break;
+        case KEYDB_SEARCH_MODE_SHORT_KID:
+          match = (pk && desc->u.kid[1] == aki[1]);
+          break;
+        case KEYDB_SEARCH_MODE_LONG_KID:
+          match = (pk && desc->u.kid[0] == aki[0]
+                   && desc->u.kid[1] == aki[1]);
+          break;
+        case KEYDB_SEARCH_MODE_FPR16:
+        case KEYDB_SEARCH_MODE_FPR20:
+        case KEYDB_SEARCH_MODE_FPR:
+          if (pk)
+            {
+              fingerprint_from_pk (pk, afp, &an);
+              while (an < 20) /* fill up to 20 bytes */
+                afp[an++] = 0;
+              match = !memcmp (desc->u.fpr, afp,
+                               desc->mode == KEYDB_SEARCH_MODE_FPR16? 16:20);
+            }
+          break;
+        case KEYDB_SEARCH_MODE_FIRST:
+        case KEYDB_SEARCH_MODE_NEXT:
+          match = !!pk;
+          break;
+        default:
+          break;
+        }
+
+      if (match)
+        {
+          if (pk)
+            node->flag |= 1;
+          else
+            {
+              node->flag |= 2;
+              *r_uid = uid;
+            }
+          return 0;
+        }
+    }
+
+  return -1;
+}
+
+
 /*
  * Search through the keyring(s), starting at the current position,
  * for a keyblock which contains one of the keys described in the DESC array.
@@ -944,6 +2148,35 @@ keyring_search (KEYRING_HANDLE hd, KEYDB_SEARCH_DESC *desc,
   if (rc)
     return rc;
 
+  if (hd->current.in_pending)
+    return search_pending (hd, desc, ndesc, descindex);
+
+  /* If we are at the start of the keyring and look for a single key
+     ID or fingerprint, ask the persistent index.  It tells us either
+     that the key is not in the keyring or where its keyblock
+     starts.  */
+  if (kr_index_usable_desc (desc, ndesc)
+      && hd->current.iobuf && !iobuf_tell (hd->current.iobuf))
+    {
+      struct kr_index *idx = get_kr_index (hd->current.kr);
+      off_t off;
+
+      if (!idx)
+        ;
+      else if (lookup_kr_index (idx, desc, &off))
+        return search_pending (hd, desc, ndesc, descindex);
+      else if (pending_replaced_p (hd->current.kr, off))
+        return search_pending (hd, desc, ndesc, descindex);
+      else if (!verify_kr_index_hit (hd->current.kr, off, desc))
+        {
+          log_info ("keyring index for '%s' is corrupt - ignored\n",
+                    hd->current.kr->fname);
+          invalidate_kr_index (hd->current.kr);
+        }
+      else if (off && !iobuf_seek (hd->current.iobuf, off))
+        hd->current.partial = 1;
+    }
+
   use_offtbl = !!kr_offtbl;
   if (!use_offtbl)
     ;
@@ -954,12 +2187,8 @@ keyring_search (KEYRING_HANDLE hd, KEYDB_SEARCH_DESC *desc,
       struct off_item *oi;
 
       oi = lookup_offset_hash_table (kr_offtbl, desc[0].u.kid);
-      if (!oi)
-        { /* We know that we don't have this key */
-          hd->found.kr = NULL;
-          hd->current.eof = 1;
-          return -1;
-        }
+      if (!oi) /* We know that we don't have this key in the file */
+        return search_pending (hd, desc, ndesc, descindex);
       /* We could now create a positive search status and return.
        * However the problem is that another instance of gpg may
        * have changed the keyring so that the offsets are not valid
@@ -1094,6 +2323,13 @@ keyring_search (KEYRING_HANDLE hd, KEYDB_SEARCH_DESC *desc,
       free_packet (&pkt);
       continue;
     found:
+      /* Ignore keyblocks replaced by a transaction.  */
+      if (!rc && kr_pending
+          && pending_replaced_p (hd->current.kr, main_offset))
+        {
+          free_packet (&pkt);
+          continue;
+        }
       /* Record which desc we matched on.  Note this value is only
 	 meaningful if this function returns with no errors. */
       if(descindex)
@@ -1113,6 +2349,7 @@ keyring_search (KEYRING_HANDLE hd, KEYDB_SEARCH_DESC *desc,
     {
       hd->found.offset = main_offset;
       hd->found.kr = hd->current.kr;
+      hd->found.pending = NULL;
       hd->found.pk_no = pk? pk_no : 0;
       hd->found.uid_no = uid? uid_no : 0;
     }
@@ -1121,7 +2358,7 @@ keyring_search (KEYRING_HANDLE hd, KEYDB_SEARCH_DESC *desc,
       hd->current.eof = 1;
       /* if we scanned all keyrings, we are sure that
        * all known key IDs are in our offtbl, mark that. */
-      if (use_offtbl && !kr_offtbl_ready)
+      if (use_offtbl && !kr_offtbl_ready && !hd->current.partial)
         {
           KR_NAME kr;
 
@@ -1150,6 +2387,10 @@ keyring_search (KEYRING_HANDLE hd, KEYDB_SEARCH_DESC *desc,
 
   free_packet(&pkt);
   set_packet_list_mode(save_mode);
+
+  /* Keyblocks added by a transaction come after the file.  */
+  if (rc == -1 && kr_pending)
+    rc = search_pending (hd, desc, ndesc, descindex);
   return rc;
 }
 
@@ -1631,3 +2872,312 @@ do_copy (int mode, const char *fname, KBNODE root,
     xfree(tmpfname);
     return rc;
 }
+
+
+/*
+ * Start a transaction.  All changes to the keyrings are queued in
+ * memory until keyring_commit_transaction is called, which then
+ * writes each modified keyring in one go.  The keyrings stay locked
+ * for the duration of the transaction.
+ */
+int
+keyring_begin_transaction (void)
+{
+  int rc;
+
+  if (kr_in_transaction)
+    return gpg_error (GPG_ERR_CONFLICT);
+
+  rc = keyring_lock (NULL, 1);
+  if (rc)
+    return rc;
+  kr_in_transaction = 1;
+  return 0;
+}
+
+
+static int
+cmp_pending_offset (const void *a_arg, const void *b_arg)
+{
+  const struct kr_pending *a = *(const struct kr_pending **)a_arg;
+  const struct kr_pending *b = *(const struct kr_pending **)b_arg;
+
+  return a->offset < b->offset? -1 : a->offset > b->offset;
+}
+
+
+/* Update the index IDX of keyring KR after commit_pending wrote the
+   queued changes.  REPLACED are the NREPLACED queued replacements and
+   deletions sorted by offset and OLDENDS has the offset of the end of
+   each of these keyblocks in the old file.  */
+static void
+update_kr_index_pending (CONST_KR_NAME kr, struct kr_index *idx,
+                         struct kr_pending **replaced, off_t *oldends,
+                         size_t nreplaced)
+{
+  struct kr_index cur;
+  struct kr_pending *p;
+  off_t *shifts, off;
+  char *seen;
+  size_t n, m, lo, hi, mid;
+
+  if (kr_index_stat (kr->fname, &cur))
+    {
+      invalidate_kr_index (kr);
+      return;
+    }
+
+  /* SHIFTS[N] is how much the keyblocks behind the first N replaced
+     ones have moved.  */
+  shifts = xmalloc ((nreplaced + 1) * sizeof *shifts);
+  seen = xmalloc_clear (nreplaced + 1);
+  shifts[0] = 0;
+  for (n=0; n < nreplaced; n++)
+    {
+      p = replaced[n];
+      shifts[n+1] = (shifts[n] - (oldends[n] - p->offset)
+                     + (p->image? iobuf_get_temp_length (p->image) : 0));
+    }
+
+  for (n=m=0; n < idx->nitems; n++)
+    {
+      off = idx->items[n].off;
+      lo = 0;
+      hi = nreplaced;
+      while (lo < hi)
+        {
+          mid = lo + (hi - lo) / 2;
+          if (replaced[mid]->offset < off)
+            lo = mid + 1;
+          else
+            hi = mid;
+        }
+      if (lo < nreplaced && replaced[lo]->offset == off)
+        {
+          seen[lo] = 1;
+          continue;
+        }
+      idx->items[n].off = off + shifts[lo];
+      if (m != n)
+        idx->items[m] = idx->items[n];
+      m++;
+    }
+  idx->nitems = m;
+
+  for (n=0; n < nreplaced; n++)
+    if (!seen[n])
+      break;
+  if (n < nreplaced)
+    {
+      /* The index does not know about a replaced keyblock; it can't
+         be trusted anymore.  */
+      invalidate_kr_index (kr);
+      goto leave;
+    }
+
+  for (n=0; n < nreplaced; n++)
+    if (replaced[n]->keyblock)
+      add_kr_index_keyblock (idx, replaced[n]->keyblock,
+                             replaced[n]->offset + shifts[n]);
+  off = idx->size + shifts[nreplaced];
+  for (p = kr_pending; p; p = p->next)
+    if (p->kr == kr && p->offset == -1 && p->image)
+      {
+        add_kr_index_keyblock (idx, p->keyblock, off);
+        off += iobuf_get_temp_length (p->image);
+      }
+  if (off != cur.size)
+    {
+      invalidate_kr_index (kr);
+      goto leave;
+    }
+
+  idx->size = cur.size;
+  idx->mtime = cur.mtime;
+  idx->ino = cur.ino;
+  sort_kr_index (idx);
+  write_kr_index (kr, idx);
+
+ leave:
+  xfree (seen);
+  xfree (shifts);
+}
+
+
+/* Write the queued changes for keyring KR.  The keyring is copied
+   once to a temporary file, with the replaced keyblocks written in
+   place and the new ones appended.  The index is then updated with
+   the same changes.  */
+static int
+commit_pending (KR_NAME kr)
+{
+  struct kr_pending *p, **replaced = NULL;
+  off_t *oldends = NULL;
+  struct kr_index *idx;
+  size_t nreplaced, n;
+  IOBUF fp, newfp;
+  char *bakfname = NULL;
+  char *tmpfname = NULL;
+  int any = 0;
+  int rc = 0;
+
+  nreplaced = 0;
+  for (p = kr_pending; p; p = p->next)
+    {
+      if (p->kr != kr)
+        continue;
+      any = 1;
+      if (p->offset != -1)
+        nreplaced++;
+      if (p->keyblock && kr_offtbl)
+        update_offset_hash_table_from_kb (kr_offtbl, p->keyblock, 0);
+    }
+  if (!any)
+    return 0;
+
+  if (access (kr->fname, F_OK) && errno == ENOENT)
+    {
+      /* Let the first new keyblock create the keyring.  */
+      for (p = kr_pending; p; p = p->next)
+        if (p->kr == kr && p->keyblock)
+          break;
+      if (!p)
+        return 0;
+      rc = do_copy (1, kr->fname, p->keyblock, 0, 0);
+      if (rc)
+        return rc;
+      set_pending_keyblock (p, NULL);
+    }
+
+  if (access (kr->fname, W_OK))
+    return gpg_error_from_syserror ();
+
+  /* Get the index while it still matches the keyring.  */
+  idx = prepare_kr_index_update (kr);
+
+  fp = iobuf_open (kr->fname);
+  if (!fp)
+    {
+      rc = gpg_error_from_syserror ();
+      log_error (_("can't open '%s': %s\n"), kr->fname, strerror (errno));
+      return rc;
+    }
+
+  rc = create_tmp_file (kr->fname, &bakfname, &tmpfname, &newfp);
+  if (rc)
+    {
+      iobuf_close (fp);
+      goto leave;
+    }
+
+  if (nreplaced)
+    {
+      replaced = xmalloc (nreplaced * sizeof *replaced);
+      oldends = xmalloc (nreplaced * sizeof *oldends);
+      for (n=0, p = kr_pending; p; p = p->next)
+        if (p->kr == kr && p->offset != -1)
+          replaced[n++] = p;
+      qsort (replaced, nreplaced, sizeof *replaced, cmp_pending_offset);
+    }
+
+  for (n=0; !rc && n < nreplaced; n++)
+    {
+      p = replaced[n];
+      rc = copy_some_packets (fp, newfp, p->offset);
+      if (!rc)
+        rc = skip_some_packets (fp, p->n_packets);
+      oldends[n] = iobuf_tell (fp);
+      if (!rc && p->image
+          && iobuf_write (newfp, iobuf_get_temp_buffer (p->image),
+                          iobuf_get_temp_length (p->image)))
+        rc = gpg_error_from_syserror ();
+    }
+  if (rc == -1) /* should never get EOF here */
+    rc = gpg_error (GPG_ERR_TRUNCATED);
+  if (!rc)
+    {
+      rc = copy_all_packets (fp, newfp);
+      if (rc == -1)
+        rc = 0;
+    }
+  for (p = kr_pending; !rc && p; p = p->next)
+    {
+      if (p->kr == kr && p->offset == -1 && p->image
+          && iobuf_write (newfp, iobuf_get_temp_buffer (p->image),
+                          iobuf_get_temp_length (p->image)))
+        rc = gpg_error_from_syserror ();
+    }
+  if (rc)
+    {
+      log_error ("%s: copy to '%s' failed: %s\n",
+                 kr->fname, tmpfname, g10_errstr (rc));
+      iobuf_close (fp);
+      iobuf_cancel (newfp);
+      goto leave;
+    }
+
+  if (iobuf_close (fp))
+    {
+      rc = gpg_error_from_syserror ();
+      log_error ("%s: close failed: %s\n", kr->fname, strerror (errno));
+      iobuf_cancel (newfp);
+      goto leave;
+    }
+  if (iobuf_close (newfp))
+    {
+      rc = gpg_error_from_syserror ();
+      log_error ("%s: close failed: %s\n", tmpfname, strerror (errno));
+      goto leave;
+    }
+
+  rc = rename_tmp_file (bakfname, tmpfname, kr->fname);
+  if (!rc && idx)
+    update_kr_index_pending (kr, idx, replaced, oldends, nreplaced);
+
+ leave:
+  xfree (oldends);
+  xfree (replaced);
+  xfree (bakfname);
+  xfree (tmpfname);
+  return rc;
+}
+
+
+/*
+ * Write all changes queued since keyring_begin_transaction and end
+ * the transaction.
+ */
+int
+keyring_commit_transaction (void)
+{
+  struct kr_pending *p;
+  KR_NAME kr;
+  int rc = 0;
+  int tmprc;
+
+  if (!kr_in_transaction)
+    return 0;
+
+  if (!opt.dry_run)
+    for (kr = kr_names; kr; kr = kr->next)
+      {
+        tmprc = commit_pending (kr);
+        if (tmprc && !rc)
+          rc = tmprc;
+      }
+
+  while ((p = kr_pending))
+    {
+      kr_pending = p->next;
+      release_kbnode (p->keyblock);
+      if (p->image)
+        iobuf_close (p->image);
+      xfree (p);
+    }
+  kr_pending_tail = &kr_pending;
+  memset (kr_replaced_tbl, 0, sizeof kr_replaced_tbl);
+
+  kr_in_transaction = 0;
+  keyring_lock (NULL, 0);
+  return rc;
+}
@@ -26,6 +26,7 @@ typedef struct keyring_handle *KEYRING_HANDLE;
 
 int keyring_register_filename (const char *fname, int read_only, void **ptr);
 int keyring_is_writable (void *token);
+void keyring_flush_caches (void);
 
 KEYRING_HANDLE keyring_new (void *token);
 void keyring_release (KEYRING_HANDLE hd);
@@ -39,6 +40,11 @@ int keyring_delete_keyblock (KEYRING_HANDLE hd);
 int keyring_search_reset (KEYRING_HANDLE hd);
 int keyring_search (KEYRING_HANDLE hd, KEYDB_SEARCH_DESC *desc,
 		    size_t ndesc, size_t *descindex);
+int keyring_read_next (KEYRING_HANDLE hd, KBNODE *ret_kb);
+int keyring_match_keyblock (KBNODE keyblock, KEYDB_SEARCH_DESC *desc,
+                            u32 *r_kid, gpg_pkt_user_id_t *r_uid);
 int keyring_rebuild_cache (void *token,int noisy);
+int keyring_begin_transaction (void);
+int keyring_commit_transaction (void);
 
 #endif /*GPG_KEYRING_H*/
@@ -208,6 +208,8 @@ int complete_sig (PKT_signature *sig, PKT_public_key *pksk, gcry_md_hd_t md,
                   const char *cache_nonce);
 int sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
 	       int do_encrypt, strlist_t remusr, const char *outfile );
+int sign_fd (ctrl_t ctrl, int inp_fd, int detached, strlist_t locusr,
+             int out_fd);
 int clearsign_file( const char *fname, strlist_t locusr, const char *outfile );
 int sign_symencrypt_file (const char *fname, strlist_t locusr);
 
@@ -220,6 +222,13 @@ int check_key_signature2( KBNODE root, KBNODE node, PKT_public_key *check_pk,
 			  PKT_public_key *ret_pk, int *is_selfsig,
 			  u32 *r_expiredate, int *r_expired );
 
+/*-- sigcache.c --*/
+void sig_cache_enable (void);
+int sig_cache_lookup (byte *hash, PKT_public_key *pk, PKT_signature *sig,
+                      gcry_md_hd_t digest);
+void sig_cache_store (const byte *hash, int rc);
+void sig_cache_flush (void);
+
 /*-- delkey.c --*/
 int delete_keys( strlist_t names, int secret, int allow_both );
 
@@ -332,6 +341,7 @@ void print_card_key_info (estream_t fp, KBNODE keyblock);
 void print_file_status( int status, const char *name, int what );
 int verify_signatures (ctrl_t ctrl, int nfiles, char **files );
 int verify_files (ctrl_t ctrl, int nfiles, char **files );
+int verify_manifest (ctrl_t ctrl, const char *fname);
 int gpg_verify (ctrl_t ctrl, int sig_fd, int data_fd, estream_t out_fp);
 
 /*-- decrypt.c --*/
@@ -187,6 +187,9 @@ struct
   int no_sig_cache;
   int no_sig_create_check;
   int no_auto_check_trustdb;
+  unsigned int trustdb_cache_size; /* In KiB; 0 for the default.  */
+  int trustdb_mmap;
+  unsigned int key_cache_size;  /* 0 for the default.  */
   int preserve_permissions;
   int no_homedir_creation;
   struct groupitem *grouplist;
@@ -149,6 +149,10 @@ typedef struct
   subpktarea_t *unhashed;    /* Ditto for unhashed data. */
   byte digest_start[2];      /* First 2 bytes of the digest. */
   gcry_mpi_t  data[PUBKEY_MAX_NSIG];
+  byte *rawdata;             /* If not NULL, DATA has not yet been
+                                decoded from these bytes; see
+                                sig_parse_data.  */
+  size_t rawdatalen;
 } PKT_signature;
 
 #define ATTRIB_IMAGE 1
@@ -251,6 +255,8 @@ typedef struct
   u32     has_expired;    /* set to the expiration date if expired */
   u32     main_keyid[2];  /* keyid of the primary key */
   u32     keyid[2];	    /* calculated by keyid_from_pk() */
+  byte    fprlen;         /* Length of FPR or 0 if not yet known.  */
+  byte    fpr[MAX_FINGERPRINT_LEN]; /* Cached by fingerprint_from_pk().  */
   prefitem_t *prefs;      /* list of preferences (may be NULL) */
   struct
   {
@@ -393,6 +399,8 @@ int list_packets( iobuf_t a );
 
 /*-- parse-packet.c --*/
 int set_packet_list_mode( int mode );
+int set_lazy_sig_mode (int mode);
+int sig_parse_data (PKT_signature *sig);
 
 #if DEBUG_PARSE_PACKET
 int dbg_search_packet( iobuf_t inp, PACKET *pkt, off_t *retpos, int with_uid,
@@ -37,6 +37,7 @@
 
 static int mpi_print_mode;
 static int list_mode;
+static int lazy_sig_mode;
 static estream_t listfp;
 
 static int parse (IOBUF inp, PACKET * pkt, int onlykeypkts,
@@ -189,6 +190,54 @@ set_packet_list_mode (int mode)
 }
 
 
+/* If MODE is true, the values of signatures are not decoded by
+   parse_packet but only when sig_parse_data is called.  This is used
+   when reading keyblocks from a keyring where most of the third-party
+   certifications are never checked.  Returns the old mode.  */
+int
+set_lazy_sig_mode (int mode)
+{
+  int old = lazy_sig_mode;
+  lazy_sig_mode = mode;
+  return old;
+}
+
+
+/* Decode the values of SIG if that has been deferred by the lazy
+   mode.  This needs to be called before accessing SIG->DATA of a
+   signature read from a keyring.  Returns 0 on success or an error
+   code; in the latter case the values of SIG are NULL.  */
+int
+sig_parse_data (PKT_signature *sig)
+{
+  iobuf_t inp;
+  unsigned int n;
+  size_t pktlen;
+  int i, ndata;
+  int rc = 0;
+
+  if (!sig->rawdata)
+    return 0;
+
+  inp = iobuf_temp_with_content (sig->rawdata, sig->rawdatalen);
+  pktlen = sig->rawdatalen;
+  ndata = pubkey_get_nsig (sig->pubkey_algo);
+  for (i = 0; i < ndata; i++)
+    {
+      n = pktlen;
+      sig->data[i] = mpi_read (inp, &n, 0);
+      pktlen -= n;
+      if (!sig->data[i])
+	rc = G10ERR_INVALID_PACKET;
+    }
+  iobuf_close (inp);
+  xfree (sig->rawdata);
+  sig->rawdata = NULL;
+  sig->rawdatalen = 0;
+  return rc;
+}
+
+
 static void
 unknown_pubkey_warning (int algo)
 {
@@ -1764,6 +1813,23 @@ parse_signature (IOBUF inp, int pkttype, unsigned long pktlen,
 	  pktlen = 0;
 	}
     }
+  else if (lazy_sig_mode && !list_mode && pktlen
+	   && pktlen <= (5 * MAX_EXTERN_MPI_BITS / 8))
+    {
+      /* Keep the raw values; sig_parse_data decodes them if the
+	 signature is ever used.  */
+      sig->rawdata = xmalloc (pktlen);
+      if (iobuf_read (inp, sig->rawdata, pktlen) != pktlen)
+	{
+	  log_error ("premature eof while reading rest of packet\n");
+	  xfree (sig->rawdata);
+	  sig->rawdata = NULL;
+	  rc = G10ERR_INVALID_PACKET;
+	}
+      else
+	sig->rawdatalen = pktlen;
+      pktlen = 0;
+    }
   else
     {
       for (i = 0; i < ndata; i++)
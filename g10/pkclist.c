@@ -1176,7 +1176,17 @@ build_pk_list (ctrl_t ctrl,
     }
   else
     {
-      /* General case: Check all keys. */
+      /* General case: Check all keys.  With more than one recipient
+         we first look them all up in one pass over the keyrings.  */
+      strlist_t names = NULL;
+
+      for (rov = remusr; rov; rov = rov->next)
+        if (!(rov->flags & 1) && *rov->d)
+          add_to_strlist (&names, rov->d);
+      if (names && names->next)
+        getkey_prefetch_names (names);
+      free_strlist (names);
+
       any_recipients = 0;
       for (; remusr; remusr = remusr->next )
         {
@@ -1200,6 +1210,7 @@ build_pk_list (ctrl_t ctrl,
 
  fail:
 
+  getkey_prefetch_release ();
   if ( rc )
     release_pk_list( pk_list );
   else
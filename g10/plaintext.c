@@ -480,51 +480,58 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 }
 
 
+/* Size of the chunks used by do_hash.  */
+#define HASH_CHUNK_SIZE (64*1024)
+
 static void
 do_hash (gcry_md_hd_t md, gcry_md_hd_t md2, IOBUF fp, int textmode)
 {
   text_filter_context_t tfx;
-  int c;
+  byte *buffer;
+  int i, n;
+  int lc = -1;
 
   if (textmode)
     {
       memset (&tfx, 0, sizeof tfx);
       iobuf_push_filter (fp, text_filter, &tfx);
     }
-  if (md2)
-    {				/* work around a strange behaviour in pgp2 */
-      /* It seems that at least PGP5 converts a single CR to a CR,LF too */
-      int lc = -1;
-      while ((c = iobuf_get (fp)) != -1)
-	{
-	  if (c == '\n' && lc == '\r')
-	    gcry_md_putc (md2, c);
-	  else if (c == '\n')
-	    {
-	      gcry_md_putc (md2, '\r');
-	      gcry_md_putc (md2, c);
-	    }
-	  else if (c != '\n' && lc == '\r')
-	    {
-	      gcry_md_putc (md2, '\n');
-	      gcry_md_putc (md2, c);
-	    }
-	  else
-	    gcry_md_putc (md2, c);
 
-	  if (md)
-	    gcry_md_putc (md, c);
-	  lc = c;
-	}
-    }
-  else
+  /* Hash the data in large chunks; feeding the digest byte by byte
+     costs more than the hashing itself.  With a plain file the
+     chunks are read directly into our buffer.  */
+  buffer = xmalloc (HASH_CHUNK_SIZE);
+  while ((n = iobuf_read (fp, buffer, HASH_CHUNK_SIZE)) != -1)
     {
-      while ((c = iobuf_get (fp)) != -1)
-	{
-	  if (md)
-	    gcry_md_putc (md, c);
-	}
+      if (md)
+        gcry_md_write (md, buffer, n);
+      if (!md2)
+        continue;
+
+      /* Work around a strange behaviour in pgp2.  It seems that at
+         least PGP5 converts a single CR to a CR,LF too.  */
+      for (i=0; i < n; i++)
+        {
+          int c = buffer[i];
+
+          if (c == '\n' && lc == '\r')
+            gcry_md_putc (md2, c);
+          else if (c == '\n')
+            {
+              gcry_md_putc (md2, '\r');
+              gcry_md_putc (md2, c);
+            }
+          else if (c != '\n' && lc == '\r')
+            {
+              gcry_md_putc (md2, '\n');
+              gcry_md_putc (md2, c);
+            }
+          else
+            gcry_md_putc (md2, c);
+          lc = c;
+        }
     }
+  xfree (buffer);
 }
 
 
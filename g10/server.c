@@ -34,6 +34,10 @@
 #include "options.h"
 #include "../common/sysutils.h"
 #include "status.h"
+#include "main.h"
+#include "keydb.h"
+#include "trustdb.h"
+#include "filter.h"
 
 
 #define set_error(e,t) assuan_set_error (ctx, gpg_error (e), (t))
@@ -50,6 +54,8 @@ struct server_local_s
   /* List of prepared recipients.  */
   pk_list_t recplist;
 
+  /* List of signers as set by the SIGNER command.  */
+  strlist_t signerlist;
 };
 
 
@@ -153,6 +159,8 @@ reset_notify (assuan_context_t ctx, char *line)
 
   release_pk_list (ctrl->server_local->recplist);
   ctrl->server_local->recplist = NULL;
+  free_strlist (ctrl->server_local->signerlist);
+  ctrl->server_local->signerlist = NULL;
 
   close_message_fd (ctrl);
   assuan_close_input_fd (ctx);
@@ -161,6 +169,29 @@ reset_notify (assuan_context_t ctx, char *line)
 }
 
 
+/* Called by libassuan before each command.  Another process may have
+   changed the keyrings or the trustdb since the last command; in that
+   case the caches are flushed so that we don't work on stale data.  */
+static gpg_error_t
+pre_cmd_notify (assuan_context_t ctx, const char *cmd)
+{
+  int changed;
+
+  (void)ctx;
+  (void)cmd;
+
+  changed = keydb_check_changes ();
+  /* The cached keys carry the disabled flag from the trustdb.  */
+  changed |= check_trustdb_changes ();
+  if (changed)
+    {
+      getkey_disable_caches ();
+      getkey_enable_caches ();
+    }
+  return 0;
+}
+
+
 /* Called by libassuan for INPUT commands. */
 static gpg_error_t
 input_notify (assuan_context_t ctx, char *line)
@@ -259,9 +290,30 @@ cmd_recipient (assuan_context_t ctx, char *line)
 static gpg_error_t
 cmd_signer (assuan_context_t ctx, char *line)
 {
-  (void)ctx;
-  (void)line;
-  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  gpg_error_t err;
+  strlist_t sl = NULL;
+  SK_LIST sk_list = NULL;
+
+  line = skip_options (line);
+  if (!*line)
+    return set_error (GPG_ERR_ASS_PARAMETER, "no user ID given");
+
+  /* Check that the key is usable right now so that the client gets
+     an early error.  build_sk_list emits the INV_SGNR status.  */
+  add_to_strlist (&sl, line);
+  err = build_sk_list (sl, &sk_list, PUBKEY_USAGE_SIG);
+  release_sk_list (sk_list);
+  if (err)
+    {
+      free_strlist (sl);
+      log_error ("command '%s' failed: %s\n", "SIGNER", gpg_strerror (err));
+      return err;
+    }
+
+  sl->next = ctrl->server_local->signerlist;
+  ctrl->server_local->signerlist = sl;
+  return 0;
 }
 
 
@@ -442,9 +494,32 @@ cmd_verify (assuan_context_t ctx, char *line)
 static gpg_error_t
 cmd_sign (assuan_context_t ctx, char *line)
 {
-  (void)ctx;
-  (void)line;
-  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  gpg_error_t err;
+  int inp_fd, out_fd;
+  int detached;
+
+  detached = has_option (line, "--detached");
+
+  inp_fd = translate_sys2libc_fd (assuan_get_input_fd (ctx), 0);
+  if (inp_fd == -1)
+    return set_error (GPG_ERR_ASS_NO_INPUT, NULL);
+  out_fd = translate_sys2libc_fd (assuan_get_output_fd (ctx), 1);
+  if (out_fd == -1)
+    return set_error (GPG_ERR_ASS_NO_OUTPUT, NULL);
+
+  /* Without a SIGNER command the default key is used.  */
+  err = sign_fd (ctrl, inp_fd, detached, ctrl->server_local->signerlist,
+                 out_fd);
+
+  /* Close and reset the fds. */
+  close_message_fd (ctrl);
+  assuan_close_input_fd (ctx);
+  assuan_close_output_fd (ctx);
+
+  if (err)
+    log_error ("command '%s' failed: %s\n", "SIGN", gpg_strerror (err));
+  return err;
 }
 
 
@@ -456,9 +531,39 @@ cmd_sign (assuan_context_t ctx, char *line)
 static gpg_error_t
 cmd_import (assuan_context_t ctx, char *line)
 {
-  (void)ctx;
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  gpg_error_t err;
+  int inp_fd;
+  iobuf_t inp;
+  void *stats;
+
   (void)line;
-  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+
+  inp_fd = translate_sys2libc_fd (assuan_get_input_fd (ctx), 0);
+  if (inp_fd == -1)
+    return set_error (GPG_ERR_ASS_NO_INPUT, NULL);
+
+  inp = iobuf_fdopen_nc (inp_fd, "rb");
+  if (!inp)
+    err = set_error (gpg_err_code_from_syserror (), "fdopen() failed");
+  else
+    {
+      stats = import_new_stats_handle ();
+      err = import_keys_stream (ctrl, inp, stats, NULL, NULL,
+                                opt.import_options);
+      import_print_stats (stats);
+      import_release_stats_handle (stats);
+      iobuf_close (inp);
+    }
+
+  /* The import disabled the key caches; they are valid again now
+     that the keyring has been updated.  */
+  getkey_enable_caches ();
+
+  assuan_close_input_fd (ctx);
+  if (err)
+    log_error ("command '%s' failed: %s\n", "IMPORT", gpg_strerror (err));
+  return err;
 }
 
 
@@ -472,13 +577,88 @@ cmd_import (assuan_context_t ctx, char *line)
    and "--base" ospecify an output format if "--data" has been used.
    Recall that in general the output format is set with the OUTPUT
    command.
+
+   Note that only binary output is yet supported with "--data"; the
+   output fd is armored if gpg has been started with --armor.
  */
 static gpg_error_t
 cmd_export (assuan_context_t ctx, char *line)
 {
-  (void)ctx;
-  (void)line;
-  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  gpg_error_t err;
+  int use_data;
+  int out_fd;
+  char *p;
+  strlist_t list = NULL;
+  iobuf_t out;
+  armor_filter_context_t *afx = NULL;
+
+  use_data = has_option (line, "--data");
+  if (use_data
+      && (has_option (line, "--armor") || has_option (line, "--base64")))
+    return set_error (GPG_ERR_NOT_SUPPORTED, "only binary data supported");
+  line = skip_options (line);
+
+  /* Break the line down into an strlist.  */
+  while (*line)
+    {
+      while (spacep (line))
+        line++;
+      if (!*line)
+        break;
+      for (p = line; *p && !spacep (p); p++)
+        ;
+      if (*p)
+        *p++ = 0;
+      add_to_strlist (&list, line);
+      line = p;
+    }
+
+  if (use_data)
+    {
+      out = iobuf_temp ();
+      err = export_pubkeys_stream (ctrl, out, list, NULL, opt.export_options);
+      if (!err)
+        err = assuan_send_data (ctx, iobuf_get_temp_buffer (out),
+                                iobuf_get_temp_length (out));
+      iobuf_close (out);
+    }
+  else
+    {
+      out_fd = translate_sys2libc_fd (assuan_get_output_fd (ctx), 1);
+      if (out_fd == -1)
+        {
+          free_strlist (list);
+          return set_error (GPG_ERR_ASS_NO_OUTPUT, NULL);
+        }
+      out = iobuf_fdopen_nc (out_fd, "wb");
+      if (!out)
+        err = set_error (gpg_err_code_from_syserror (), "fdopen() failed");
+      else
+        {
+          if (opt.armor)
+            {
+              afx = new_armor_context ();
+              afx->what = 1;
+              push_armor_filter (afx, out);
+            }
+          err = export_pubkeys_stream (ctrl, out, list, NULL,
+                                       opt.export_options);
+          if (err)
+            iobuf_cancel (out);
+          else
+            iobuf_close (out);
+          release_armor_context (afx);
+        }
+      assuan_close_output_fd (ctx);
+    }
+
+  free_strlist (list);
+  if (err == -1)
+    err = gpg_error (GPG_ERR_NOT_FOUND);
+  if (err)
+    log_error ("command '%s' failed: %s\n", "EXPORT", gpg_strerror (err));
+  return err;
 }
 
 
@@ -722,6 +902,7 @@ gpg_server (ctrl_t ctrl)
   else
     assuan_set_hello_line (ctx, hello);
   assuan_register_reset_notify (ctx, reset_notify);
+  assuan_register_pre_cmd_notify (ctx, pre_cmd_notify);
   assuan_register_input_notify (ctx, input_notify);
   assuan_register_output_notify (ctx, output_notify);
   assuan_register_option_handler (ctx, option_handler);
@@ -761,6 +942,7 @@ gpg_server (ctrl_t ctrl)
   if (ctrl->server_local)
     {
       release_pk_list (ctrl->server_local->recplist);
+      free_strlist (ctrl->server_local->signerlist);
 
       xfree (ctrl->server_local);
       ctrl->server_local = NULL;
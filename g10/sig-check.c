@@ -263,9 +263,13 @@ do_check( PKT_public_key *pk, PKT_signature *sig, gcry_md_hd_t digest,
 {
     gcry_mpi_t result = NULL;
     int rc = 0;
+    int cached = -1;
+    byte cachekey[32];
 
     if( (rc=do_check_messages(pk,sig,r_expired,r_revoked)) )
         return rc;
+    if( (rc=sig_parse_data (sig)) )
+        return rc;
 
     /* Make sure the digest algo is enabled (in case of a detached
        signature).  */
@@ -312,11 +316,23 @@ do_check( PKT_public_key *pk, PKT_signature *sig, gcry_md_hd_t digest,
     }
     gcry_md_final( digest );
 
-    result = encode_md_value (pk, digest, sig->digest_algo );
-    if (!result)
-        return G10ERR_GENERAL;
-    rc = pk_verify( pk->pubkey_algo, result, sig->data, pk->pkey );
-    gcry_mpi_release (result);
+    /* For key signatures consult the signature cache first.  We
+       don't do this for data signatures because they are rarely
+       verified more than once.  */
+    if( sig->sig_class >= 0x10 && sig->sig_class <= 0x30 )
+	cached = sig_cache_lookup (cachekey, pk, sig, digest);
+
+    if( cached != -1 )
+	rc = cached? 0 : gpg_error (GPG_ERR_BAD_SIGNATURE);
+    else {
+	result = encode_md_value (pk, digest, sig->digest_algo );
+	if (!result)
+	    return G10ERR_GENERAL;
+	rc = pk_verify( pk->pubkey_algo, result, sig->data, pk->pkey );
+	gcry_mpi_release (result);
+	if( sig->sig_class >= 0x10 && sig->sig_class <= 0x30 )
+	    sig_cache_store (cachekey, rc);
+    }
 
     if( !rc && sig->flags.unknown_critical )
       {
@@ -0,0 +1,661 @@
+/* sigcache.c - Persistent cache of signature verification results
+ * Copyright (C) 2012 Free Software Foundation, Inc.
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The signature cache remembers the result of the public key
+   operation of a key signature verification.  Unlike the checked and
+   valid flags of a signature, which are only kept across invocations
+   if the keyring can be updated with ring trust packets, this cache
+   lives in a file of its own and thus also works with read-only or
+   shared keyrings and with any keydb backend.
+
+   An entry is identified by a SHA-256 hash over the fingerprint of
+   the signing key, the algorithms, the final digest of the signed
+   material and the signature values.  Thus any change to the key,
+   the user ID or the signature leads to a different entry; there is
+   no need to ever invalidate an entry.
+
+   The file is a magic string followed by records of SIG_CACHE_RECLEN
+   bytes: the hash, the state and a CRC-32 over both.  New records
+   are appended with one write call while holding a lock on the file.
+   The CRC allows to skip over the remains of an interrupted write.
+   If the file has grown too large or contains such garbage, it is
+   rewritten keeping only the newest records and those used by this
+   process.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "gpg.h"
+#include "util.h"
+#include "packet.h"
+#include "main.h"
+#include "options.h"
+#include "i18n.h"
+
+#define SIG_CACHE_FNAME   "sigcache" EXTSEP_S "bin"
+#define SIG_CACHE_MAGIC   "GPGSC\x02\r\n"
+#define SIG_CACHE_MAGICLEN 8
+#define SIG_CACHE_HASHLEN 32
+#define SIG_CACHE_CRCLEN  4
+#define SIG_CACHE_RECLEN  (SIG_CACHE_HASHLEN + 1 + SIG_CACHE_CRCLEN)
+
+/* If the file grows beyond this number of records it is rewritten
+   keeping at most half of them.  */
+#define SIG_CACHE_MAX_ENTRIES 200000
+
+/* Milliseconds to wait for the lock on the file.  */
+#define SIG_CACHE_LOCK_TIMEOUT 2000
+
+#if defined(HAVE_DOSISH_SYSTEM) || defined(__CYGWIN__)
+#define MY_O_BINARY  O_BINARY
+#else
+#define MY_O_BINARY  0
+#endif
+
+/* Values for the STATE field.  */
+#define SIG_CACHE_EMPTY 0
+#define SIG_CACHE_BAD   1
+#define SIG_CACHE_GOOD  2
+
+struct sig_cache_entry
+{
+  byte hash[SIG_CACHE_HASHLEN];
+  byte state;
+  unsigned int used:1;     /* Looked up by this process.  */
+  unsigned int written:1;  /* Already written by compact_sig_cache.  */
+};
+
+/* Set by sig_cache_enable.  */
+static int sig_cache_enabled;
+
+/* True if we already tried to load the file.  */
+static int sig_cache_loaded;
+
+/* Open addressed hash table with SIG_CACHE_SIZE slots (a power of
+   2) of which SIG_CACHE_USED are in use.  */
+static struct sig_cache_entry *sig_cache;
+static size_t sig_cache_size;
+static size_t sig_cache_used;
+
+/* Records not yet written to the file.  */
+static byte *sig_cache_pending;
+static size_t sig_cache_npending;
+static size_t sig_cache_maxpending;
+
+/* Number of records in the file and number of bytes in it which
+   are not part of a valid record.  */
+static size_t sig_cache_nfile;
+static size_t sig_cache_garbage;
+
+/* Statistics for the debug output.  */
+static unsigned long sig_cache_hits, sig_cache_misses;
+
+
+
+static struct sig_cache_entry *
+find_slot (const byte *hash)
+{
+  size_t idx;
+
+  idx = ((hash[0] << 24) | (hash[1] << 16) | (hash[2] << 8) | hash[3]);
+  idx &= sig_cache_size - 1;
+  while (sig_cache[idx].state != SIG_CACHE_EMPTY
+         && memcmp (sig_cache[idx].hash, hash, SIG_CACHE_HASHLEN))
+    idx = (idx + 1) & (sig_cache_size - 1);
+  return sig_cache + idx;
+}
+
+
+/* Add HASH with STATE to the table.  Returns true if it was not yet
+   in the table.  */
+static int
+insert_entry (const byte *hash, byte state)
+{
+  struct sig_cache_entry *e;
+
+  if (state != SIG_CACHE_BAD && state != SIG_CACHE_GOOD)
+    return 0;  /* Corrupted record.  */
+
+  /* Keep the load factor below 1/2.  */
+  if ((sig_cache_used + 1) * 2 > sig_cache_size)
+    {
+      struct sig_cache_entry *old = sig_cache;
+      size_t n, oldsize = sig_cache_size;
+
+      sig_cache_size = oldsize? oldsize * 2 : 1024;
+      sig_cache = xcalloc (sig_cache_size, sizeof *sig_cache);
+      for (n=0; n < oldsize; n++)
+        if (old[n].state != SIG_CACHE_EMPTY)
+          *find_slot (old[n].hash) = old[n];
+      xfree (old);
+    }
+
+  e = find_slot (hash);
+  if (e->state != SIG_CACHE_EMPTY)
+    return 0;
+  memcpy (e->hash, hash, SIG_CACHE_HASHLEN);
+  e->state = state;
+  e->used = 0;
+  e->written = 0;
+  sig_cache_used++;
+  return 1;
+}
+
+
+/* Store the CRC of the hash and state of record REC in REC.  */
+static void
+set_record_crc (byte *rec)
+{
+  gcry_md_hash_buffer (GCRY_MD_CRC32, rec + SIG_CACHE_HASHLEN + 1,
+                       rec, SIG_CACHE_HASHLEN + 1);
+}
+
+
+static int
+record_valid_p (const byte *rec)
+{
+  byte crc[SIG_CACHE_CRCLEN];
+
+  if (rec[SIG_CACHE_HASHLEN] != SIG_CACHE_BAD
+      && rec[SIG_CACHE_HASHLEN] != SIG_CACHE_GOOD)
+    return 0;
+  gcry_md_hash_buffer (GCRY_MD_CRC32, crc, rec, SIG_CACHE_HASHLEN + 1);
+  return !memcmp (crc, rec + SIG_CACHE_HASHLEN + 1, SIG_CACHE_CRCLEN);
+}
+
+
+/* Return the next valid record of the file image BUF of LEN bytes
+   starting at *POS and advance *POS behind it.  Bytes which do not
+   belong to a valid record are skipped and counted in *R_GARBAGE.
+   Returns NULL at the end of the image.  */
+static const byte *
+next_record (const byte *buf, size_t len, size_t *pos, size_t *r_garbage)
+{
+  const byte *rec;
+
+  while (*pos + SIG_CACHE_RECLEN <= len)
+    {
+      rec = buf + *pos;
+      if (record_valid_p (rec))
+        {
+          *pos += SIG_CACHE_RECLEN;
+          return rec;
+        }
+      /* Misaligned or damaged; try to resync at the next byte.  */
+      (*pos)++;
+      (*r_garbage)++;
+    }
+  if (*pos < len)
+    *r_garbage += len - *pos;
+  *pos = len;
+  return NULL;
+}
+
+
+/* Read the entire file FNAME.  A missing file is returned as empty
+   file.  */
+static gpg_error_t
+read_cache_file (const char *fname, byte **r_buf, size_t *r_len)
+{
+  gpg_error_t err = 0;
+  estream_t fp;
+  byte *buf = NULL;
+  size_t len = 0, size = 0, n;
+
+  *r_buf = NULL;
+  *r_len = 0;
+  fp = es_fopen (fname, "rb");
+  if (!fp)
+    return errno == ENOENT? 0 : gpg_error_from_syserror ();
+
+  for (;;)
+    {
+      if (len == size)
+        {
+          size = size? 2 * size : 8192;
+          buf = xrealloc (buf, size);
+        }
+      n = es_fread (buf + len, 1, size - len, fp);
+      if (!n)
+        break;
+      len += n;
+    }
+  if (es_ferror (fp))
+    {
+      err = gpg_error_from_syserror ();
+      xfree (buf);
+    }
+  else
+    {
+      *r_buf = buf;
+      *r_len = len;
+    }
+  es_fclose (fp);
+  return err;
+}
+
+
+static void
+load_sig_cache (void)
+{
+  gpg_error_t err;
+  char *fname;
+  byte *buf;
+  const byte *rec;
+  size_t len, pos;
+
+  sig_cache_loaded = 1;
+  fname = make_filename (opt.homedir, SIG_CACHE_FNAME, NULL);
+  err = read_cache_file (fname, &buf, &len);
+  if (err)
+    {
+      log_info (_("can't open '%s': %s\n"), fname, gpg_strerror (err));
+      xfree (fname);
+      return;
+    }
+
+  if (!len)
+    ;
+  else if (len < SIG_CACHE_MAGICLEN
+           || memcmp (buf, SIG_CACHE_MAGIC, SIG_CACHE_MAGICLEN))
+    {
+      log_info ("'%s' is not a signature cache - ignored\n", fname);
+      /* Have sig_cache_flush replace the entire file.  */
+      sig_cache_garbage = len;
+    }
+  else
+    {
+      pos = SIG_CACHE_MAGICLEN;
+      while ((rec = next_record (buf, len, &pos, &sig_cache_garbage)))
+        {
+          insert_entry (rec, rec[SIG_CACHE_HASHLEN]);
+          sig_cache_nfile++;
+        }
+    }
+  xfree (buf);
+
+  if (DBG_CACHE)
+    log_debug ("sigcache: loaded %lu entries (%lu bytes garbage) from '%s'\n",
+               (unsigned long)sig_cache_used,
+               (unsigned long)sig_cache_garbage, fname);
+  xfree (fname);
+}
+
+
+/* Compute the cache key for a signature SIG made by PK.  DIGEST is
+   the finalized hash context of the signed material.  */
+static void
+compute_key (byte *hash, PKT_public_key *pk, PKT_signature *sig,
+             gcry_md_hd_t digest)
+{
+  gcry_md_hd_t md;
+  byte fpr[MAX_FINGERPRINT_LEN];
+  byte buf[3];
+  size_t fprlen, n;
+  int i, nsig;
+
+  if (gcry_md_open (&md, GCRY_MD_SHA256, 0))
+    BUG ();
+
+  fingerprint_from_pk (pk, fpr, &fprlen);
+  buf[0] = fprlen;
+  buf[1] = sig->pubkey_algo;
+  buf[2] = sig->digest_algo;
+  gcry_md_write (md, buf, 3);
+  gcry_md_write (md, fpr, fprlen);
+  gcry_md_write (md, gcry_md_read (digest, sig->digest_algo),
+                 gcry_md_get_algo_dlen (sig->digest_algo));
+
+  sig_parse_data (sig);
+  nsig = pubkey_get_nsig (sig->pubkey_algo);
+  for (i=0; i < nsig; i++)
+    {
+      unsigned char *p;
+
+      if (!sig->data[i]
+          || gcry_mpi_aprint (GCRYMPI_FMT_PGP, &p, &n, sig->data[i]))
+        {
+          gcry_md_putc (md, 0);
+          continue;
+        }
+      gcry_md_putc (md, 1);
+      gcry_md_write (md, p, n);
+      gcry_free (p);
+    }
+
+  gcry_md_final (md);
+  memcpy (hash, gcry_md_read (md, GCRY_MD_SHA256), SIG_CACHE_HASHLEN);
+  gcry_md_close (md);
+}
+
+
+/* Enable the use of the signature cache file.  This is called by
+   gpg after the home directory is known; other tools linking the
+   signature checking code don't use the cache.  */
+void
+sig_cache_enable (void)
+{
+  sig_cache_enabled = 1;
+}
+
+
+/* Look up the result of verifying SIG made by PK over DIGEST.
+   Returns -1 if not known, 0 for a bad and 1 for a good signature.
+   HASH receives the cache key to be used with sig_cache_store.  */
+int
+sig_cache_lookup (byte *hash, PKT_public_key *pk, PKT_signature *sig,
+                  gcry_md_hd_t digest)
+{
+  struct sig_cache_entry *e;
+
+  if (!sig_cache_enabled || opt.no_sig_cache)
+    return -1;
+  if (!sig_cache_loaded)
+    load_sig_cache ();
+
+  compute_key (hash, pk, sig, digest);
+  if (!sig_cache_size)
+    {
+      sig_cache_misses++;
+      return -1;
+    }
+  e = find_slot (hash);
+  if (e->state == SIG_CACHE_EMPTY)
+    {
+      sig_cache_misses++;
+      return -1;
+    }
+  e->used = 1;
+  sig_cache_hits++;
+  return e->state == SIG_CACHE_GOOD;
+}
+
+
+/* Store the result RC of a signature verification with the key HASH
+   as computed by sig_cache_lookup.  Only good and bad signatures are
+   stored; other errors may be temporary.  */
+void
+sig_cache_store (const byte *hash, int rc)
+{
+  byte state, *rec;
+
+  if (!sig_cache_enabled || opt.no_sig_cache)
+    return;
+
+  if (!rc)
+    state = SIG_CACHE_GOOD;
+  else if (gpg_err_code (rc) == GPG_ERR_BAD_SIGNATURE)
+    state = SIG_CACHE_BAD;
+  else
+    return;
+
+  if (!insert_entry (hash, state))
+    return;
+
+  if (sig_cache_npending == sig_cache_maxpending)
+    {
+      sig_cache_maxpending = sig_cache_maxpending? 2*sig_cache_maxpending:64;
+      sig_cache_pending = xrealloc (sig_cache_pending,
+                                    sig_cache_maxpending * SIG_CACHE_RECLEN);
+    }
+  rec = sig_cache_pending + sig_cache_npending * SIG_CACHE_RECLEN;
+  memcpy (rec, hash, SIG_CACHE_HASHLEN);
+  rec[SIG_CACHE_HASHLEN] = state;
+  set_record_crc (rec);
+  sig_cache_npending++;
+}
+
+
+/* Append the pending records to the cache file FNAME using a single
+   write.  The caller must hold the lock.  */
+static gpg_error_t
+append_sig_cache (const char *fname)
+{
+  gpg_error_t err = 0;
+  int fd;
+  struct stat st;
+  byte *buf;
+  size_t len;
+  ssize_t n;
+
+  fd = open (fname, O_WRONLY | O_APPEND | O_CREAT | MY_O_BINARY,
+             S_IRUSR | S_IWUSR);
+  if (fd == -1)
+    return gpg_error_from_syserror ();
+  if (fstat (fd, &st))
+    {
+      err = gpg_error_from_syserror ();
+      close (fd);
+      return err;
+    }
+
+  len = sig_cache_npending * SIG_CACHE_RECLEN;
+  if (!st.st_size)
+    {
+      buf = xmalloc (SIG_CACHE_MAGICLEN + len);
+      memcpy (buf, SIG_CACHE_MAGIC, SIG_CACHE_MAGICLEN);
+      memcpy (buf + SIG_CACHE_MAGICLEN, sig_cache_pending, len);
+      len += SIG_CACHE_MAGICLEN;
+    }
+  else
+    buf = sig_cache_pending;
+
+  n = write (fd, buf, len);
+  if (n == -1)
+    err = gpg_error_from_syserror ();
+  else if ((size_t)n != len)
+    err = gpg_error (GPG_ERR_EIO);  /* A partial record is garbage.  */
+  else
+    sig_cache_nfile += sig_cache_npending;
+  if (close (fd) && !err)
+    err = gpg_error_from_syserror ();
+  if (buf != sig_cache_pending)
+    xfree (buf);
+  return err;
+}
+
+
+/* Return the table entry for the record REC or NULL.  */
+static struct sig_cache_entry *
+lookup_record (const byte *rec)
+{
+  struct sig_cache_entry *e;
+
+  if (!sig_cache_size)
+    return NULL;
+  e = find_slot (rec);
+  return e->state == SIG_CACHE_EMPTY? NULL : e;
+}
+
+
+/* Write a new cache file FNAME with the valid records of the current
+   file and the pending ones.  If there are too many, only half of
+   SIG_CACHE_MAX_ENTRIES old records are kept: those looked up by
+   this process and then the newest ones.  The caller must hold the
+   lock.  */
+static gpg_error_t
+compact_sig_cache (const char *fname)
+{
+  gpg_error_t err;
+  char *tmpfname;
+  estream_t fp;
+  byte *buf, *rec;
+  const byte *frec;
+  struct sig_cache_entry *e;
+  size_t len, pos, garbage, nvalid, nused, nkeep, n, nwritten;
+  size_t skip_used, skip_unused, used_seen, unused_seen;
+
+  err = read_cache_file (fname, &buf, &len);
+  if (err)
+    return err;
+  if (len < SIG_CACHE_MAGICLEN
+      || memcmp (buf, SIG_CACHE_MAGIC, SIG_CACHE_MAGICLEN))
+    len = 0;  /* Not a signature cache; replace it.  */
+
+  nvalid = nused = garbage = 0;
+  pos = SIG_CACHE_MAGICLEN;
+  while ((frec = next_record (buf, len, &pos, &garbage)))
+    {
+      nvalid++;
+      e = lookup_record (frec);
+      if (e && e->used)
+        nused++;
+    }
+
+  /* Compute how many of the oldest used and unused records to drop.  */
+  skip_used = skip_unused = 0;
+  if (nvalid + sig_cache_npending > SIG_CACHE_MAX_ENTRIES)
+    {
+      nkeep = SIG_CACHE_MAX_ENTRIES / 2;
+      if (nused >= nkeep)
+        {
+          skip_used = nused - nkeep;
+          skip_unused = nvalid - nused;
+        }
+      else if (nvalid > nkeep)
+        skip_unused = nvalid - nkeep;
+    }
+
+  tmpfname = xstrconcat (fname, EXTSEP_S "tmp", NULL);
+  fp = es_fopen (tmpfname, "wb,mode=-rw");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  es_fwrite (SIG_CACHE_MAGIC, SIG_CACHE_MAGICLEN, 1, fp);
+
+  nwritten = used_seen = unused_seen = 0;
+  pos = SIG_CACHE_MAGICLEN;
+  while ((frec = next_record (buf, len, &pos, &garbage)))
+    {
+      e = lookup_record (frec);
+      if (e && e->used)
+        {
+          if (used_seen++ < skip_used)
+            continue;
+        }
+      else if (unused_seen++ < skip_unused)
+        continue;
+      if (e)
+        {
+          if (e->written)
+            continue;  /* Duplicate.  */
+          e->written = 1;
+        }
+      es_fwrite (frec, SIG_CACHE_RECLEN, 1, fp);
+      nwritten++;
+    }
+  for (n=0; n < sig_cache_npending; n++)
+    {
+      rec = sig_cache_pending + n * SIG_CACHE_RECLEN;
+      e = find_slot (rec);
+      if (e->written)
+        continue;
+      e->written = 1;
+      es_fwrite (rec, SIG_CACHE_RECLEN, 1, fp);
+      nwritten++;
+    }
+  for (n=0; n < sig_cache_size; n++)
+    sig_cache[n].written = 0;
+
+  if (es_ferror (fp))
+    {
+      err = gpg_error_from_syserror ();
+      es_fclose (fp);
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+  if (es_fclose (fp))
+    {
+      err = gpg_error_from_syserror ();
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+
+#ifdef HAVE_DOSISH_SYSTEM
+  gnupg_remove (fname);
+#endif
+  if (rename (tmpfname, fname))
+    {
+      err = gpg_error_from_syserror ();
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+  if (DBG_CACHE)
+    log_debug ("sigcache: rewrote '%s' with %lu of %lu entries\n",
+               fname, (unsigned long)nwritten,
+               (unsigned long)(nvalid + sig_cache_npending));
+  sig_cache_nfile = nwritten;
+  sig_cache_garbage = 0;
+
+ leave:
+  xfree (tmpfname);
+  xfree (buf);
+  return err;
+}
+
+
+/* Write the new entries to the cache file.  Errors are not fatal:
+   a read-only home directory just means that nothing is cached
+   across invocations.  */
+void
+sig_cache_flush (void)
+{
+  gpg_error_t err;
+  char *fname;
+  dotlock_t lockhd;
+
+  if (DBG_CACHE && sig_cache_loaded)
+    log_debug ("sigcache: %lu hits, %lu misses, %lu new entries\n",
+               sig_cache_hits, sig_cache_misses,
+               (unsigned long)sig_cache_npending);
+  if (!sig_cache_npending)
+    return;
+
+  fname = make_filename (opt.homedir, SIG_CACHE_FNAME, NULL);
+  lockhd = dotlock_create (fname, 0);
+  if (!lockhd || dotlock_take (lockhd, SIG_CACHE_LOCK_TIMEOUT))
+    {
+      if (opt.verbose)
+        log_info (_("can't lock '%s'\n"), fname);
+      goto leave;
+    }
+
+  if (sig_cache_garbage
+      || sig_cache_nfile + sig_cache_npending > SIG_CACHE_MAX_ENTRIES)
+    err = compact_sig_cache (fname);
+  else
+    err = append_sig_cache (fname);
+  if (err && opt.verbose)
+    log_info (_("error writing '%s': %s\n"), fname, gpg_strerror (err));
+  dotlock_release (lockhd);
+
+ leave:
+  dotlock_destroy (lockhd);
+  sig_cache_npending = 0;
+  xfree (fname);
+}
@@ -653,16 +653,9 @@ write_plaintext_packet (IOBUF out, IOBUF inp, const char *fname, int ptmode)
         pt->buf = NULL;
     }
     else {
-        byte copy_buffer[4096];
-        int  bytes_copied;
-
-        while ((bytes_copied = iobuf_read(inp, copy_buffer, 4096)) != -1)
-            if ( (rc=iobuf_write(out, copy_buffer, bytes_copied)) ) {
-                log_error ("copying input to output failed: %s\n",
-                           gpg_strerror (rc));
-                break;
-            }
-        wipememory(copy_buffer,4096); /* burn buffer */
+        if ( (rc=iobuf_copy (out, inp, NULL)) )
+            log_error ("copying input to output failed: %s\n",
+                       gpg_strerror (rc));
     }
     /* fixme: it seems that we never freed pt/pkt */
 
@@ -748,21 +741,12 @@ write_signature_packets (SK_LIST sk_list, IOBUF out, gcry_md_hd_t hash,
 }
 
 
-/****************
- * Sign the files whose names are in FILENAME.
- * If DETACHED has the value true,
- * make a detached signature.  If FILENAMES->d is NULL read from stdin
- * and ignore the detached mode.  Sign the file with all secret keys
- * which can be taken from LOCUSR, if this is NULL, use the default one
- * If ENCRYPTFLAG is true, use REMUSER (or ask if it is NULL) to encrypt the
- * signed data for these users.
- * If OUTFILE is not NULL; this file is used for output and the function
- * does not ask for overwrite permission; output is then always
- * uncompressed, non-armored and in binary mode.
- */
-int
-sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
-	   int encryptflag, strlist_t remusr, const char *outfile )
+/* Worker for sign_file and sign_fd.  If INP_FD or OUT_FD are not -1
+   they are used instead of the first file name and the output file.  */
+static int
+do_sign_file (ctrl_t ctrl, strlist_t filenames, int inp_fd, int detached,
+              strlist_t locusr, int encryptflag, strlist_t remusr,
+              const char *outfile, int out_fd)
 {
     const char *fname;
     armor_filter_context_t *afx;
@@ -829,7 +813,10 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
     if( multifile )  /* have list of filenames */
 	inp = NULL; /* we do it later */
     else {
-      inp = iobuf_open(fname);
+      if (inp_fd != -1)
+        inp = iobuf_fdopen_nc (inp_fd, "rb");
+      else
+        inp = iobuf_open(fname);
       if (inp && is_secured_file (iobuf_get_fd (inp)))
         {
           iobuf_close (inp);
@@ -863,7 +850,7 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
 	else if( opt.verbose )
 	    log_info(_("writing to '%s'\n"), outfile );
     }
-    else if( (rc = open_outfile (GNUPG_INVALID_FD, fname,
+    else if( (rc = open_outfile (out_fd, fname,
                                  opt.armor? 1: detached? 2:0, &out )))
 	goto leave;
 
@@ -1052,7 +1039,7 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
 		    iobuf_push_filter( inp, text_filter, &tfx );
 		  }
 		iobuf_push_filter( inp, md_filter, &mfx );
-		while( iobuf_get(inp) != -1 )
+		while( iobuf_read (inp, NULL, 1<<30) != -1 )
 		    ;
 		iobuf_close(inp); inp = NULL;
 	    }
@@ -1061,7 +1048,7 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
 	}
 	else {
 	    /* read, so that the filter can calculate the digest */
-	    while( iobuf_get(inp) != -1 )
+	    while( iobuf_read (inp, NULL, 1<<30) != -1 )
 		;
 	}
     }
@@ -1101,6 +1088,37 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
 }
 
 
+/****************
+ * Sign the files whose names are in FILENAME.
+ * If DETACHED has the value true,
+ * make a detached signature.  If FILENAMES->d is NULL read from stdin
+ * and ignore the detached mode.  Sign the file with all secret keys
+ * which can be taken from LOCUSR, if this is NULL, use the default one
+ * If ENCRYPTFLAG is true, use REMUSER (or ask if it is NULL) to encrypt the
+ * signed data for these users.
+ * If OUTFILE is not NULL; this file is used for output and the function
+ * does not ask for overwrite permission; output is then always
+ * uncompressed, non-armored and in binary mode.
+ */
+int
+sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
+	   int encryptflag, strlist_t remusr, const char *outfile )
+{
+  return do_sign_file (ctrl, filenames, -1, detached, locusr,
+                       encryptflag, remusr, outfile, -1);
+}
+
+
+/* Sign the data read from INP_FD and write the signature or the
+   signed data to OUT_FD.  This is used by the server.  */
+int
+sign_fd (ctrl_t ctrl, int inp_fd, int detached, strlist_t locusr, int out_fd)
+{
+  return do_sign_file (ctrl, NULL, inp_fd, detached, locusr,
+                       0, NULL, NULL, out_fd);
+}
+
+
 
 /****************
  * make a clear signature. note that opt.armor is not needed
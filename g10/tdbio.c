@@ -23,10 +23,14 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
 
 #include "gpg.h"
 #include "status.h"
@@ -57,27 +61,45 @@
 #endif
 
 /****************
- * Yes, this is a very simple implementation. We should really
- * use a page aligned buffer and read complete pages.
- * To implement a simple trannsaction system, this is sufficient.
+ * The record cache.  Records are found using a hash table on the
+ * record number and are kept in a list ordered by their last use, so
+ * that the least recently used clean records are dropped first when
+ * the cache reaches its size limit.  Dirty records are written back
+ * in the order of their record numbers by tdbio_sync.
  */
 typedef struct cache_ctrl_struct *CACHE_CTRL;
 struct cache_ctrl_struct {
-    CACHE_CTRL next;
+    CACHE_CTRL next;      /* Next item in the hash bucket.  */
+    CACHE_CTRL lru_prev;  /* Next more recently used item.  */
+    CACHE_CTRL lru_next;  /* Next less recently used item.  */
     struct {
-	unsigned used:1;
 	unsigned dirty:1;
     } flags;
     ulong recno;
     char data[TRUST_RECORD_LEN];
 };
 
-#define MAX_CACHE_ENTRIES_SOFT	200    /* may be increased while in a */
-#define MAX_CACHE_ENTRIES_HARD	10000  /* transaction to this one */
-static CACHE_CTRL cache_list;
+#define DEFAULT_CACHE_SIZE	1024   /* in KiB; see --trustdb-cache-size */
+#define MAX_CACHE_ENTRIES_HARD	10000  /* at least allowed in a transaction */
+#define WRITE_BATCH		64     /* max. records written at once */
+static CACHE_CTRL *cache_tbl;        /* The hash table.  */
+static unsigned int cache_tbl_size;  /* Number of buckets; a power of 2. */
+static CACHE_CTRL cache_lru_head;    /* The most recently used item.  */
+static CACHE_CTRL cache_lru_tail;    /* The least recently used item.  */
 static int cache_entries;
+static int cache_max_entries;
+static int cache_dirty_count;
 static int cache_is_dirty;
 
+/* Statistics of the record cache.  */
+static struct {
+    ulong hits;
+    ulong misses;
+    ulong dropped;
+    ulong records_written;
+    ulong writes;
+} cache_stats;
+
 /* a type used to pass infomation to cmp_krec_fpr */
 struct cmp_krec_fpr_struct {
     int pubkey_algo;
@@ -98,6 +120,14 @@ static int is_locked;
 static int  db_fd = -1;
 static int in_transaction;
 
+/* The mapped trustdb if --trustdb-mmap is used.  */
+static struct {
+    byte *image;
+    size_t size;
+    int writable;
+    int failed;  /* Set if mapping failed; don't try again.  */
+} db_map;
+
 static void open_db(void);
 
 
@@ -106,6 +136,139 @@ static void open_db(void);
  ************* record cache **********
  *************************************/
 
+static void
+init_cache (void)
+{
+    ulong size;
+
+    size = opt.trustdb_cache_size? opt.trustdb_cache_size : DEFAULT_CACHE_SIZE;
+    size = size * 1024 / sizeof (struct cache_ctrl_struct);
+    cache_max_entries = size < 16? 16 : size > INT_MAX? INT_MAX : size;
+    for (cache_tbl_size = 256; cache_tbl_size < cache_max_entries / 2
+           && cache_tbl_size < (1 << 24); cache_tbl_size <<= 1 )
+	;
+    cache_tbl = xcalloc (cache_tbl_size, sizeof *cache_tbl);
+}
+
+static void
+lru_unlink (CACHE_CTRL r)
+{
+    if (r->lru_prev)
+	r->lru_prev->lru_next = r->lru_next;
+    else
+	cache_lru_head = r->lru_next;
+    if (r->lru_next)
+	r->lru_next->lru_prev = r->lru_prev;
+    else
+	cache_lru_tail = r->lru_prev;
+}
+
+static void
+lru_push (CACHE_CTRL r)
+{
+    r->lru_prev = NULL;
+    r->lru_next = cache_lru_head;
+    if (cache_lru_head)
+	cache_lru_head->lru_prev = r;
+    else
+	cache_lru_tail = r;
+    cache_lru_head = r;
+}
+
+/****************
+ * Return the cache item for RECNO or NULL.  The item is marked as
+ * the most recently used one.
+ */
+static CACHE_CTRL
+lookup_cache (ulong recno)
+{
+    CACHE_CTRL r;
+
+    if (!cache_tbl)
+	return NULL;
+    for (r = cache_tbl[recno & (cache_tbl_size - 1)]; r; r = r->next) {
+	if (r->recno == recno) {
+	    if (r != cache_lru_head) {
+		lru_unlink (r);
+		lru_push (r);
+	    }
+	    return r;
+	}
+    }
+    return NULL;
+}
+
+static void
+drop_cache_item (CACHE_CTRL r)
+{
+    CACHE_CTRL *rp;
+
+    for (rp = &cache_tbl[r->recno & (cache_tbl_size - 1)]; *rp != r;
+         rp = &(*rp)->next)
+	;
+    *rp = r->next;
+    lru_unlink (r);
+    if (r->flags.dirty)
+	cache_dirty_count--;
+    xfree (r);
+    cache_entries--;
+    cache_stats.dropped++;
+}
+
+static void
+mark_cache_item_dirty (CACHE_CTRL r)
+{
+    if (!r->flags.dirty) {
+	r->flags.dirty = 1;
+	cache_dirty_count++;
+    }
+    cache_is_dirty = 1;
+}
+
+/****************
+ * Make sure that record RECNO is covered by the mapping of the
+ * trustdb, mapping the file again if it has grown.  Returns true if
+ * the record can be accessed in db_map.image.
+ */
+static int
+map_db (ulong recno)
+{
+#ifdef HAVE_MMAP
+    struct stat st;
+    void *image;
+    size_t need = (recno + 1) * TRUST_RECORD_LEN;
+
+    if (!opt.trustdb_mmap || db_map.failed)
+	return 0;
+    if (need <= db_map.size)
+	return 1;
+    if (fstat (db_fd, &st) || (size_t)st.st_size < need)
+	return 0;
+
+    if (db_map.image)
+	munmap (db_map.image, db_map.size);
+    db_map.writable = ((fcntl (db_fd, F_GETFL) & O_ACCMODE) == O_RDWR);
+    image = mmap (NULL, (size_t)st.st_size,
+		  db_map.writable? (PROT_READ|PROT_WRITE) : PROT_READ,
+		  MAP_SHARED, db_fd, 0);
+    if (image == MAP_FAILED) {
+	log_info ("can't map '%s': %s - not using mmap\n",
+		  db_name, strerror (errno));
+	db_map.image = NULL;
+	db_map.size = 0;
+	db_map.failed = 1;
+	return 0;
+    }
+    db_map.image = image;
+    db_map.size = (size_t)st.st_size;
+    return 1;
+#else
+    (void)recno;
+    return 0;
+#endif
+}
+
+
 /****************
  * Get the data from therecord cache and return a
  * pointer into that cache.  Caller should copy
@@ -116,180 +279,219 @@ get_record_from_cache( ulong recno )
 {
     CACHE_CTRL r;
 
-    for( r = cache_list; r; r = r->next ) {
-	if( r->flags.used && r->recno == recno )
-	    return r->data;
+    r = lookup_cache (recno);
+    if (!r) {
+	cache_stats.misses++;
+	return NULL;
     }
-    return NULL;
+    cache_stats.hits++;
+    return r->data;
 }
 
 
+/****************
+ * Write the N cache items of LIST with consecutive record numbers
+ * using one write call.
+ */
 static int
-write_cache_item( CACHE_CTRL r )
+write_cache_items (CACHE_CTRL *list, int n)
 {
     gpg_error_t err;
-    int n;
+    char buf[WRITE_BATCH * TRUST_RECORD_LEN];
+    int i, nbytes;
+
+    assert (n > 0 && n <= WRITE_BATCH);
+
+    if (db_map.writable && map_db (list[n-1]->recno)) {
+	/* Storing into the shared mapping is all we need to do; the
+	   kernel writes the pages back to the file.  tdbio_sync only
+	   schedules that early using msync with MS_ASYNC.  */
+	for (i=0; i < n; i++) {
+	    memcpy (db_map.image + list[i]->recno * TRUST_RECORD_LEN,
+		    list[i]->data, TRUST_RECORD_LEN);
+	    list[i]->flags.dirty = 0;
+	    cache_dirty_count--;
+	}
+	cache_stats.records_written += n;
+	return 0;
+    }
+
+    for (i=0; i < n; i++)
+	memcpy (buf + i * TRUST_RECORD_LEN, list[i]->data, TRUST_RECORD_LEN);
+    nbytes = n * TRUST_RECORD_LEN;
 
-    if( lseek( db_fd, r->recno * TRUST_RECORD_LEN, SEEK_SET ) == -1 ) {
+    if( lseek( db_fd, list[0]->recno * TRUST_RECORD_LEN, SEEK_SET ) == -1 ) {
         err = gpg_error_from_syserror ();
 	log_error(_("trustdb rec %lu: lseek failed: %s\n"),
-					    r->recno, strerror(errno) );
+					    list[0]->recno, strerror(errno) );
 	return err;
     }
-    n = write( db_fd, r->data, TRUST_RECORD_LEN);
-    if( n != TRUST_RECORD_LEN ) {
+    i = write( db_fd, buf, nbytes);
+    if( i != nbytes ) {
         err = gpg_error_from_syserror ();
 	log_error(_("trustdb rec %lu: write failed (n=%d): %s\n"),
-					    r->recno, n, strerror(errno) );
+					    list[0]->recno, i, strerror(errno) );
 	return err;
     }
-    r->flags.dirty = 0;
+    for (i=0; i < n; i++) {
+	list[i]->flags.dirty = 0;
+	cache_dirty_count--;
+    }
+    cache_stats.records_written += n;
+    cache_stats.writes++;
     return 0;
 }
 
+static int
+cmp_cache_recno (const void *a_arg, const void *b_arg)
+{
+    CACHE_CTRL a = *(const CACHE_CTRL *)a_arg;
+    CACHE_CTRL b = *(const CACHE_CTRL *)b_arg;
+
+    return a->recno < b->recno? -1 : a->recno > b->recno;
+}
+
 /****************
- * Put data into the cache.  This function may flush the
- * some cache entries if there is not enough space available.
+ * Write all dirty records in the order of their record numbers.
+ * Runs of adjacent records are written with one write call.
  */
-int
-put_record_into_cache( ulong recno, const char *data )
+static int
+write_dirty_records (void)
 {
-    CACHE_CTRL r, unused;
-    int dirty_count = 0;
-    int clean_count = 0;
+    CACHE_CTRL r, *list;
+    int n, i, j, rc = 0;
 
-    /* see whether we already cached this one */
-    for( unused = NULL, r = cache_list; r; r = r->next ) {
-	if( !r->flags.used ) {
-	    if( !unused )
-		unused = r;
-	}
-	else if( r->recno == recno ) {
-	    if( !r->flags.dirty ) {
-		/* Hmmm: should we use a a copy and compare? */
-		if( memcmp(r->data, data, TRUST_RECORD_LEN ) ) {
-		    r->flags.dirty = 1;
-		    cache_is_dirty = 1;
-		}
-	    }
-	    memcpy( r->data, data, TRUST_RECORD_LEN );
-	    return 0;
-	}
-	if( r->flags.used ) {
-	    if( r->flags.dirty )
-		dirty_count++;
-	    else
-		clean_count++;
-	}
-    }
-    /* not in the cache: add a new entry */
-    if( unused ) { /* reuse this entry */
-	r = unused;
-	r->flags.used = 1;
-	r->recno = recno;
-	memcpy( r->data, data, TRUST_RECORD_LEN );
-	r->flags.dirty = 1;
-	cache_is_dirty = 1;
-	cache_entries++;
+    if (!cache_dirty_count)
 	return 0;
+    list = xtrymalloc (cache_dirty_count * sizeof *list);
+    if (!list)
+	return gpg_error_from_syserror ();
+    for (n=0, r = cache_lru_head; r; r = r->lru_next)
+	if (r->flags.dirty)
+	    list[n++] = r;
+    assert (n == cache_dirty_count);
+    qsort (list, n, sizeof *list, cmp_cache_recno);
+
+    for (i=0; !rc && i < n; i = j) {
+	for (j = i + 1; j < n && j - i < WRITE_BATCH
+		 && list[j]->recno == list[j-1]->recno + 1; j++)
+	    ;
+	rc = write_cache_items (list + i, j - i);
     }
-    /* see whether we reached the limit */
-    if( cache_entries < MAX_CACHE_ENTRIES_SOFT ) { /* no */
-	r = xmalloc( sizeof *r );
-	r->flags.used = 1;
-	r->recno = recno;
-	memcpy( r->data, data, TRUST_RECORD_LEN );
-	r->flags.dirty = 1;
-	r->next = cache_list;
-	cache_list = r;
-	cache_is_dirty = 1;
-	cache_entries++;
-	return 0;
-    }
-    /* cache is full: discard some clean entries */
-    if( clean_count ) {
-	int n = clean_count / 3; /* discard a third of the clean entries */
-	if( !n )
-	    n = 1;
-	for( unused = NULL, r = cache_list; r; r = r->next ) {
-	    if( r->flags.used && !r->flags.dirty ) {
-		if( !unused )
-		    unused = r;
-		r->flags.used = 0;
-		cache_entries--;
-		if( !--n )
-		    break;
+    xfree (list);
+    return rc;
+}
+
+
+/****************
+ * Create a new cache item for RECNO and store it at R_ITEM.  If the
+ * cache is full, the least recently used clean item is dropped.  If
+ * there is none and DIRTY is set, the dirty items are written back
+ * first; if DIRTY is not set, NULL is stored instead.
+ */
+static int
+new_cache_item (ulong recno, int dirty, CACHE_CTRL *r_item)
+{
+    CACHE_CTRL r, *bucket;
+    int rc;
+
+    *r_item = NULL;
+    if (!cache_tbl)
+	init_cache ();
+
+    if (cache_entries >= cache_max_entries) {
+	for (r = cache_lru_tail; r && r->flags.dirty; r = r->lru_prev)
+	    ;
+	if (r)
+	    ;
+	else if (!dirty)
+	    return 0;  /* Not worth a write just to cache a read.  */
+	else if (in_transaction) {
+	    /* We can't write while in a transaction, thus we increase
+	     * the cache size instead */
+	    if (cache_entries >= MAX_CACHE_ENTRIES_HARD) {
+		log_info(_("trustdb transaction too large\n"));
+		return G10ERR_RESOURCE_LIMIT;
 	    }
-	}
-	assert( unused );
-	r = unused;
-	r->flags.used = 1;
-	r->recno = recno;
-	memcpy( r->data, data, TRUST_RECORD_LEN );
-	r->flags.dirty = 1;
-	cache_is_dirty = 1;
-	cache_entries++;
-	return 0;
-    }
-    /* no clean entries: have to flush some dirty entries */
-    if( in_transaction ) {
-	/* but we can't do this while in a transaction
-	 * we increase the cache size instead */
-	if( cache_entries < MAX_CACHE_ENTRIES_HARD ) { /* no */
 	    if( opt.debug && !(cache_entries % 100) )
 		log_debug("increasing tdbio cache size\n");
-	    r = xmalloc( sizeof *r );
-	    r->flags.used = 1;
-	    r->recno = recno;
-	    memcpy( r->data, data, TRUST_RECORD_LEN );
-	    r->flags.dirty = 1;
-	    r->next = cache_list;
-	    cache_list = r;
-	    cache_is_dirty = 1;
-	    cache_entries++;
-	    return 0;
 	}
-	log_info(_("trustdb transaction too large\n"));
-	return G10ERR_RESOURCE_LIMIT;
-    }
-    if( dirty_count ) {
-	int n = dirty_count / 5; /* discard some dirty entries */
-	if( !n )
-	    n = 1;
-	if( !is_locked ) {
-	    if( dotlock_take( lockhandle, -1 ) )
-		log_fatal("can't acquire lock - giving up\n");
-	    else
-		is_locked = 1;
-	}
-	for( unused = NULL, r = cache_list; r; r = r->next ) {
-	    if( r->flags.used && r->flags.dirty ) {
-		int rc = write_cache_item( r );
-		if( rc )
-		    return rc;
-		if( !unused )
-		    unused = r;
-		r->flags.used = 0;
-		cache_entries--;
-		if( !--n )
-		    break;
-	    }
-	}
-	if( !opt.lock_once ) {
-	    if( !dotlock_release( lockhandle ) )
-		is_locked = 0;
+	else {
+	    rc = tdbio_sync ();
+	    if (rc)
+		return rc;
+	    r = cache_lru_tail;
 	}
-	assert( unused );
-	r = unused;
-	r->flags.used = 1;
-	r->recno = recno;
-	memcpy( r->data, data, TRUST_RECORD_LEN );
-	r->flags.dirty = 1;
-	cache_is_dirty = 1;
-	cache_entries++;
+	if (r)
+	    drop_cache_item (r);
+    }
+
+    r = xmalloc (sizeof *r);
+    r->recno = recno;
+    r->flags.dirty = 0;
+    bucket = &cache_tbl[recno & (cache_tbl_size - 1)];
+    r->next = *bucket;
+    *bucket = r;
+    lru_push (r);
+    cache_entries++;
+    *r_item = r;
+    return 0;
+}
+
+
+/****************
+ * Put data into the cache.  This function may flush the
+ * some cache entries if there is not enough space available.
+ */
+int
+put_record_into_cache( ulong recno, const char *data )
+{
+    CACHE_CTRL r;
+    int rc;
+
+    /* see whether we already cached this one */
+    r = lookup_cache (recno);
+    if (r) {
+	if (!r->flags.dirty && memcmp (r->data, data, TRUST_RECORD_LEN))
+	    mark_cache_item_dirty (r);
+	memcpy (r->data, data, TRUST_RECORD_LEN);
 	return 0;
     }
-    BUG();
+
+    /* not in the cache: add a new entry */
+    rc = new_cache_item (recno, 1, &r);
+    if (rc)
+	return rc;
+    memcpy (r->data, data, TRUST_RECORD_LEN);
+    mark_cache_item_dirty (r);
+    return 0;
+}
+
+
+/****************
+ * Remember the record just read from the file, if there is room.
+ */
+static void
+put_read_record_into_cache (ulong recno, const char *data)
+{
+    CACHE_CTRL r;
+
+    if (!new_cache_item (recno, 0, &r) && r)
+	memcpy (r->data, data, TRUST_RECORD_LEN);
+}
+
+
+/****************
+ * Print statistics about the record cache.
+ */
+void
+tdbio_dump_cache_stats (void)
+{
+    log_info ("trustdb cache: %d of %d records used, %lu hits, %lu misses,"
+	      " %lu dropped\n", cache_entries, cache_max_entries,
+	      cache_stats.hits, cache_stats.misses, cache_stats.dropped);
+    log_info ("trustdb cache: %lu records written in %lu writes\n",
+	      cache_stats.records_written, cache_stats.writes);
 }
 
 
@@ -300,14 +502,65 @@ tdbio_is_dirty()
 }
 
 
+/****************
+ * Check whether the trustdb has been changed, e.g. by another
+ * process, since the last call and drop the clean records from the
+ * cache in that case.  If the file has been replaced it is opened
+ * again on the next access.  Returns true if the cache has been
+ * dropped.
+ */
+int
+tdbio_check_changes (void)
+{
+    static struct {
+	off_t size;
+	time_t mtime;
+	u32 ino;
+    } stamp;
+    struct stat st;
+    CACHE_CTRL r, r2;
+
+    if( !db_name || stat (db_name, &st) )
+	return 0;
+    if( stamp.size == st.st_size && stamp.mtime == st.st_mtime
+	&& stamp.ino == (u32)st.st_ino )
+	return 0;
+
+    for (r = cache_lru_head; r; r = r2) {
+	r2 = r->lru_next;
+	if (!r->flags.dirty)
+	    drop_cache_item (r);
+    }
+
+    if( stamp.ino && stamp.ino != (u32)st.st_ino
+	&& db_fd != -1 && !cache_is_dirty ) {
+#ifdef HAVE_MMAP
+	if (db_map.image)
+	    munmap (db_map.image, db_map.size);
+	db_map.image = NULL;
+	db_map.size = 0;
+#endif
+#ifndef HAVE_W32CE_SYSTEM
+	close (db_fd);
+	db_fd = -1;
+#endif
+    }
+
+    stamp.size = st.st_size;
+    stamp.mtime = st.st_mtime;
+    stamp.ino = (u32)st.st_ino;
+    return 1;
+}
+
+
 /****************
  * Flush the cache.  This cannot be used while in a transaction.
  */
 int
 tdbio_sync()
 {
-    CACHE_CTRL r;
     int did_lock = 0;
+    int rc;
 
     if( db_fd == -1 )
 	open_db();
@@ -324,13 +577,13 @@ tdbio_sync()
 	    is_locked = 1;
 	did_lock = 1;
     }
-    for( r = cache_list; r; r = r->next ) {
-	if( r->flags.used && r->flags.dirty ) {
-	    int rc = write_cache_item( r );
-	    if( rc )
-		return rc;
-	}
-    }
+    rc = write_dirty_records ();
+    if( rc )
+	return rc;
+#ifdef HAVE_MMAP
+    if( db_map.image && db_map.writable )
+	msync( db_map.image, db_map.size, MS_ASYNC );
+#endif
     cache_is_dirty = 0;
     if( did_lock && !opt.lock_once ) {
 	if( !dotlock_release (lockhandle) )
@@ -400,11 +653,12 @@ tdbio_cancel_transaction()
     /* remove all dirty marked entries, so that the original ones
      * are read back the next time */
     if( cache_is_dirty ) {
-	for( r = cache_list; r; r = r->next ) {
-	    if( r->flags.used && r->flags.dirty ) {
-		r->flags.used = 0;
-		cache_entries--;
-	    }
+	CACHE_CTRL rnext;
+
+	for( r = cache_lru_head; r; r = rnext ) {
+	    rnext = r->lru_next;
+	    if( r->flags.dirty )
+		drop_cache_item( r );
 	}
 	cache_is_dirty = 0;
     }
@@ -1207,6 +1461,8 @@ tdbio_read_record( ulong recnum, TRUSTREC *rec, int expected )
     if( db_fd == -1 )
 	open_db();
     buf = get_record_from_cache( recnum );
+    if( !buf && map_db( recnum ) )
+	buf = db_map.image + recnum * TRUST_RECORD_LEN;
     if( !buf ) {
 	if( lseek( db_fd, recnum * TRUST_RECORD_LEN, SEEK_SET ) == -1 ) {
             err = gpg_error_from_syserror ();
@@ -1224,6 +1480,7 @@ tdbio_read_record( ulong recnum, TRUSTREC *rec, int expected )
 	    return err;
 	}
 	buf = readbuf;
+	put_read_record_into_cache (recnum, buf);
     }
     rec->recnum = recnum;
     rec->dirty = 0;
@@ -1478,7 +1735,8 @@ tdbio_new_recnum()
 	recnum = offset / TRUST_RECORD_LEN;
 	assert(recnum); /* this is will never be the first record */
 	/* we must write a record, so that the next call to this function
-	 * returns another recnum */
+	 * returns another recnum.  If the trustdb is mapped, map_db
+	 * extends the mapping when the record is accessed. */
 	memset( &rec, 0, sizeof rec );
 	rec.rectype = 0; /* unused record */
 	rec.recnum = recnum;
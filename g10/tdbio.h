@@ -103,7 +103,9 @@ byte tdbio_read_model(void);
 ulong tdbio_read_nextcheck (void);
 int tdbio_write_nextcheck (ulong stamp);
 int tdbio_is_dirty(void);
+int tdbio_check_changes (void);
 int tdbio_sync(void);
+void tdbio_dump_cache_stats (void);
 int tdbio_begin_transaction(void);
 int tdbio_end_transaction(void);
 int tdbio_cancel_transaction(void);
@@ -53,10 +53,13 @@ struct key_item {
   byte trust_value;
   char *trust_regexp;
   u32 kid[2];
+  PKT_public_key *pk;            /* The key itself or NULL.  */
+  struct key_item *hash_next;    /* Used by new_key_item_index().  */
 };
 
 
 typedef struct key_item **KeyHashTable; /* see new_key_hash_table() */
+typedef struct key_item **KeyItemIndex; /* see new_key_item_index() */
 
 /*
  * Structure to keep track of keys, this is used as an array wherre
@@ -106,6 +109,8 @@ release_key_items (struct key_item *k)
     {
       k2 = k->next;
       xfree (k->trust_regexp);
+      if (k->pk)
+        free_public_key (k->pk);
       xfree (k);
     }
 }
@@ -172,6 +177,26 @@ add_key_hash_table (KeyHashTable tbl, u32 *kid)
   tbl[(kid[1] & 0x03ff)] = kk;
 }
 
+/*
+ * Create a lookup table for the key items in KLIST.  This uses the
+ * same hashing as the KeyHashTable but links the items of KLIST
+ * itself so that they don't need to be copied.  The table is only
+ * valid as long as KLIST is not changed; release it with xfree.
+ */
+static KeyItemIndex
+new_key_item_index (struct key_item *klist)
+{
+  struct key_item **tbl, *k;
+
+  tbl = xmalloc_clear (1024 * sizeof *tbl);
+  for (k = klist; k; k = k->next)
+    {
+      k->hash_next = tbl[(k->kid[1] & 0x03ff)];
+      tbl[(k->kid[1] & 0x03ff)] = k;
+    }
+  return tbl;
+}
+
 /*
  * Release a key_array
  */
@@ -1062,6 +1087,17 @@ check_trustdb_stale(void)
     }
 }
 
+
+/* Drop the cached trustdb records if the trustdb has been changed by
+   another process.  Returns true if that was done.  */
+int
+check_trustdb_changes (void)
+{
+  if (trustdb_args.init)
+    return tdbio_check_changes ();
+  return 0;
+}
+
 /*
  * Return the validity information for PK.  If the namehash is not
  * NULL, the validity of the corresponsing user ID is returned,
@@ -1428,12 +1464,14 @@ store_validation_status (int depth, KBNODE keyblock, KeyHashTable stored)
 }
 
 /*
- * check whether the signature sig is in the klist k
+ * check whether the signature sig is in the klist indexed by KINDEX
  */
 static struct key_item *
-is_in_klist (struct key_item *k, PKT_signature *sig)
+is_in_klist (KeyItemIndex kindex, PKT_signature *sig)
 {
-  for (; k; k = k->next)
+  struct key_item *k;
+
+  for (k = kindex[(sig->keyid[1] & 0x03ff)]; k; k = k->hash_next)
     {
       if (k->kid[0] == sig->keyid[0] && k->kid[1] == sig->keyid[1])
         return k;
@@ -1448,15 +1486,17 @@ is_in_klist (struct key_item *k, PKT_signature *sig)
  * certification revocation signature we mark the signature by setting
  * node flag bit 8.  Revocations are marked with flag 11, and sigs
  * from unavailable keys are marked with flag 12.  Note that flag bits
- * 9 and 10 are used for internal purposes.
+ * 9 and 10 are used for internal purposes.  If KINDEX is given only
+ * signatures issued by a key in it are considered.
  */
 static void
 mark_usable_uid_certs (KBNODE keyblock, KBNODE uidnode,
-                       u32 *main_kid, struct key_item *klist,
+                       u32 *main_kid, KeyItemIndex kindex,
                        u32 curtime, u32 *next_expire)
 {
   KBNODE node;
   PKT_signature *sig;
+  struct key_item *kr;
 
   /* first check all signatures */
   for (node=uidnode->next; node; node = node->next)
@@ -1479,9 +1519,13 @@ mark_usable_uid_certs (KBNODE keyblock, KBNODE uidnode,
 	 sig->sig_class-0x10<opt.min_cert_level)
 	continue; /* treat anything under our min_cert_level as an
 		     invalid signature */
-      if (klist && !is_in_klist (klist, sig))
+      kr = NULL;
+      if (kindex && !(kr = is_in_klist (kindex, sig)))
         continue;  /* no need to check it then */
-      if ((rc=check_key_signature (keyblock, node, NULL)))
+      /* If we already have the issuer's key there is no need to look
+         it up again for each certification.  */
+      if ((rc=check_key_signature2 (keyblock, node, kr? kr->pk : NULL,
+                                    NULL, NULL, NULL, NULL)))
 	{
 	  /* we ignore anything that won't verify, but tag the
 	     no_pubkey case */
@@ -1907,7 +1951,7 @@ check_regexp(const char *expr,const char *string)
  * This function assumes that all kbnode flags are cleared on entry.
  */
 static int
-validate_one_keyblock (KBNODE kb, struct key_item *klist,
+validate_one_keyblock (KBNODE kb, KeyItemIndex kindex,
                        u32 curtime, u32 *next_expire)
 {
   struct key_item *kr;
@@ -1955,7 +1999,7 @@ validate_one_keyblock (KBNODE kb, struct key_item *klist,
 
           issigned = 0;
 	  get_validity_counts(pk,uid);
-          mark_usable_uid_certs (kb, uidnode, main_kid, klist,
+          mark_usable_uid_certs (kb, uidnode, main_kid, kindex,
                                  curtime, next_expire);
         }
       else if (node->pkt->pkttype == PKT_SIGNATURE
@@ -1964,7 +2008,7 @@ validate_one_keyblock (KBNODE kb, struct key_item *klist,
 	  /* Note that we are only seeing unrevoked sigs here */
           PKT_signature *sig = node->pkt->pkt.signature;
 
-          kr = is_in_klist (klist, sig);
+          kr = is_in_klist (kindex, sig);
 	  /* If the trust_regexp does not match, it's as if the sig
              did not exist.  This is safe for non-trust sigs as well
              since we don't accept a regexp on the sig unless it's a
@@ -2069,80 +2113,261 @@ validate_one_keyblock (KBNODE kb, struct key_item *klist,
 }
 
 
+/* A node of the certification graph: a key of the keyring.  */
+struct sig_graph_key
+{
+  u32 kid[2];
+  byte fpr[MAX_FINGERPRINT_LEN];
+};
+
+/* An edge of the certification graph: key IDX has a user ID
+   certified by the key ISSUER.  */
+struct sig_graph_edge
+{
+  u32 issuer[2];
+  unsigned int idx;
+};
+
+/* The certification graph.  It tells which keys need to be looked at
+   for a given list of trusted keys.  */
+struct sig_graph
+{
+  struct sig_graph_key *keys;   /* In keyring order.  */
+  unsigned int nkeys;
+  struct sig_graph_edge *edges; /* Sorted by issuer.  */
+  size_t nedges;
+};
+
+
 static int
-search_skipfnc (void *opaque, u32 *kid, PKT_user_id *dummy)
+cmp_sig_graph_edge (const void *a_arg, const void *b_arg)
+{
+  const struct sig_graph_edge *a = a_arg;
+  const struct sig_graph_edge *b = b_arg;
+
+  if (a->issuer[0] != b->issuer[0])
+    return a->issuer[0] < b->issuer[0]? -1 : 1;
+  if (a->issuer[1] != b->issuer[1])
+    return a->issuer[1] < b->issuer[1]? -1 : 1;
+  return a->idx < b->idx? -1 : a->idx > b->idx;
+}
+
+
+static void
+release_sig_graph (struct sig_graph *graph)
 {
-  (void)dummy;
-  return test_key_hash_table ((KeyHashTable)opaque, kid);
+  xfree (graph->keys);
+  xfree (graph->edges);
+  memset (graph, 0, sizeof *graph);
 }
 
 
 /*
- * Scan all keys and return a key_array of all suitable keys from
- * kllist.  The caller has to pass keydb handle so that we don't use
- * to create our own.  Returns either a key_array or NULL in case of
- * an error.  No results found are indicated by an empty array.
- * Caller hast to release the returned array.
+ * Scan all keys once and build the certification graph.  Returns 0
+ * on success.
  */
-static struct key_array *
-validate_key_list (KEYDB_HANDLE hd, KeyHashTable full_trust,
-                   struct key_item *klist, u32 curtime, u32 *next_expire)
+static int
+build_sig_graph (KEYDB_HANDLE hd, struct sig_graph *graph)
 {
-  KBNODE keyblock = NULL;
-  struct key_array *keys = NULL;
-  size_t nkeys, maxkeys;
-  int rc;
+  KBNODE keyblock, node;
   KEYDB_SEARCH_DESC desc;
+  struct sig_graph_key *gk;
+  size_t maxkeys = 1000, maxedges = 1000;
+  size_t n, m, an;
+  int rc;
 
-  maxkeys = 1000;
-  keys = xmalloc ((maxkeys+1) * sizeof *keys);
-  nkeys = 0;
+  memset (graph, 0, sizeof *graph);
+  graph->keys = xmalloc (maxkeys * sizeof *graph->keys);
+  graph->edges = xmalloc (maxedges * sizeof *graph->edges);
 
   rc = keydb_search_reset (hd);
   if (rc)
     {
       log_error ("keydb_search_reset failed: %s\n", g10_errstr(rc));
-      xfree (keys);
-      return NULL;
+      release_sig_graph (graph);
+      return rc;
     }
 
   memset (&desc, 0, sizeof desc);
   desc.mode = KEYDB_SEARCH_MODE_FIRST;
-  desc.skipfnc = search_skipfnc;
-  desc.skipfncvalue = full_trust;
-  rc = keydb_search (hd, &desc, 1);
-  if (gpg_err_code (rc) == GPG_ERR_NOT_FOUND)
+  while (!(rc = keydb_search (hd, &desc, 1)))
     {
-      keys[nkeys].keyblock = NULL;
-      return keys;
+      desc.mode = KEYDB_SEARCH_MODE_NEXT;
+      rc = keydb_get_keyblock (hd, &keyblock);
+      if (rc)
+        {
+          log_error ("keydb_get_keyblock failed: %s\n", g10_errstr(rc));
+          release_sig_graph (graph);
+          return rc;
+        }
+      if (keyblock->pkt->pkttype != PKT_PUBLIC_KEY)
+        {
+          release_kbnode (keyblock);
+          continue;
+        }
+
+      if (graph->nkeys == maxkeys)
+        {
+          maxkeys *= 2;
+          graph->keys = xrealloc (graph->keys, maxkeys * sizeof *graph->keys);
+        }
+      gk = graph->keys + graph->nkeys;
+      keyid_from_pk (keyblock->pkt->pkt.public_key, gk->kid);
+      fingerprint_from_pk (keyblock->pkt->pkt.public_key, gk->fpr, &an);
+      while (an < MAX_FINGERPRINT_LEN)
+        gk->fpr[an++] = 0;
+
+      for (node = keyblock; node; node = node->next)
+        {
+          PKT_signature *sig;
+
+          if (node->pkt->pkttype != PKT_SIGNATURE)
+            continue;
+          sig = node->pkt->pkt.signature;
+          if (!IS_UID_SIG (sig)
+              || (sig->keyid[0] == gk->kid[0] && sig->keyid[1] == gk->kid[1]))
+            continue;
+          if (graph->nedges == maxedges)
+            {
+              maxedges *= 2;
+              graph->edges = xrealloc (graph->edges,
+                                       maxedges * sizeof *graph->edges);
+            }
+          graph->edges[graph->nedges].issuer[0] = sig->keyid[0];
+          graph->edges[graph->nedges].issuer[1] = sig->keyid[1];
+          graph->edges[graph->nedges].idx = graph->nkeys;
+          graph->nedges++;
+        }
+      graph->nkeys++;
+      release_kbnode (keyblock);
+    }
+  if (gpg_err_code (rc) != GPG_ERR_NOT_FOUND)
+    {
+      log_error ("keydb_search failed: %s\n", g10_errstr(rc));
+      release_sig_graph (graph);
+      return rc;
+    }
+
+  /* Sort the edges and remove duplicates.  */
+  qsort (graph->edges, graph->nedges, sizeof *graph->edges,
+         cmp_sig_graph_edge);
+  for (n=m=0; n < graph->nedges; n++)
+    if (!m || cmp_sig_graph_edge (graph->edges + m - 1, graph->edges + n))
+      graph->edges[m++] = graph->edges[n];
+  graph->nedges = m;
+
+  if (opt.verbose)
+    log_info ("%u keys with %lu certifications\n",
+              graph->nkeys, (unsigned long)graph->nedges);
+  return 0;
+}
+
+
+/*
+ * Return an array with one flag for each key in GRAPH which tells
+ * whether the key has a user ID certified by a key in KLIST.
+ */
+static byte *
+find_certified_keys (struct sig_graph *graph, struct key_item *klist)
+{
+  struct key_item *k;
+  struct sig_graph_edge key;
+  byte *flags;
+  size_t lo, hi, mid;
+
+  flags = xcalloc (graph->nkeys? graph->nkeys : 1, 1);
+  memset (&key, 0, sizeof key);
+  for (k = klist; k; k = k->next)
+    {
+      /* Find the first edge of this issuer.  */
+      key.issuer[0] = k->kid[0];
+      key.issuer[1] = k->kid[1];
+      for (lo = 0, hi = graph->nedges; lo < hi; )
+        {
+          mid = lo + (hi - lo) / 2;
+          if (cmp_sig_graph_edge (graph->edges + mid, &key) < 0)
+            lo = mid + 1;
+          else
+            hi = mid;
+        }
+      for (; lo < graph->nedges
+             && graph->edges[lo].issuer[0] == k->kid[0]
+             && graph->edges[lo].issuer[1] == k->kid[1]; lo++)
+        flags[graph->edges[lo].idx] = 1;
     }
+  return flags;
+}
+
+
+/*
+ * Return a key_array of all keys which are certified by a key in
+ * klist.  Only the keys found in the certification graph GRAPH are
+ * read from the keyring.  The caller has to pass keydb handle so that
+ * we don't use to create our own.  Returns either a key_array or NULL
+ * in case of an error.  No results found are indicated by an empty
+ * array.  Caller hast to release the returned array.
+ */
+static struct key_array *
+validate_key_list (KEYDB_HANDLE hd, struct sig_graph *graph,
+                   KeyHashTable full_trust, struct key_item *klist,
+                   u32 curtime, u32 *next_expire)
+{
+  KBNODE keyblock = NULL;
+  struct key_array *keys = NULL;
+  size_t nkeys, maxkeys;
+  unsigned int idx;
+  byte *certified;
+  KeyItemIndex kindex;
+  int rc;
+
+  maxkeys = 1000;
+  keys = xmalloc ((maxkeys+1) * sizeof *keys);
+  nkeys = 0;
+
+  certified = find_certified_keys (graph, klist);
+  kindex = new_key_item_index (klist);
+
+  /* The keys of GRAPH are in keyring order; thus after a reset each
+     key is found by searching forward from the previous one and the
+     keyrings are read at most once.  */
+  rc = keydb_search_reset (hd);
   if (rc)
     {
-      log_error ("keydb_search_first failed: %s\n", g10_errstr(rc));
-      xfree (keys);
+      log_error ("keydb_search_reset failed: %s\n", g10_errstr(rc));
+      xfree (certified);
+      xfree (kindex);
+      keys[nkeys].keyblock = NULL;
+      release_key_array (keys);
       return NULL;
     }
-
-  desc.mode = KEYDB_SEARCH_MODE_NEXT; /* change mode */
-  do
+  for (idx=0; idx < graph->nkeys; idx++)
     {
       PKT_public_key *pk;
 
-      rc = keydb_get_keyblock (hd, &keyblock);
-      if (rc)
+      if (!certified[idx]
+          || test_key_hash_table (full_trust, graph->keys[idx].kid))
+        continue;
+
+      rc = keydb_search_fpr (hd, graph->keys[idx].fpr);
+      if (gpg_err_code (rc) == GPG_ERR_NOT_FOUND)
         {
-          log_error ("keydb_get_keyblock failed: %s\n", g10_errstr(rc));
-          xfree (keys);
-          return NULL;
+          /* Should not happen unless the keyring has been changed
+             meanwhile; try again from the start.  */
+          rc = keydb_search_reset (hd);
+          if (!rc)
+            rc = keydb_search_fpr (hd, graph->keys[idx].fpr);
         }
-
-      if ( keyblock->pkt->pkttype != PKT_PUBLIC_KEY)
+      if (!rc)
+        rc = keydb_get_keyblock (hd, &keyblock);
+      if (rc)
         {
-          log_debug ("ooops: invalid pkttype %d encountered\n",
-                     keyblock->pkt->pkttype);
-          dump_kbnode (keyblock);
-          release_kbnode(keyblock);
-          continue;
+          log_error ("reading key %s failed: %s\n",
+                     keystr (graph->keys[idx].kid), g10_errstr(rc));
+          xfree (certified);
+          xfree (kindex);
+          keys[nkeys].keyblock = NULL;
+          release_key_array (keys);
+          return NULL;
         }
 
       /* prepare the keyblock for further processing */
@@ -2154,7 +2379,8 @@ validate_key_list (KEYDB_HANDLE hd, KeyHashTable full_trust,
           /* it does not make sense to look further at those keys */
           mark_keyblock_seen (full_trust, keyblock);
         }
-      else if (validate_one_keyblock (keyblock, klist, curtime, next_expire))
+      else if (validate_one_keyblock (keyblock, kindex,
+                                      curtime, next_expire))
         {
 	  KBNODE node;
 
@@ -2184,13 +2410,8 @@ validate_key_list (KEYDB_HANDLE hd, KeyHashTable full_trust,
       release_kbnode (keyblock);
       keyblock = NULL;
     }
-  while ( !(rc = keydb_search (hd, &desc, 1)) );
-  if (rc && gpg_err_code (rc) != GPG_ERR_NOT_FOUND)
-    {
-      log_error ("keydb_search_next failed: %s\n", g10_errstr(rc));
-      xfree (keys);
-      return NULL;
-    }
+  xfree (certified);
+  xfree (kindex);
 
   keys[nkeys].keyblock = NULL;
   return keys;
@@ -2272,6 +2493,7 @@ validate_keys (int interactive)
   int depth;
   int ot_unknown, ot_undefined, ot_never, ot_marginal, ot_full, ot_ultimate;
   KeyHashTable stored,used,full_trust;
+  struct sig_graph graph;
   u32 start_time, next_expire;
 
   /* Make sure we have all sigs cached.  TODO: This is going to
@@ -2289,6 +2511,7 @@ validate_keys (int interactive)
 
   kdb = keydb_new ();
   reset_trust_records();
+  memset (&graph, 0, sizeof graph);
 
   /* Fixme: Instead of always building a UTK list, we could just build it
    * here when needed */
@@ -2332,6 +2555,14 @@ validate_keys (int interactive)
 
   klist = utk_list;
 
+  /* Instead of scanning all keys at each depth, we scan them once to
+     find out which keys are certified by which other keys.  Only
+     the keys certified by a key of the current depth are then read
+     again.  */
+  rc = build_sig_graph (kdb, &graph);
+  if (rc)
+    goto leave;
+
   log_info(_("%d marginal(s) needed, %d complete(s) needed, %s trust model\n"),
 	   opt.marginals_needed,opt.completes_needed,trust_model_string());
 
@@ -2399,7 +2630,7 @@ validate_keys (int interactive)
         }
 
       /* Find all keys which are signed by a key in kdlist */
-      keys = validate_key_list (kdb, full_trust, klist,
+      keys = validate_key_list (kdb, &graph, full_trust, klist,
 				start_time, &next_expire);
       if (!keys)
         {
@@ -2460,6 +2691,8 @@ validate_keys (int interactive)
 			k->trust_regexp=
 			  xstrdup(kar->keyblock->pkt->
 				   pkt.public_key->trust_regexp);
+		      k->pk = copy_public_key
+			(NULL, kar->keyblock->pkt->pkt.public_key);
 		      k->next = klist;
 		      klist = k;
 		      break;
@@ -2475,6 +2708,7 @@ validate_keys (int interactive)
 
  leave:
   keydb_release (kdb);
+  release_sig_graph (&graph);
   release_key_array (keys);
   release_key_items (klist);
   release_key_hash_table (full_trust);
@@ -2502,5 +2736,8 @@ validate_keys (int interactive)
       pending_check_trustdb = 0;
     }
 
+  if (opt.verbose)
+    tdbio_dump_cache_stats ();
+
   return rc;
 }
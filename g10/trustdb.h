@@ -47,6 +47,7 @@ int setup_trustdb( int level, const char *dbname );
 void how_to_fix_the_trustdb (void);
 void init_trustdb( void );
 void check_trustdb_stale(void);
+int check_trustdb_changes (void);
 void sync_trustdb( void );
 
 const char *uid_trust_string_fixed(PKT_public_key *key,PKT_user_id *uid);
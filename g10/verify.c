@@ -220,6 +220,86 @@ verify_files (ctrl_t ctrl, int nfiles, char **files )
 }
 
 
+/* Verify all signatures listed in the file FNAME or on stdin if FNAME
+   is NULL or "-".  Each line gives the name of a signature file,
+   optionally followed by a TAB and the name of the signed data.
+   Without a data file the signature is handled as by --verify with
+   one argument.  Empty lines and lines starting with a '#' are
+   ignored.  The status output of each item is framed by FILE_START
+   and FILE_DONE (or FILE_ERROR).  Verifying many files this way is
+   much faster than running a process for each file because the
+   keyrings are opened and the key caches are filled only once.  */
+int
+verify_manifest (ctrl_t ctrl, const char *fname)
+{
+  estream_t fp;
+  char line[2048];
+  char *files[2], *p;
+  unsigned int lno = 0;
+  size_t n;
+  int rc;
+
+  if (!fname || !strcmp (fname, "-"))
+    {
+      fp = es_stdin;
+      fname = "[stdin]";
+    }
+  else
+    {
+      fp = es_fopen (fname, "r");
+      if (!fp)
+        {
+          rc = gpg_error_from_syserror ();
+          log_error (_("can't open '%s': %s\n"), fname, gpg_strerror (rc));
+          return rc;
+        }
+    }
+
+  rc = 0;
+  while (es_fgets (line, DIM(line), fp))
+    {
+      lno++;
+      n = strlen (line);
+      if (!n || line[n-1] != '\n')
+        {
+          log_error (_("input line %u too long or missing LF\n"), lno);
+          rc = G10ERR_GENERAL;
+          break;
+        }
+      line[--n] = 0;
+      if (n && line[n-1] == '\r')
+        line[--n] = 0;
+      if (!n || *line == '#')
+        continue;
+
+      files[0] = line;
+      files[1] = NULL;
+      p = strchr (line, '\t');
+      if (p)
+        {
+          *p++ = 0;
+          files[1] = p;
+        }
+
+      print_file_status (STATUS_FILE_START, files[0], 1);
+      if (verify_signatures (ctrl, files[1]? 2 : 1, files))
+        print_file_status (STATUS_FILE_ERROR, files[0], 1);
+      else
+        write_status (STATUS_FILE_DONE);
+      reset_literals_seen ();
+    }
+  if (!rc && es_ferror (fp))
+    {
+      rc = gpg_error_from_syserror ();
+      log_error (_("error reading '%s': %s\n"), fname, gpg_strerror (rc));
+    }
+
+  if (fp != es_stdin)
+    es_fclose (fp);
+  return rc;
+}
+
+
 
 
 /* Perform a verify operation.  To verify detached signatures, DATA_FD
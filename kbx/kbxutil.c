@@ -55,6 +55,7 @@ enum cmd_and_opt_values {
   aImportOpenPGP,
   aFindDups,
   aCut,
+  aBuildNameIndex,
 
   oDebug,
   oDebugAll,
@@ -77,6 +78,7 @@ static ARGPARSE_OPTS opts[] = {
   { aImportOpenPGP, "import-openpgp", 0, "import OpenPGP keyblocks"},
   { aFindDups,    "find-dups",   0, "find duplicates" },
   { aCut,         "cut",         0, "export records" },
+  { aBuildNameIndex, "build-name-index", 0, "create the name index" },
 
   { 301, NULL, 0, N_("@\nOptions:\n ") },
 
@@ -473,6 +475,7 @@ main( int argc, char **argv )
         case aImportOpenPGP:
         case aFindDups:
         case aCut:
+        case aBuildNameIndex:
           cmd = pargs.r_opt;
           break;
 
@@ -532,6 +535,20 @@ main( int argc, char **argv )
             _keybox_dump_cut_records (*argv, from, to, stdout);
         }
     }
+  else if (cmd == aBuildNameIndex)
+    {
+      gpg_error_t err;
+
+      if (!argc)
+        log_error ("usage: kbxutil --build-name-index KEYBOXFILE\n");
+      for (; argc; argc--, argv++)
+        {
+          err = _keybox_build_name_index (*argv);
+          if (err)
+            log_error ("error building the name index for '%s': %s\n",
+                       *argv, gpg_strerror (err));
+        }
+    }
   else if (cmd == aImportOpenPGP)
     {
       if (!argc)
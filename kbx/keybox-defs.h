@@ -93,6 +93,25 @@ struct keybox_handle {
   int eof;
   int error;
   int ephemeral;
+  int for_openpgp;        /* Only return OpenPGP blobs.  */
+  struct {
+    unsigned char *image;  /* The mapped keybox file or NULL.  */
+    size_t size;           /* Length of IMAGE.  */
+    size_t pos;            /* Offset of the next blob in IMAGE.  */
+  } map;
+  struct {
+    unsigned char *image;  /* The loaded name index or NULL.  */
+    size_t size;           /* Length of IMAGE.  */
+    int mapped;            /* IMAGE is memory mapped.  */
+  } nidx;
+  struct {
+    off_t *offsets;        /* Offsets of the candidate blobs or NULL.  */
+    size_t count;          /* Number of candidates.  */
+    size_t pos;            /* Index of the next candidate.  */
+    off_t size;            /* Size of the keybox the index is for.  */
+    int mode;              /* Search mode and name the candidates  */
+    char *name;            /* have been computed for.  */
+  } cand;
   struct {
     KEYBOXBLOB blob;
     off_t offset;
@@ -155,9 +174,12 @@ void _keybox_close_file (KEYBOX_HANDLE hd);
 
 
 /*-- keybox-blob.c --*/
-#ifdef KEYBOX_WITH_OPENPGP
-  /* fixme */
-#endif /*KEYBOX_WITH_OPENPGP*/
+gpg_error_t _keybox_create_openpgp_blob (KEYBOXBLOB *r_blob,
+                                         keybox_openpgp_info_t info,
+                                         const unsigned char *image,
+                                         size_t imagelen,
+                                         u32 *sigstatus,
+                                         int as_ephemeral);
 #ifdef KEYBOX_WITH_X509
 int _keybox_create_x509_blob (KEYBOXBLOB *r_blob, ksba_cert_t cert,
                               unsigned char *sha1_digest, int as_ephemeral);
@@ -166,6 +188,9 @@ int _keybox_create_x509_blob (KEYBOXBLOB *r_blob, ksba_cert_t cert,
 int  _keybox_new_blob (KEYBOXBLOB *r_blob,
                        unsigned char *image, size_t imagelen,
                        off_t off);
+void _keybox_set_blob_image (KEYBOXBLOB blob,
+                             const unsigned char *image, size_t imagelen,
+                             off_t off);
 void _keybox_release_blob (KEYBOXBLOB blob);
 const unsigned char *_keybox_get_blob_image (KEYBOXBLOB blob, size_t *n);
 off_t _keybox_get_blob_fileoffset (KEYBOXBLOB blob);
@@ -183,6 +208,17 @@ int _keybox_read_blob (KEYBOXBLOB *r_blob, FILE *fp);
 int _keybox_read_blob2 (KEYBOXBLOB *r_blob, FILE *fp, int *skipped_deleted);
 int _keybox_write_blob (KEYBOXBLOB blob, FILE *fp);
 int _keybox_write_header_blob (FILE *fp);
+int _keybox_map_file (KEYBOX_HANDLE hd);
+void _keybox_unmap_file (KEYBOX_HANDLE hd);
+int _keybox_read_mapped_blob (KEYBOX_HANDLE hd, KEYBOXBLOB blob);
+int _keybox_seek_blob (KEYBOX_HANDLE hd, off_t off);
+
+/*-- keybox-index.c --*/
+gpg_error_t _keybox_build_name_index (const char *fname);
+gpg_error_t _keybox_lookup_name_index (KEYBOX_HANDLE hd,
+                                       KEYBOX_SEARCH_DESC *desc);
+void _keybox_release_name_index (KEYBOX_HANDLE hd);
+void _keybox_release_candidates (KEYBOX_HANDLE hd);
 
 /*-- keybox-search.c --*/
 gpg_err_code_t _keybox_get_flag_location (const unsigned char *buffer,
@@ -202,11 +238,13 @@ int _keybox_dump_cut_records (const char *filename, unsigned long from,
 void *_keybox_malloc (size_t n);
 void *_keybox_calloc (size_t n, size_t m);
 void *_keybox_realloc (void *p, size_t n);
+char *_keybox_strdup (const char *string);
 void  _keybox_free (void *p);
 
 #define xtrymalloc(a)    _keybox_malloc ((a))
 #define xtrycalloc(a,b)  _keybox_calloc ((a),(b))
 #define xtryrealloc(a,b) _keybox_realloc((a),(b))
+#define xtrystrdup(a)    _keybox_strdup ((a))
 #define xfree(a)         _keybox_free ((a))
 
 
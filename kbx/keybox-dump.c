@@ -97,6 +97,9 @@ dump_header_blob (const byte *buffer, size_t length, FILE *fp)
   fprintf( fp, "created-at: %lu\n", n );
   n = get32 (buffer+20);
   fprintf( fp, "last-maint: %lu\n", n );
+  n = get32 (buffer+24);
+  if (n)
+    fprintf( fp, "garbage: %lu\n", n );
 
   return 0;
 }
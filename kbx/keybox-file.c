@@ -23,6 +23,13 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
 
 #include "keybox-defs.h"
 
@@ -115,6 +122,130 @@ _keybox_read_blob (KEYBOXBLOB *r_blob, FILE *fp)
 }
 
 
+/* Map the keybox file of HD into memory.  Returns 0 on success; on
+   error the caller should fall back to stdio.  */
+int
+_keybox_map_file (KEYBOX_HANDLE hd)
+{
+#ifdef HAVE_MMAP
+  int fd;
+  struct stat st;
+  void *image;
+
+  if (hd->map.image)
+    return 0;
+
+  fd = open (hd->kb->fname, O_RDONLY);
+  if (fd == -1)
+    return gpg_error_from_syserror ();
+  if (fstat (fd, &st))
+    {
+      gpg_error_t err = gpg_error_from_syserror ();
+      close (fd);
+      return err;
+    }
+  if (!st.st_size || (off_t)(size_t)st.st_size != st.st_size)
+    {
+      /* Empty or too large for our address space.  */
+      close (fd);
+      return gpg_error (GPG_ERR_NOT_SUPPORTED);
+    }
+
+  image = mmap (NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (image == MAP_FAILED)
+    return gpg_error_from_syserror ();
+#ifdef MADV_SEQUENTIAL
+  madvise (image, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+
+  hd->map.image = image;
+  hd->map.size = (size_t)st.st_size;
+  hd->map.pos = 0;
+  return 0;
+#else /*!HAVE_MMAP*/
+  (void)hd;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+#endif /*!HAVE_MMAP*/
+}
+
+
+/* Release the mapping of HD.  */
+void
+_keybox_unmap_file (KEYBOX_HANDLE hd)
+{
+#ifdef HAVE_MMAP
+  if (hd->map.image)
+    munmap (hd->map.image, hd->map.size);
+#endif
+  hd->map.image = NULL;
+  hd->map.size = 0;
+  hd->map.pos = 0;
+}
+
+
+/* Set BLOB to the next blob of the mapped keybox HD.  The blob image
+   is not copied but references the mapping.  Deleted blobs are
+   skipped.  Returns -1 at EOF.  */
+int
+_keybox_read_mapped_blob (KEYBOX_HANDLE hd, KEYBOXBLOB blob)
+{
+  const unsigned char *p;
+  size_t imagelen, pos;
+
+  for (;;)
+    {
+      pos = hd->map.pos;
+      if (pos == hd->map.size)
+        return -1; /* eof */
+      if (hd->map.size - pos < 5)
+        return gpg_error (GPG_ERR_TOO_SHORT);
+      p = hd->map.image + pos;
+      imagelen = ((size_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+      if (imagelen > 500000) /* Sanity check. */
+        return gpg_error (GPG_ERR_TOO_LARGE);
+      if (imagelen < 5)
+        return gpg_error (GPG_ERR_TOO_SHORT);
+      if (imagelen > hd->map.size - pos)
+        return gpg_error (GPG_ERR_TOO_SHORT);
+      hd->map.pos += imagelen;
+      if (p[4])
+        break;
+      /* Skip empty blobs. */
+    }
+
+  _keybox_set_blob_image (blob, p, imagelen, (off_t)pos);
+  return 0;
+}
+
+
+/* Position HD so that the next read returns the blob at file offset
+   OFF.  */
+int
+_keybox_seek_blob (KEYBOX_HANDLE hd, off_t off)
+{
+  if (hd->map.image)
+    {
+      if (off < 0 || (size_t)off >= hd->map.size)
+        return gpg_error (GPG_ERR_INV_VALUE);
+      hd->map.pos = (size_t)off;
+      return 0;
+    }
+  if (!hd->fp)
+    return gpg_error (GPG_ERR_INV_HANDLE);
+#ifdef HAVE_FSEEKO
+  if (fseeko (hd->fp, off, SEEK_SET))
+    return gpg_error_from_syserror ();
+#else
+  if (off != (long)off)
+    return gpg_error (GPG_ERR_TOO_LARGE);
+  if (fseek (hd->fp, (long)off, SEEK_SET))
+    return gpg_error_from_syserror ();
+#endif
+  return 0;
+}
+
+
 /* Write the block to the current file position */
 int
 _keybox_write_blob (KEYBOXBLOB blob, FILE *fp)
@@ -0,0 +1,845 @@
+/* keybox-index.c - Name index for keyboxes
+ * Copyright (C) 2012 Free Software Foundation, Inc.
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The name index is an optional file stored alongside a keybox with
+   the suffix ".nidx".  For every trigram of the lowercased user IDs
+   it lists the blobs having a user ID with that trigram.  A substring,
+   mail or word search then only needs to look at the blobs which have
+   all trigrams of the searched name; those candidates are verified by
+   the usual search code.  The index is never created implicitly (use
+   "kbxutil --build-name-index"), but once it exists it is rebuilt by
+   keybox_update_name_index after the keybox has been changed.  The
+   rebuild reads the entire keybox; callers doing many changes in a
+   row (e.g. gpg's import transaction) should call it only once at
+   the end.  A search never rebuilds the index; if it does not match
+   the keybox the search scans the entire keybox.
+
+   All numbers are stored big endian:
+
+     u32  magic "KBXN"
+     u32  version (1)
+     u32  size of the keybox (high and low part)
+     u32
+     u32  mtime of the keybox
+     u32  inode of the keybox
+     u32  number of blobs
+     u32  number of trigrams
+     u32  length of the postings
+     --   (header is 36 bytes)
+     n*8  offsets of the blobs (high and low part)
+     n*12 trigram table sorted by trigram:
+            u32 trigram, u32 offset into postings, u32 number of blobs
+     ...  postings: for each trigram the ascending blob numbers,
+          delta encoded as 7 bit groups with bit 7 as continuation.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
+
+#include "keybox-defs.h"
+
+#define NIDX_SUFFIX     ".nidx"
+#define NIDX_VERSION    1
+#define NIDX_HEADERLEN  36
+
+
+/* The keyboxes for which writing the name index failed.  We don't
+   try again in this process.  */
+struct nidx_failed_s
+{
+  struct nidx_failed_s *next;
+  char fname[1];
+};
+static struct nidx_failed_s *nidx_failed;
+
+
+/* A (trigram, blob number) pair used while building the index.  */
+struct tripair_s
+{
+  u32 tri;
+  u32 blobno;
+};
+
+
+/* A growing array of trigram pairs.  */
+struct tripairs_s
+{
+  struct tripair_s *items;
+  size_t used;
+  size_t size;
+  int error;
+};
+
+
+static u32
+get32 (const unsigned char *p)
+{
+  return ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | p[3];
+}
+
+static u32
+get16 (const unsigned char *p)
+{
+  return ((u32)p[0] << 8) | p[1];
+}
+
+static void
+put32 (unsigned char *p, u32 a)
+{
+  p[0] = a >> 24;
+  p[1] = a >> 16;
+  p[2] = a >> 8;
+  p[3] = a;
+}
+
+
+/* Return the lowercased byte C.  Only ASCII is folded, which is what
+   ascii_memcasemem does when verifying the candidates.  */
+static int
+fold (int c)
+{
+  return (c >= 'A' && c <= 'Z')? (c + 'a' - 'A') : c;
+}
+
+
+static int
+word_char_p (int c)
+{
+  return ((c & 0x80)
+          || (c >= '0' && c <= '9')
+          || (c >= 'a' && c <= 'z')
+          || (c >= 'A' && c <= 'Z'));
+}
+
+
+static char *
+nidx_fname (const char *fname)
+{
+  char *name;
+
+  name = xtrymalloc (strlen (fname) + strlen (NIDX_SUFFIX) + 1);
+  if (name)
+    strcpy (stpcpy (name, fname), NIDX_SUFFIX);
+  return name;
+}
+
+
+static void
+add_trigrams (struct tripairs_s *pairs, u32 blobno,
+              const unsigned char *s, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i + 2 < len && !pairs->error; i++)
+    {
+      if (pairs->used == pairs->size)
+        {
+          struct tripair_s *tmp;
+          size_t newsize = pairs->size? pairs->size * 2 : 4096;
+
+          tmp = xtryrealloc (pairs->items, newsize * sizeof *tmp);
+          if (!tmp)
+            {
+              pairs->error = gpg_error_from_syserror ();
+              return;
+            }
+          pairs->items = tmp;
+          pairs->size = newsize;
+        }
+      pairs->items[pairs->used].tri = ((fold (s[i]) << 16)
+                                       | (fold (s[i+1]) << 8)
+                                       | fold (s[i+2]));
+      pairs->items[pairs->used].blobno = blobno;
+      pairs->used++;
+    }
+}
+
+
+/* Add the trigrams of all user IDs of BLOB.  The blob layout is
+   checked the same way blob_cmp_name does.  */
+static void
+add_blob_trigrams (struct tripairs_s *pairs, u32 blobno, KEYBOXBLOB blob)
+{
+  const unsigned char *buffer;
+  size_t length, pos, off, len;
+  size_t nkeys, keyinfolen, nserial, nuids, uidinfolen;
+  size_t idx;
+  int x509;
+
+  buffer = _keybox_get_blob_image (blob, &length);
+  if (length < 40)
+    return;
+  if (buffer[4] == BLOBTYPE_PGP)
+    x509 = 0;
+  else if (buffer[4] == BLOBTYPE_X509)
+    x509 = 1;
+  else
+    return;
+
+  nkeys = get16 (buffer + 16);
+  keyinfolen = get16 (buffer + 18);
+  if (keyinfolen < 28)
+    return;
+  pos = 20 + keyinfolen*nkeys;
+  if (pos+2 > length)
+    return;
+  nserial = get16 (buffer + pos);
+  pos += 2 + nserial;
+  if (pos+4 > length)
+    return;
+  nuids = get16 (buffer + pos);
+  pos += 2;
+  uidinfolen = get16 (buffer + pos);
+  pos += 2;
+  if (uidinfolen < 12 || pos + uidinfolen*nuids > length)
+    return;
+
+  for (idx = x509; idx < nuids; idx++)
+    {
+      off = get32 (buffer + pos + idx*uidinfolen);
+      len = get32 (buffer + pos + idx*uidinfolen + 4);
+      if (off+len > length)
+        return;
+      add_trigrams (pairs, blobno, buffer + off, len);
+    }
+}
+
+
+static int
+compare_tripairs (const void *a_arg, const void *b_arg)
+{
+  const struct tripair_s *a = a_arg;
+  const struct tripair_s *b = b_arg;
+
+  if (a->tri != b->tri)
+    return a->tri < b->tri? -1 : 1;
+  if (a->blobno != b->blobno)
+    return a->blobno < b->blobno? -1 : 1;
+  return 0;
+}
+
+
+/* Write the index image for the keybox described by ST to a
+   temporary file and rename it to NAME.  */
+static gpg_error_t
+write_name_index (const char *name, struct stat *st,
+                  off_t *offsets, u32 nblobs,
+                  struct tripair_s *pairs, size_t npairs)
+{
+  gpg_error_t err = 0;
+  unsigned char *tritbl = NULL;
+  unsigned char *postings = NULL;
+  size_t postingslen, ntri, i, j;
+  unsigned char hdr[NIDX_HEADERLEN];
+  unsigned char buf[8];
+  char *tmpname = NULL;
+  FILE *fp = NULL;
+
+  /* Each delta needs at most 5 bytes.  */
+  postings = xtrymalloc (npairs * 5 + 1);
+  tritbl = xtrymalloc (npairs * 12 + 1);
+  tmpname = xtrymalloc (strlen (name) + 30);
+  if (!postings || !tritbl || !tmpname)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+
+  postingslen = ntri = 0;
+  for (i = 0; i < npairs; i = j)
+    {
+      u32 last = 0;
+      u32 count = 0;
+
+      put32 (tritbl + ntri*12, pairs[i].tri);
+      put32 (tritbl + ntri*12 + 4, postingslen);
+      for (j = i; j < npairs && pairs[j].tri == pairs[i].tri; j++)
+        {
+          u32 delta;
+
+          if (j > i && pairs[j].blobno == last)
+            continue; /* Same blob.  */
+          delta = pairs[j].blobno - last;
+          last = pairs[j].blobno;
+          while (delta >= 0x80)
+            {
+              postings[postingslen++] = 0x80 | (delta & 0x7f);
+              delta >>= 7;
+            }
+          postings[postingslen++] = delta;
+          count++;
+        }
+      put32 (tritbl + ntri*12 + 8, count);
+      ntri++;
+    }
+
+  memcpy (hdr, "KBXN", 4);
+  put32 (hdr+4, NIDX_VERSION);
+  put32 (hdr+8, (u32)(((unsigned long long)st->st_size) >> 32));
+  put32 (hdr+12, (u32)st->st_size);
+  put32 (hdr+16, (u32)st->st_mtime);
+  put32 (hdr+20, (u32)st->st_ino);
+  put32 (hdr+24, nblobs);
+  put32 (hdr+28, (u32)ntri);
+  put32 (hdr+32, (u32)postingslen);
+
+  snprintf (tmpname, strlen (name) + 30, "%s.%u.tmp",
+            name, (unsigned int)getpid ());
+  fp = fopen (tmpname, "wb");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  if (fwrite (hdr, NIDX_HEADERLEN, 1, fp) != 1)
+    err = gpg_error_from_syserror ();
+  for (i = 0; !err && i < nblobs; i++)
+    {
+      put32 (buf, (u32)(((unsigned long long)offsets[i]) >> 32));
+      put32 (buf+4, (u32)offsets[i]);
+      if (fwrite (buf, 8, 1, fp) != 1)
+        err = gpg_error_from_syserror ();
+    }
+  if (!err && ntri && fwrite (tritbl, ntri*12, 1, fp) != 1)
+    err = gpg_error_from_syserror ();
+  if (!err && postingslen && fwrite (postings, postingslen, 1, fp) != 1)
+    err = gpg_error_from_syserror ();
+  if (fclose (fp) && !err)
+    err = gpg_error_from_syserror ();
+  fp = NULL;
+  if (!err && rename (tmpname, name))
+    err = gpg_error_from_syserror ();
+  if (err)
+    remove (tmpname);
+
+ leave:
+  xfree (tmpname);
+  xfree (tritbl);
+  xfree (postings);
+  return err;
+}
+
+
+/* Create or replace the name index for the keybox FNAME.  */
+gpg_error_t
+_keybox_build_name_index (const char *fname)
+{
+  gpg_error_t err;
+  FILE *fp;
+  struct stat st;
+  KEYBOXBLOB blob;
+  off_t *offsets = NULL;
+  size_t nblobs = 0;
+  size_t offsetssize = 0;
+  struct tripairs_s pairs;
+  char *name;
+
+  memset (&pairs, 0, sizeof pairs);
+
+  fp = fopen (fname, "rb");
+  if (!fp)
+    return gpg_error_from_syserror ();
+  if (fstat (fileno (fp), &st))
+    {
+      err = gpg_error_from_syserror ();
+      fclose (fp);
+      return err;
+    }
+
+  while (!(err = _keybox_read_blob (&blob, fp)))
+    {
+      if (nblobs == offsetssize)
+        {
+          off_t *tmp;
+
+          offsetssize = offsetssize? offsetssize * 2 : 1024;
+          tmp = xtryrealloc (offsets, offsetssize * sizeof *offsets);
+          if (!tmp)
+            {
+              err = gpg_error_from_syserror ();
+              _keybox_release_blob (blob);
+              break;
+            }
+          offsets = tmp;
+        }
+      offsets[nblobs] = _keybox_get_blob_fileoffset (blob);
+      add_blob_trigrams (&pairs, nblobs, blob);
+      nblobs++;
+      _keybox_release_blob (blob);
+      if (pairs.error)
+        {
+          err = pairs.error;
+          break;
+        }
+    }
+  fclose (fp);
+  if (err == -1)
+    err = 0;
+
+  if (!err)
+    {
+      qsort (pairs.items, pairs.used, sizeof *pairs.items, compare_tripairs);
+      name = nidx_fname (fname);
+      if (!name)
+        err = gpg_error_from_syserror ();
+      else
+        {
+          err = write_name_index (name, &st, offsets, nblobs,
+                                  pairs.items, pairs.used);
+          xfree (name);
+        }
+    }
+
+  xfree (pairs.items);
+  xfree (offsets);
+  return err;
+}
+
+
+/* Release the name index loaded into HD.  */
+void
+_keybox_release_name_index (KEYBOX_HANDLE hd)
+{
+  if (hd->nidx.image)
+    {
+#ifdef HAVE_MMAP
+      if (hd->nidx.mapped)
+        munmap (hd->nidx.image, hd->nidx.size);
+      else
+#endif
+        xfree (hd->nidx.image);
+    }
+  hd->nidx.image = NULL;
+  hd->nidx.size = 0;
+  hd->nidx.mapped = 0;
+  _keybox_release_candidates (hd);
+}
+
+
+/* Release the candidate list of the current search of HD.  */
+void
+_keybox_release_candidates (KEYBOX_HANDLE hd)
+{
+  xfree (hd->cand.offsets);
+  hd->cand.offsets = NULL;
+  hd->cand.count = 0;
+  hd->cand.pos = 0;
+  hd->cand.mode = 0;
+  xfree (hd->cand.name);
+  hd->cand.name = NULL;
+}
+
+
+/* Return true if the index header in IMAGE describes the keybox with
+   the status ST.  */
+static int
+nidx_matches (const unsigned char *image, size_t size, struct stat *st)
+{
+  u32 nblobs, ntri, plen;
+
+  if (size < NIDX_HEADERLEN
+      || memcmp (image, "KBXN", 4)
+      || get32 (image+4) != NIDX_VERSION
+      || get32 (image+8) != (u32)(((unsigned long long)st->st_size) >> 32)
+      || get32 (image+12) != (u32)st->st_size
+      || get32 (image+16) != (u32)st->st_mtime
+      || get32 (image+20) != (u32)st->st_ino)
+    return 0;
+
+  nblobs = get32 (image+24);
+  ntri = get32 (image+28);
+  plen = get32 (image+32);
+  if ((size - NIDX_HEADERLEN) / 8 < nblobs
+      || (size - NIDX_HEADERLEN - nblobs*8) / 12 < ntri
+      || size - NIDX_HEADERLEN - nblobs*8 - ntri*12 != plen)
+    return 0;
+  return 1;
+}
+
+
+/* Load the name index of HD's keybox.  */
+static gpg_error_t
+load_name_index (KEYBOX_HANDLE hd)
+{
+  gpg_error_t err;
+  char *name;
+  int fd;
+  struct stat st;
+  unsigned char *image;
+
+  name = nidx_fname (hd->kb->fname);
+  if (!name)
+    return gpg_error_from_syserror ();
+  fd = open (name, O_RDONLY);
+  xfree (name);
+  if (fd == -1)
+    return gpg_error_from_syserror ();
+  if (fstat (fd, &st))
+    {
+      err = gpg_error_from_syserror ();
+      close (fd);
+      return err;
+    }
+  if (st.st_size < NIDX_HEADERLEN || (off_t)(size_t)st.st_size != st.st_size)
+    {
+      close (fd);
+      return gpg_error (GPG_ERR_INV_OBJ);
+    }
+
+#ifdef HAVE_MMAP
+  image = mmap (NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (image != MAP_FAILED)
+    {
+      close (fd);
+      hd->nidx.image = image;
+      hd->nidx.size = (size_t)st.st_size;
+      hd->nidx.mapped = 1;
+      return 0;
+    }
+#endif /*HAVE_MMAP*/
+
+  image = xtrymalloc ((size_t)st.st_size);
+  if (!image)
+    {
+      err = gpg_error_from_syserror ();
+      close (fd);
+      return err;
+    }
+  if (read (fd, image, (size_t)st.st_size) != st.st_size)
+    {
+      err = gpg_error (GPG_ERR_EIO);
+      xfree (image);
+      close (fd);
+      return err;
+    }
+  close (fd);
+  hd->nidx.image = image;
+  hd->nidx.size = (size_t)st.st_size;
+  hd->nidx.mapped = 0;
+  return 0;
+}
+
+
+/* Make sure that HD has an up-to-date name index loaded.  Returns
+   GPG_ERR_NOT_FOUND if the index does not match the keybox.  */
+static gpg_error_t
+prepare_name_index (KEYBOX_HANDLE hd)
+{
+  gpg_error_t err;
+  struct stat st;
+
+  if (stat (hd->kb->fname, &st))
+    return gpg_error_from_syserror ();
+
+  if (hd->nidx.image && nidx_matches (hd->nidx.image, hd->nidx.size, &st))
+    return 0;
+  _keybox_release_name_index (hd);
+
+  err = load_name_index (hd);
+  if (err)
+    return err;  /* No index - this is the default.  */
+  if (nidx_matches (hd->nidx.image, hd->nidx.size, &st))
+    return 0;
+
+  /* The keybox has been changed since the index was built.  */
+  _keybox_release_name_index (hd);
+  return gpg_error (GPG_ERR_NOT_FOUND);
+}
+
+
+/* Rebuild the name index of HD's keybox if there is one and it does
+   not match the keybox anymore.  This is to be called after the
+   keybox has been changed, while the caller still holds the lock.
+   If writing the index fails, it is not tried again by this
+   process.  */
+gpg_error_t
+keybox_update_name_index (KEYBOX_HANDLE hd)
+{
+  gpg_error_t err;
+  struct nidx_failed_s *fl;
+
+  if (!hd || !hd->kb)
+    return gpg_error (GPG_ERR_INV_HANDLE);
+
+  err = prepare_name_index (hd);
+  if (gpg_err_code (err) != GPG_ERR_NOT_FOUND)
+    return 0;  /* Up to date or no index at all.  */
+
+  for (fl = nidx_failed; fl; fl = fl->next)
+    if (!strcmp (fl->fname, hd->kb->fname))
+      return 0;
+
+  err = _keybox_build_name_index (hd->kb->fname);
+  if (err)
+    {
+      fl = xtrymalloc (sizeof *fl + strlen (hd->kb->fname));
+      if (fl)
+        {
+          strcpy (fl->fname, hd->kb->fname);
+          fl->next = nidx_failed;
+          nidx_failed = fl;
+        }
+    }
+  return err;
+}
+
+
+/* Lookup the trigram TRI in the index of HD and return the decoded
+   list of blob numbers at R_LIST and its length at R_COUNT.  A
+   trigram not in the index yields an empty list.  */
+static gpg_error_t
+get_postings (KEYBOX_HANDLE hd, u32 tri, u32 **r_list, size_t *r_count)
+{
+  const unsigned char *image = hd->nidx.image;
+  u32 nblobs = get32 (image+24);
+  u32 ntri = get32 (image+28);
+  size_t plen = get32 (image+32);
+  const unsigned char *tritbl = image + NIDX_HEADERLEN + nblobs*8;
+  const unsigned char *postings = tritbl + ntri*12;
+  size_t lo, hi, mid, off, count, n;
+  u32 *list, value, delta;
+  int shift;
+
+  *r_list = NULL;
+  *r_count = 0;
+
+  lo = 0;
+  hi = ntri;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (get32 (tritbl + mid*12) < tri)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  if (lo == ntri || get32 (tritbl + lo*12) != tri)
+    return 0;
+
+  off = get32 (tritbl + lo*12 + 4);
+  count = get32 (tritbl + lo*12 + 8);
+  if (!count)
+    return 0;
+  if (count > nblobs)
+    return gpg_error (GPG_ERR_INV_OBJ);
+  list = xtrymalloc (count * sizeof *list);
+  if (!list)
+    return gpg_error_from_syserror ();
+
+  value = 0;
+  for (n = 0; n < count; n++)
+    {
+      delta = 0;
+      shift = 0;
+      do
+        {
+          if (off >= plen || shift > 28)
+            {
+              xfree (list);
+              return gpg_error (GPG_ERR_INV_OBJ);
+            }
+          delta |= (u32)(postings[off] & 0x7f) << shift;
+          shift += 7;
+        }
+      while (postings[off++] & 0x80);
+      value += delta;
+      if (value >= nblobs)
+        {
+          xfree (list);
+          return gpg_error (GPG_ERR_INV_OBJ);
+        }
+      list[n] = value;
+    }
+
+  *r_list = list;
+  *r_count = count;
+  return 0;
+}
+
+
+/* Restrict the candidate list CAND of length *R_NCAND to the blobs
+   having all trigrams of the LEN bytes at S.  If CAND is NULL the
+   list is initialized from the first trigram.  */
+static gpg_error_t
+intersect_trigrams (KEYBOX_HANDLE hd, const unsigned char *s, size_t len,
+                    u32 **cand, size_t *r_ncand)
+{
+  gpg_error_t err;
+  size_t i, a, b, n, count;
+  u32 *list;
+
+  for (i = 0; i + 2 < len; i++)
+    {
+      if (*cand && !*r_ncand)
+        return 0;  /* Nothing left.  */
+
+      err = get_postings (hd, ((fold (s[i]) << 16)
+                               | (fold (s[i+1]) << 8)
+                               | fold (s[i+2])), &list, &count);
+      if (err)
+        return err;
+      if (!*cand)
+        {
+          *cand = list;
+          *r_ncand = count;
+          if (!list)
+            {
+              /* Unknown trigram; use an empty but allocated list.  */
+              *cand = xtrymalloc (sizeof **cand);
+              if (!*cand)
+                return gpg_error_from_syserror ();
+            }
+          continue;
+        }
+
+      for (a = b = n = 0; a < *r_ncand && b < count; )
+        {
+          if ((*cand)[a] < list[b])
+            a++;
+          else if ((*cand)[a] > list[b])
+            b++;
+          else
+            {
+              (*cand)[n++] = (*cand)[a];
+              a++;
+              b++;
+            }
+        }
+      *r_ncand = n;
+      xfree (list);
+    }
+  return 0;
+}
+
+
+/* Try to find the candidate blobs for the search DESC using the name
+   index of HD.  On success the sorted offsets of the candidates are
+   stored in HD->CAND.  An error is returned if the search can't be
+   served from the index, for example because there is no index or
+   because the name is too short.  The caller then has to scan the
+   entire keybox.  */
+gpg_error_t
+_keybox_lookup_name_index (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc)
+{
+  gpg_error_t err;
+  const unsigned char *name, *s, *w;
+  size_t namelen, n;
+  u32 *cand = NULL;
+  size_t ncand = 0;
+  const unsigned char *blobtbl;
+  int any = 0;
+
+  _keybox_release_candidates (hd);
+
+  switch (desc->mode)
+    {
+    case KEYDB_SEARCH_MODE_SUBSTR:
+    case KEYDB_SEARCH_MODE_MAIL:
+    case KEYDB_SEARCH_MODE_MAILSUB:
+    case KEYDB_SEARCH_MODE_WORDS:
+      break;
+    default:
+      return gpg_error (GPG_ERR_NOT_SUPPORTED);
+    }
+  if (!desc->u.name)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+
+  name = (const unsigned char *)desc->u.name;
+  namelen = strlen (desc->u.name);
+  if (desc->mode == KEYDB_SEARCH_MODE_MAIL
+      || desc->mode == KEYDB_SEARCH_MODE_MAILSUB)
+    {
+      /* Same as has_mail.  */
+      if (*name == '<')
+        {
+          name++;
+          namelen--;
+        }
+      if (namelen && name[namelen-1] == '>')
+        namelen--;
+    }
+  if (namelen < 3)
+    return gpg_error (GPG_ERR_NOT_SUPPORTED);
+
+  err = prepare_name_index (hd);
+  if (err)
+    return err;
+
+  if (desc->mode == KEYDB_SEARCH_MODE_WORDS)
+    {
+      for (s = name, n = namelen; n && !err; )
+        {
+          while (n && !word_char_p (*s))
+            s++, n--;
+          for (w = s; n && word_char_p (*s); s++, n--)
+            ;
+          if (s - w >= 3)
+            {
+              any = 1;
+              err = intersect_trigrams (hd, w, s - w, &cand, &ncand);
+            }
+        }
+    }
+  else
+    {
+      any = 1;
+      err = intersect_trigrams (hd, name, namelen, &cand, &ncand);
+    }
+  if (!err && !any)
+    err = gpg_error (GPG_ERR_NOT_SUPPORTED);
+  if (err)
+    {
+      xfree (cand);
+      return err;
+    }
+
+  /* Map the blob numbers to file offsets.  */
+  hd->cand.offsets = xtrymalloc ((ncand? ncand : 1) * sizeof (off_t));
+  hd->cand.name = xtrystrdup (desc->u.name);
+  if (!hd->cand.offsets || !hd->cand.name)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (cand);
+      _keybox_release_candidates (hd);
+      return err;
+    }
+  blobtbl = hd->nidx.image + NIDX_HEADERLEN;
+  for (n = 0; n < ncand; n++)
+    hd->cand.offsets[n] = (off_t)(((unsigned long long)
+                                   get32 (blobtbl + cand[n]*8) << 32)
+                                  | get32 (blobtbl + cand[n]*8 + 4));
+  hd->cand.count = ncand;
+  hd->cand.pos = 0;
+  hd->cand.mode = desc->mode;
+  hd->cand.size = (off_t)(((unsigned long long)
+                           get32 (hd->nidx.image+8) << 32)
+                          | get32 (hd->nidx.image+12));
+  xfree (cand);
+  return 0;
+}
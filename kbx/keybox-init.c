@@ -135,6 +135,21 @@ keybox_new (void *token, int secret)
   return hd;
 }
 
+
+/* Same as keybox_new but the handle skips all blobs which are not
+   OpenPGP keyblocks.  This is used by gpg which may share the keybox
+   with gpgsm.  */
+KEYBOX_HANDLE
+keybox_new_openpgp (void *token, int secret)
+{
+  KEYBOX_HANDLE hd;
+
+  hd = keybox_new (token, secret);
+  if (hd)
+    hd->for_openpgp = 1;
+  return hd;
+}
+
 void
 keybox_release (KEYBOX_HANDLE hd)
 {
@@ -153,6 +168,8 @@ keybox_release (KEYBOX_HANDLE hd)
       fclose (hd->fp);
       hd->fp = NULL;
     }
+  _keybox_unmap_file (hd);
+  _keybox_release_name_index (hd);
   xfree (hd->word_match.name);
   xfree (hd->word_match.pattern);
   xfree (hd);
@@ -197,6 +214,7 @@ _keybox_close_file (KEYBOX_HANDLE hd)
             fclose (roverhd->fp);
             roverhd->fp = NULL;
           }
+        _keybox_unmap_file (roverhd);
       }
   assert (!hd->fp);
 }
@@ -116,6 +116,7 @@ _keybox_get_flag_location (const unsigned char *buffer, size_t length,
     case KEYBOX_FLAG_OWNERTRUST:
     case KEYBOX_FLAG_VALIDITY:
     case KEYBOX_FLAG_CREATED_AT:
+    case KEYBOX_FLAG_SIG_INFO:
       if (length < 20)
         return GPG_ERR_INV_OBJ;
       /* Key info. */
@@ -140,6 +141,12 @@ _keybox_get_flag_location (const unsigned char *buffer, size_t length,
       if (pos+4 > length)
         return GPG_ERR_INV_OBJ ; /* Out of bounds. */
       /* Signature info. */
+      if (what == KEYBOX_FLAG_SIG_INFO)
+        {
+          *flag_off = pos;
+          *flag_size = 4 + get16 (buffer + pos) * get16 (buffer + pos + 2);
+          break;
+        }
       nsigs = get16 (buffer + pos); pos += 2;
       siginfolen = get16 (buffer + pos); pos += 2;
       if (siginfolen < 4 )
@@ -253,7 +260,7 @@ blob_cmp_fpr (KEYBOXBLOB blob, const unsigned char *fpr)
     {
       off = pos + idx*keyinfolen;
       if (!memcmp (buffer + off, fpr, 20))
-        return 1; /* found */
+        return idx+1; /* found */
     }
   return 0; /* not found */
 }
@@ -285,15 +292,81 @@ blob_cmp_fpr_part (KEYBOXBLOB blob, const unsigned char *fpr,
     {
       off = pos + idx*keyinfolen;
       if (!memcmp (buffer + off + fproff, fpr, fprlen))
-        return 1; /* found */
+        return idx+1; /* found */
+    }
+  return 0; /* not found */
+}
+
+
+/* Compare the keyids of all keys in the OpenPGP BLOB.  Other than
+   blob_cmp_fpr_part this uses the keyID offset stored in the key
+   information and thus also works for v3 keys whose keyIDs are not
+   part of the fingerprint.  KIDOFF and KIDLEN select the part of the
+   8 byte keyID to compare. */
+static int
+blob_cmp_kid (KEYBOXBLOB blob, const unsigned char *kid,
+              int kidoff, int kidlen)
+{
+  const unsigned char *buffer;
+  size_t length;
+  size_t pos, off;
+  size_t nkeys, keyinfolen;
+  int idx;
+
+  buffer = _keybox_get_blob_image (blob, &length);
+  if (length < 40)
+    return 0; /* blob too short */
+
+  /*keys*/
+  nkeys = get16 (buffer + 16);
+  keyinfolen = get16 (buffer + 18 );
+  if (keyinfolen < 28)
+    return 0; /* invalid blob */
+  pos = 20;
+  if (pos + keyinfolen*nkeys > length)
+    return 0; /* out of bounds */
+
+  for (idx=0; idx < nkeys; idx++)
+    {
+      off = get32 (buffer + pos + idx*keyinfolen + 20);
+      if (!off || off + 8 > length)
+        continue; /* keyID not known or out of bounds */
+      if (!memcmp (buffer + off + kidoff, kid, kidlen))
+        return idx+1; /* found */
     }
   return 0; /* not found */
 }
 
 
+/* Store the keyID of the primary key of the OpenPGP BLOB at KID.
+   Returns false if the keyID is not available.  */
+static int
+blob_get_first_keyid (KEYBOXBLOB blob, u32 *kid)
+{
+  const unsigned char *buffer;
+  size_t length, off;
+
+  buffer = _keybox_get_blob_image (blob, &length);
+  if (length < 48)
+    return 0; /* blob too short */
+
+  off = get32 (buffer + 20 + 20);
+  if (!off || off + 8 > length)
+    return 0; /* not known or out of bounds */
+
+  kid[0] = get32 (buffer + off);
+  kid[1] = get32 (buffer + off + 4);
+  return 1;
+}
+
+
+/* Compare the user ID with index IDX of BLOB against NAME.  With IDX
+   given as -1 all user IDs are compared; for X.509 this skips the
+   issuer which is always stored as the first user ID.  Returns 0 if
+   not found or the index of the matching user ID plus 1.  */
 static int
 blob_cmp_name (KEYBOXBLOB blob, int idx,
-               const char *name, size_t namelen, int substr)
+               const char *name, size_t namelen, int substr, int x509)
 {
   const unsigned char *buffer;
   size_t length;
@@ -330,10 +403,8 @@ blob_cmp_name (KEYBOXBLOB blob, int idx,
     return 0; /* out of bounds */
 
   if (idx < 0)
-    { /* compare all names starting with that (negated) index */
-      idx = -idx;
-
-      for ( ;idx < nuids; idx++)
+    { /* Compare all names.  */
+      for (idx = !!x509; idx < nuids; idx++)
         {
           size_t mypos = pos;
 
@@ -347,12 +418,12 @@ blob_cmp_name (KEYBOXBLOB blob, int idx,
           if (substr)
             {
               if (ascii_memcasemem (buffer+off, len, name, namelen))
-                return 1; /* found */
+                return idx+1; /* found */
             }
           else
             {
               if (len == namelen && !memcmp (buffer+off, name, len))
-                return 1; /* found */
+                return idx+1; /* found */
             }
         }
       return 0; /* not found */
@@ -371,20 +442,26 @@ blob_cmp_name (KEYBOXBLOB blob, int idx,
 
       if (substr)
         {
-          return !!ascii_memcasemem (buffer+off, len, name, namelen);
+          if (ascii_memcasemem (buffer+off, len, name, namelen))
+            return idx+1; /* found */
         }
       else
         {
-          return len == namelen && !memcmp (buffer+off, name, len);
+          if (len == namelen && !memcmp (buffer+off, name, len))
+            return idx+1; /* found */
         }
+      return 0; /* not found */
     }
 }
 
 
-/* compare all email addresses of the subject.  With SUBSTR given as
-   True a substring search is done in the mail address */
+/* Compare all email addresses of the subject.  With SUBSTR given as
+   True a substring search is done in the mail address.  If X509
+   states whether the search is done on an X.509 blob.  Returns 0 if
+   not found or the index of the matching user ID plus 1.  */
 static int
-blob_cmp_mail (KEYBOXBLOB blob, const char *name, size_t namelen, int substr)
+blob_cmp_mail (KEYBOXBLOB blob, const char *name, size_t namelen, int substr,
+               int x509)
 {
   const unsigned char *buffer;
   size_t length;
@@ -425,7 +502,7 @@ blob_cmp_mail (KEYBOXBLOB blob, const char *name, size_t namelen, int substr)
   if (namelen < 1)
     return 0;
 
-  for (idx=1 ;idx < nuids; idx++)
+  for (idx=!!x509 ;idx < nuids; idx++)
     {
       size_t mypos = pos;
 
@@ -434,6 +511,18 @@ blob_cmp_mail (KEYBOXBLOB blob, const char *name, size_t namelen, int substr)
       len = get32 (buffer+mypos+4);
       if (off+len > length)
         return 0; /* error: better stop here out of bounds */
+      if (!x509)
+        {
+          const unsigned char *p;
+
+          /* For OpenPGP we need to forward to the mailbox part and
+             ignore anything after its closing delimiter.  */
+          for ( ;len && buffer[off] != '<'; len--, off++)
+            ;
+          p = len? memchr (buffer+off, '>', len) : NULL;
+          if (p)
+            len = p - (buffer+off) + 1;
+        }
       if (len < 2 || buffer[off] != '<')
         continue; /* empty name or trailing 0 not stored */
       len--; /* one back */
@@ -443,18 +532,150 @@ blob_cmp_mail (KEYBOXBLOB blob, const char *name, size_t namelen, int substr)
       if (substr)
         {
           if (ascii_memcasemem (buffer+off+1, len, name, namelen))
-            return 1; /* found */
+            return idx+1; /* found */
         }
       else
         {
           if (len == namelen && !ascii_memcasecmp (buffer+off+1, name, len))
-            return 1; /* found */
+            return idx+1; /* found */
         }
     }
   return 0; /* not found */
 }
 
 
+/* Return true if C is part of a word for KEYDB_SEARCH_MODE_WORDS.  */
+static int
+word_char_p (int c)
+{
+  return ((c & 0x80)
+          || (c >= '0' && c <= '9')
+          || (c >= 'a' && c <= 'z')
+          || (c >= 'A' && c <= 'Z'));
+}
+
+
+/* Return true if every word of PATTERN, which is a list of words
+   delimited by single spaces, appears as a complete word in the LEN
+   bytes at UID.  The comparison is case insensitive.  */
+static int
+word_match (const unsigned char *uid, size_t len, const char *pattern)
+{
+  const char *w, *wend;
+  const unsigned char *p, *s;
+  size_t n, wlen;
+  int found;
+
+  for (w = pattern; *w; w = *wend? wend+1 : wend)
+    {
+      wend = strchr (w, ' ');
+      if (!wend)
+        wend = w + strlen (w);
+      wlen = wend - w;
+
+      found = 0;
+      for (p = uid, n = len; n && !found; )
+        {
+          while (n && !word_char_p (*p))
+            p++, n--;
+          for (s = p; n && word_char_p (*p); p++, n--)
+            ;
+          if (p - s == wlen && !ascii_memcasecmp (s, w, wlen))
+            found = 1;
+        }
+      if (!found)
+        return 0;
+    }
+  return 1;
+}
+
+
+/* Return a word pattern for NAME as used by word_match.  */
+static char *
+prepare_word_match (const char *name)
+{
+  char *pattern, *p;
+  const unsigned char *s = (const unsigned char *)name;
+
+  p = pattern = xtrymalloc (strlen (name) + 1);
+  if (!pattern)
+    return NULL;
+  while (*s)
+    {
+      while (*s && !word_char_p (*s))
+        s++;
+      if (!*s)
+        break;
+      if (p != pattern)
+        *p++ = ' ';
+      while (*s && word_char_p (*s))
+        *p++ = *s++;
+    }
+  *p = 0;
+  return pattern;
+}
+
+
+/* Compare all user IDs of BLOB against the word PATTERN.  Returns
+   the number of the first matching user ID or 0.  */
+static int
+blob_cmp_words (KEYBOXBLOB blob, const char *pattern, int x509)
+{
+  const unsigned char *buffer;
+  size_t length;
+  size_t pos, off, len;
+  size_t nkeys, keyinfolen;
+  size_t nuids, uidinfolen;
+  size_t nserial;
+  int idx;
+
+  /* fixme: this code is common to blob_cmp_name */
+  buffer = _keybox_get_blob_image (blob, &length);
+  if (length < 40)
+    return 0; /* blob too short */
+
+  /*keys*/
+  nkeys = get16 (buffer + 16);
+  keyinfolen = get16 (buffer + 18 );
+  if (keyinfolen < 28)
+    return 0; /* invalid blob */
+  pos = 20 + keyinfolen*nkeys;
+  if (pos+2 > length)
+    return 0; /* out of bounds */
+
+  /*serial*/
+  nserial = get16 (buffer+pos);
+  pos += 2 + nserial;
+  if (pos+4 > length)
+    return 0; /* out of bounds */
+
+  /* user ids*/
+  nuids = get16 (buffer + pos);  pos += 2;
+  uidinfolen = get16 (buffer + pos);  pos += 2;
+  if (uidinfolen < 12 /* should add a: || nuidinfolen > MAX_UIDINFOLEN */)
+    return 0; /* invalid blob */
+  if (pos + uidinfolen*nuids > length)
+    return 0; /* out of bounds */
+
+  if (!*pattern)
+    return 0;
+
+  for (idx=!!x509 ;idx < nuids; idx++)
+    {
+      size_t mypos = pos;
+
+      mypos += idx*uidinfolen;
+      off = get32 (buffer+mypos);
+      len = get32 (buffer+mypos+4);
+      if (off+len > length)
+        return 0; /* error: better stop here out of bounds */
+      if (word_match (buffer+off, len, pattern))
+        return idx+1; /* found */
+    }
+  return 0; /* not found */
+}
+
+
 #ifdef KEYBOX_WITH_X509
 /* Return true if the key in BLOB matches the 20 bytes keygrip GRIP.
    We don't have the keygrips as meta data, thus we need to parse the
@@ -537,6 +758,8 @@ has_short_kid (KEYBOXBLOB blob, u32 lkid)
   buf[1] = lkid >> 16;
   buf[2] = lkid >> 8;
   buf[3] = lkid;
+  if (blob_get_type (blob) == BLOBTYPE_PGP)
+    return blob_cmp_kid (blob, buf, 4, 4);
   return blob_cmp_fpr_part (blob, buf, 16, 4);
 }
 
@@ -552,6 +775,8 @@ has_long_kid (KEYBOXBLOB blob, u32 mkid, u32 lkid)
   buf[5] = lkid >> 16;
   buf[6] = lkid >> 8;
   buf[7] = lkid;
+  if (blob_get_type (blob) == BLOBTYPE_PGP)
+    return blob_cmp_kid (blob, buf, 0, 8);
   return blob_cmp_fpr_part (blob, buf, 12, 8);
 }
 
@@ -561,12 +786,25 @@ has_fingerprint (KEYBOXBLOB blob, const unsigned char *fpr)
   return blob_cmp_fpr (blob, fpr);
 }
 
+/* The 16 byte fingerprints of OpenPGP v3 keys are stored right
+   aligned in the 20 byte fingerprint field.  */
+static inline int
+has_fingerprint16 (KEYBOXBLOB blob, const unsigned char *fpr)
+{
+  if (blob_get_type (blob) != BLOBTYPE_PGP)
+    return 0;
+  return blob_cmp_fpr_part (blob, fpr, 4, 16);
+}
+
 static inline int
 has_keygrip (KEYBOXBLOB blob, const unsigned char *grip)
 {
 #ifdef KEYBOX_WITH_X509
   if (blob_get_type (blob) == BLOBTYPE_X509)
     return blob_x509_has_grip (blob, grip);
+#else
+  (void)blob;
+  (void)grip;
 #endif
   return 0;
 }
@@ -583,7 +821,7 @@ has_issuer (KEYBOXBLOB blob, const char *name)
     return 0;
 
   namelen = strlen (name);
-  return blob_cmp_name (blob, 0 /* issuer */, name, namelen, 0);
+  return blob_cmp_name (blob, 0 /* issuer */, name, namelen, 0, 1);
 }
 
 static inline int
@@ -601,7 +839,7 @@ has_issuer_sn (KEYBOXBLOB blob, const char *name,
   namelen = strlen (name);
 
   return (blob_cmp_sn (blob, sn, snlen)
-          && blob_cmp_name (blob, 0 /* issuer */, name, namelen, 0));
+          && blob_cmp_name (blob, 0 /* issuer */, name, namelen, 0, 1));
 }
 
 static inline int
@@ -625,22 +863,28 @@ has_subject (KEYBOXBLOB blob, const char *name)
     return 0;
 
   namelen = strlen (name);
-  return blob_cmp_name (blob, 1 /* subject */, name, namelen, 0);
+  return blob_cmp_name (blob, 1 /* subject */, name, namelen, 0, 1);
 }
 
+
+/* Compare NAME against all user names of BLOB; that is all user IDs
+   of an OpenPGP blob or the subject and all subjectAltNames of an
+   X.509 blob.  */
 static inline int
-has_subject_or_alt (KEYBOXBLOB blob, const char *name, int substr)
+has_username (KEYBOXBLOB blob, const char *name, int substr)
 {
   size_t namelen;
+  int btype;
 
   return_val_if_fail (name, 0);
 
-  if (blob_get_type (blob) != BLOBTYPE_X509)
+  btype = blob_get_type (blob);
+  if (btype != BLOBTYPE_PGP && btype != BLOBTYPE_X509)
     return 0;
 
   namelen = strlen (name);
-  return blob_cmp_name (blob, -1 /* all subject names*/, name,
-                        namelen, substr);
+  return blob_cmp_name (blob, -1 /* all subject/user names */, name,
+                        namelen, substr, (btype == BLOBTYPE_X509));
 }
 
 
@@ -648,16 +892,36 @@ static inline int
 has_mail (KEYBOXBLOB blob, const char *name, int substr)
 {
   size_t namelen;
+  int btype;
 
   return_val_if_fail (name, 0);
 
-  if (blob_get_type (blob) != BLOBTYPE_X509)
+  btype = blob_get_type (blob);
+  if (btype != BLOBTYPE_PGP && btype != BLOBTYPE_X509)
     return 0;
 
+  if (*name == '<')
+    name++; /* gpg passes the mail address with the opening bracket. */
   namelen = strlen (name);
   if (namelen && name[namelen-1] == '>')
     namelen--;
-  return blob_cmp_mail (blob, name, namelen, substr);
+  return blob_cmp_mail (blob, name, namelen, substr,
+                        (btype == BLOBTYPE_X509));
+}
+
+
+static inline int
+has_words (KEYBOXBLOB blob, const char *pattern)
+{
+  int btype;
+
+  return_val_if_fail (pattern, 0);
+
+  btype = blob_get_type (blob);
+  if (btype != BLOBTYPE_PGP && btype != BLOBTYPE_X509)
+    return 0;
+
+  return blob_cmp_words (blob, pattern, (btype == BLOBTYPE_X509));
 }
 
 
@@ -695,6 +959,8 @@ keybox_search_reset (KEYBOX_HANDLE hd)
       fclose (hd->fp);
       hd->fp = NULL;
     }
+  _keybox_unmap_file (hd);
+  _keybox_release_candidates (hd);
   hd->error = 0;
   hd->eof = 0;
   return 0;
@@ -702,15 +968,20 @@ keybox_search_reset (KEYBOX_HANDLE hd)
 
 
 /* Note: When in ephemeral mode the search function does visit all
-   blobs but in standard mode, blobs flagged as ephemeral are ignored.  */
+   blobs but in standard mode, blobs flagged as ephemeral are ignored.
+   If R_DESCINDEX is not NULL, the index of the matching search
+   description is stored there.  */
 int
-keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc)
+keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
+               size_t *r_descindex)
 {
   int rc;
   size_t n;
   int need_words, any_skip;
   KEYBOXBLOB blob = NULL;
+  KEYBOXBLOB mapblob = NULL;
   struct sn_array_s *sn_array = NULL;
+  int pk_no, uid_no;
 
   if (!hd)
     return gpg_error (GPG_ERR_INV_VALUE);
@@ -753,9 +1024,52 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc)
         }
     }
 
-  (void)need_words;  /* Not yet implemented.  */
+  if (need_words)
+    {
+      const char *name = NULL;
+
+      /* As with the keyring code we only use the first description
+         in word mode.  */
+      for (n=0; n < ndesc && !name; n++)
+        if (desc[n].mode == KEYDB_SEARCH_MODE_WORDS)
+          name = desc[n].u.name;
+      if (!hd->word_match.name || strcmp (hd->word_match.name, name))
+        {
+          xfree (hd->word_match.name);
+          xfree (hd->word_match.pattern);
+          hd->word_match.name = xtrystrdup (name);
+          hd->word_match.pattern = prepare_word_match (name);
+          if (!hd->word_match.name || !hd->word_match.pattern)
+            {
+              hd->error = gpg_error_from_syserror ();
+              xfree (hd->word_match.name);
+              xfree (hd->word_match.pattern);
+              hd->word_match.name = NULL;
+              hd->word_match.pattern = NULL;
+              xfree (sn_array);
+              return hd->error;
+            }
+        }
+    }
 
-  if (!hd->fp)
+  /* A search for a single name starting at the begin of the keybox
+     may use the name index to restrict the search to the candidate
+     blobs.  Later calls continue with the same candidates as long as
+     the search is the same; otherwise we continue with a scan from
+     the current position.  */
+  if (!hd->fp && !hd->map.image)
+    {
+      if (ndesc != 1 || _keybox_lookup_name_index (hd, desc))
+        _keybox_release_candidates (hd);
+    }
+  else if (hd->cand.offsets
+           && (ndesc != 1 || desc->mode != hd->cand.mode
+               || !desc->u.name || strcmp (desc->u.name, hd->cand.name)))
+    _keybox_release_candidates (hd);
+
+  /* Prefer to walk a memory mapped image of the keybox; this avoids
+     copying each blob.  Fall back to stdio if mapping fails.  */
+  if (!hd->fp && !hd->map.image && _keybox_map_file (hd))
     {
       hd->fp = fopen (hd->kb->fname, "rb");
       if (!hd->fp)
@@ -765,6 +1079,18 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc)
           return hd->error;
         }
     }
+  if (hd->cand.offsets && hd->map.image
+      && (off_t)hd->map.size != hd->cand.size)
+    _keybox_release_candidates (hd); /* Changed since the lookup.  */
+  if (hd->map.image)
+    {
+      rc = _keybox_new_blob (&mapblob, NULL, 0, 0);
+      if (rc)
+        {
+          xfree (sn_array);
+          return (hd->error = rc);
+        }
+    }
 
   /* Kludge: We need to convert an SN given as hexstring to its binary
      representation - in some cases we are not able to store it in the
@@ -827,17 +1153,40 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc)
     }
 
 
+  pk_no = uid_no = 0;
   for (;;)
     {
       unsigned int blobflags;
 
-      _keybox_release_blob (blob); blob = NULL;
-      rc = _keybox_read_blob (&blob, hd->fp);
+      if (blob != mapblob)
+        _keybox_release_blob (blob);
+      blob = NULL;
+      if (hd->cand.offsets)
+        {
+          if (hd->cand.pos >= hd->cand.count)
+            {
+              rc = -1;
+              break;
+            }
+          rc = _keybox_seek_blob (hd, hd->cand.offsets[hd->cand.pos++]);
+          if (rc)
+            break;
+        }
+      if (mapblob)
+        {
+          rc = _keybox_read_mapped_blob (hd, mapblob);
+          if (!rc)
+            blob = mapblob;
+        }
+      else
+        rc = _keybox_read_blob (&blob, hd->fp);
       if (rc)
         break;
 
       if (blob_get_type (blob) == BLOBTYPE_HEADER)
         continue;
+      if (hd->for_openpgp && blob_get_type (blob) != BLOBTYPE_PGP)
+        continue;
 
 
       blobflags = blob_get_blob_flags (blob);
@@ -852,24 +1201,32 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc)
               never_reached ();
               break;
             case KEYDB_SEARCH_MODE_EXACT:
-              if (has_subject_or_alt (blob, desc[n].u.name, 0))
+              uid_no = has_username (blob, desc[n].u.name, 0);
+              if (uid_no)
                 goto found;
               break;
             case KEYDB_SEARCH_MODE_MAIL:
-              if (has_mail (blob, desc[n].u.name, 0))
+              uid_no = has_mail (blob, desc[n].u.name, 0);
+              if (uid_no)
                 goto found;
               break;
             case KEYDB_SEARCH_MODE_MAILSUB:
-              if (has_mail (blob, desc[n].u.name, 1))
+              uid_no = has_mail (blob, desc[n].u.name, 1);
+              if (uid_no)
                 goto found;
               break;
             case KEYDB_SEARCH_MODE_SUBSTR:
-              if (has_subject_or_alt (blob, desc[n].u.name, 1))
+              uid_no =  has_username (blob, desc[n].u.name, 1);
+              if (uid_no)
                 goto found;
               break;
             case KEYDB_SEARCH_MODE_MAILEND:
+              /* Not yet implemented.  */
+              break;
             case KEYDB_SEARCH_MODE_WORDS:
-              never_reached (); /* not yet implemented */
+              uid_no = has_words (blob, hd->word_match.pattern);
+              if (uid_no)
+                goto found;
               break;
             case KEYDB_SEARCH_MODE_ISSUER:
               if (has_issuer (blob, desc[n].u.name))
@@ -891,16 +1248,24 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc)
                 goto found;
               break;
             case KEYDB_SEARCH_MODE_SHORT_KID:
-              if (has_short_kid (blob, desc[n].u.kid[1]))
+              pk_no = has_short_kid (blob, desc[n].u.kid[1]);
+              if (pk_no)
                 goto found;
               break;
             case KEYDB_SEARCH_MODE_LONG_KID:
-              if (has_long_kid (blob, desc[n].u.kid[0], desc[n].u.kid[1]))
+              pk_no = has_long_kid (blob, desc[n].u.kid[0], desc[n].u.kid[1]);
+              if (pk_no)
+                goto found;
+              break;
+            case KEYDB_SEARCH_MODE_FPR16:
+              pk_no = has_fingerprint16 (blob, desc[n].u.fpr);
+              if (pk_no)
                 goto found;
               break;
             case KEYDB_SEARCH_MODE_FPR:
             case KEYDB_SEARCH_MODE_FPR20:
-              if (has_fingerprint (blob, desc[n].u.fpr))
+              pk_no = has_fingerprint (blob, desc[n].u.fpr);
+              if (pk_no)
                 goto found;
               break;
             case KEYDB_SEARCH_MODE_KEYGRIP:
@@ -920,19 +1285,57 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc)
 	}
       continue;
     found:
+      /* Record which DESC we matched on.  Note this value is only
+         meaningful if this function returns with no errors. */
+      if (r_descindex)
+        *r_descindex = n;
       for (n=any_skip?0:ndesc; n < ndesc; n++)
         {
-/*            if (desc[n].skipfnc */
-/*                && desc[n].skipfnc (desc[n].skipfncvalue, aki, NULL)) */
-/*              break; */
+          u32 kid[2];
+
+          if (desc[n].skipfnc
+              && blob_get_first_keyid (blob, kid)
+              && desc[n].skipfnc (desc[n].skipfncvalue, kid, NULL))
+            break;
         }
       if (n == ndesc)
         break; /* got it */
+      pk_no = uid_no = 0;
     }
 
+  if (!rc && blob == mapblob)
+    {
+      /* The found blob must stay valid after the mapping has been
+         released, thus we need a copy.  */
+      const unsigned char *image;
+      unsigned char *copy;
+      size_t imagelen;
+
+      image = _keybox_get_blob_image (mapblob, &imagelen);
+      copy = xtrymalloc (imagelen);
+      if (!copy)
+        rc = gpg_error_from_syserror ();
+      else
+        {
+          memcpy (copy, image, imagelen);
+          rc = _keybox_new_blob (&blob, copy, imagelen,
+                                 _keybox_get_blob_fileoffset (mapblob));
+          if (rc)
+            {
+              xfree (copy);
+              blob = NULL;
+            }
+        }
+    }
+  else if (blob == mapblob)
+    blob = NULL;
+  _keybox_release_blob (mapblob);
+
   if (!rc)
     {
       hd->found.blob = blob;
+      hd->found.pk_no = pk_no;
+      hd->found.uid_no = uid_no;
     }
   else if (rc == -1)
     {
@@ -958,6 +1361,76 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc)
    Functions to return a certificate or a keyblock.  To be used after
    a successful search operation.
 */
+
+
+/* Return the last found keyblock.  Returns 0 on success and stores a
+   new iobuf at R_IOBUF and a signature status vector at R_SIGSTATUS
+   in that case.  R_PK_NO and R_UID_NO are set to the number of the
+   matching key and user ID (both counting from 1) or 0 if not known.
+   The first element of the signature status vector gives the number
+   of the following elements.  */
+gpg_error_t
+keybox_get_keyblock (KEYBOX_HANDLE hd, iobuf_t *r_iobuf,
+                     int *r_pk_no, int *r_uid_no, u32 **r_sigstatus)
+{
+  gpg_err_code_t ec;
+  const unsigned char *buffer, *p;
+  size_t length;
+  size_t image_off, image_len;
+  size_t siginfo_off, siginfo_len;
+  u32 *sigstatus, n, n_sigs, n_sigs_size;
+
+  *r_iobuf = NULL;
+  *r_sigstatus = NULL;
+
+  if (!hd)
+    return gpg_error (GPG_ERR_INV_VALUE);
+  if (!hd->found.blob)
+    return gpg_error (GPG_ERR_NOTHING_FOUND);
+
+  if (blob_get_type (hd->found.blob) != BLOBTYPE_PGP)
+    return gpg_error (GPG_ERR_WRONG_BLOB_TYPE);
+
+  buffer = _keybox_get_blob_image (hd->found.blob, &length);
+  if (length < 40)
+    return gpg_error (GPG_ERR_TOO_SHORT);
+  image_off = get32 (buffer+8);
+  image_len = get32 (buffer+12);
+  if (image_off+image_len > length)
+    return gpg_error (GPG_ERR_TOO_SHORT);
+
+  ec = _keybox_get_flag_location (buffer, length, KEYBOX_FLAG_SIG_INFO,
+                                   &siginfo_off, &siginfo_len);
+  if (ec)
+    return gpg_error (ec);
+  n_sigs      = get16 (buffer + siginfo_off);
+  n_sigs_size = get16 (buffer + siginfo_off + 2);
+  if (!n_sigs || n_sigs_size != 4)
+    {
+      /* A keyblock needs to have at least one signature and we
+         require a size of 4 for the signature status.  */
+      return gpg_error (GPG_ERR_BAD_DATA);
+    }
+  if (siginfo_off + siginfo_len > length)
+    return gpg_error (GPG_ERR_TOO_SHORT);
+
+  sigstatus = xtrymalloc ((1+n_sigs) * sizeof *sigstatus);
+  if (!sigstatus)
+    return gpg_error_from_syserror ();
+
+  sigstatus[0] = n_sigs;
+  p = buffer + siginfo_off + 4;
+  for (n=1; n <= n_sigs; n++, p += n_sigs_size)
+    sigstatus[n] = get32 (p);
+
+  *r_pk_no  = hd->found.pk_no;
+  *r_uid_no = hd->found.uid_no;
+  *r_sigstatus = sigstatus;
+  *r_iobuf = iobuf_temp_with_content ((const char *)buffer+image_off,
+                                      image_len);
+  return 0;
+}
+
 #ifdef KEYBOX_WITH_X509
 /*
   Return the last found cert.  Caller must free it.
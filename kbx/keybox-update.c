@@ -24,6 +24,9 @@
 #include <errno.h>
 #include <time.h>
 #include <unistd.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "keybox-defs.h"
 #include "../common/sysutils.h"
@@ -371,6 +374,186 @@ blob_filecopy (int mode, const char *fname, KEYBOXBLOB blob,
 
 
 
+/* Append BLOB to the keybox FNAME.  This is much cheaper than
+   blob_filecopy but not atomic; thus a partly written blob is
+   removed on error.  */
+static int
+blob_append (const char *fname, KEYBOXBLOB blob, int secret, off_t *r_off)
+{
+  FILE *fp;
+  struct stat st;
+  int rc;
+
+  fp = fopen (fname, "r+b");
+  if (!fp && errno == ENOENT)
+    {
+      /* Let blob_filecopy create the file.  The blob then directly
+         follows the 32 byte header blob.  */
+      rc = blob_filecopy (1, fname, blob, secret, 0);
+      if (!rc && r_off)
+        *r_off = 32;
+      return rc;
+    }
+  if (!fp)
+    return gpg_error_from_syserror ();
+
+  if (fstat (fileno (fp), &st) || fseeko (fp, st.st_size, SEEK_SET))
+    {
+      rc = gpg_error_from_syserror ();
+      fclose (fp);
+      return rc;
+    }
+  if (st.st_size < 32)
+    {
+      /* Not even a header blob - better use the safe way.  */
+      fclose (fp);
+      return gpg_error (GPG_ERR_TOO_SHORT);
+    }
+
+  rc = _keybox_write_blob (blob, fp);
+  if (!rc && fflush (fp))
+    rc = gpg_error_from_syserror ();
+#ifdef HAVE_FTRUNCATE
+  if (rc)
+    ftruncate (fileno (fp), st.st_size);
+#endif
+  if (fclose (fp) && !rc)
+    rc = gpg_error_from_syserror ();
+  if (!rc && r_off)
+    *r_off = st.st_size;
+  return rc;
+}
+
+
+/* Return true if the LENGTH bytes at BUFFER as read from the file
+   are still the blob IMAGE.  The blob flags are not compared because
+   keybox_set_flags changes them in the file only.  */
+static int
+same_blob_p (const unsigned char *buffer, const unsigned char *image,
+             size_t length)
+{
+  size_t n = length < 40? length : 40;
+
+  if (n < 8)
+    return !memcmp (buffer, image, n);
+  return (!memcmp (buffer, image, 6)
+          && !memcmp (buffer + 8, image + 8, n - 8));
+}
+
+
+/* Mark the blob BLOB in the keybox FNAME as deleted and account its
+   length as garbage in the header blob, so that keybox_compress
+   knows when to reclaim the space.  Before doing so we make sure that
+   the blob is still at its file offset.  With CHECK_ONLY set nothing
+   is changed; only that check is done.  */
+static int
+blob_mark_deleted (const char *fname, KEYBOXBLOB blob, int check_only)
+{
+  FILE *fp;
+  int rc;
+  off_t off;
+  const unsigned char *image;
+  size_t length;
+  unsigned char buffer[40];
+  unsigned char hdr[32];
+  u32 garbage;
+
+  off = _keybox_get_blob_fileoffset (blob);
+  if (off == (off_t)-1)
+    return gpg_error (GPG_ERR_GENERAL);
+  image = _keybox_get_blob_image (blob, &length);
+  if (length < 5)
+    return gpg_error (GPG_ERR_TOO_SHORT);
+
+  fp = fopen (fname, "r+b");
+  if (!fp)
+    return gpg_error_from_syserror ();
+
+  if (fseeko (fp, off, SEEK_SET))
+    rc = gpg_error_from_syserror ();
+  else if (fread (buffer, length < 40? length : 40, 1, fp) != 1)
+    rc = ferror (fp)? gpg_error_from_syserror () : gpg_error (GPG_ERR_CONFLICT);
+  else if (!same_blob_p (buffer, image, length))
+    rc = gpg_error (GPG_ERR_CONFLICT);  /* The file has been changed.  */
+  else if (check_only)
+    {
+      fclose (fp);
+      return 0;
+    }
+  else if (fseeko (fp, off + 4, SEEK_SET))
+    rc = gpg_error_from_syserror ();
+  else if (putc (0, fp) == EOF)
+    rc = gpg_error_from_syserror ();
+  else
+    rc = 0;
+
+  /* Update the garbage counter.  Failing to do so is not an error;
+     the next maintenance run will anyway clean up.  */
+  if (!rc
+      && !fseeko (fp, 0, SEEK_SET)
+      && fread (hdr, sizeof hdr, 1, fp) == 1
+      && hdr[4] == BLOBTYPE_HEADER && !memcmp (hdr+8, "KBXf", 4))
+    {
+      garbage = ((hdr[24] << 24) | (hdr[25] << 16)
+                 | (hdr[26] << 8) | hdr[27]);
+      if (garbage + length < garbage)
+        garbage = 0xffffffff;
+      else
+        garbage += length;
+      hdr[24] = garbage >> 24;
+      hdr[25] = garbage >> 16;
+      hdr[26] = garbage >>  8;
+      hdr[27] = garbage;
+      if (!fseeko (fp, 24, SEEK_SET))
+        fwrite (hdr+24, 4, 1, fp);
+    }
+
+  if (fclose (fp))
+    {
+      if (!rc)
+        rc = gpg_error_from_syserror ();
+    }
+
+  return rc;
+}
+
+
+/* Write the new BLOB to the keybox of HD.  If OLDBLOB is not NULL
+   the new blob replaces it.  The new blob is appended and the old one
+   is then marked as deleted; the space is reclaimed later by
+   keybox_compress.  If appending is not possible we fall back to
+   copying the file.  On success and if R_OFF is not NULL the offset
+   of the new blob is stored there.  */
+static int
+blob_store (KEYBOX_HANDLE hd, KEYBOXBLOB blob, KEYBOXBLOB oldblob,
+            off_t *r_off)
+{
+  const char *fname = hd->kb->fname;
+  int rc;
+
+  /* Don't append a duplicate if the old blob can't be deleted.  */
+  if (oldblob && (rc = blob_mark_deleted (fname, oldblob, 1)))
+    return rc;
+
+  rc = blob_append (fname, blob, hd->secret, r_off);
+  if (!rc)
+    {
+      if (oldblob)
+        rc = blob_mark_deleted (fname, oldblob, 0);
+      return rc;
+    }
+  if (gpg_err_code (rc) != GPG_ERR_TOO_SHORT)
+    return rc;
+
+  if (r_off)
+    *r_off = (off_t)-1;
+  if (oldblob)
+    return blob_filecopy (3, fname, blob, hd->secret,
+                          _keybox_get_blob_fileoffset (oldblob));
+  return blob_filecopy (1, fname, blob, hd->secret, 0);
+}
+
+
 #ifdef KEYBOX_WITH_X509
 int
 keybox_insert_cert (KEYBOX_HANDLE hd, ksba_cert_t cert,
@@ -396,7 +579,7 @@ keybox_insert_cert (KEYBOX_HANDLE hd, ksba_cert_t cert,
   rc = _keybox_create_x509_blob (&blob, cert, sha1_digest, hd->ephemeral);
   if (!rc)
     {
-      rc = blob_filecopy (1, fname, blob, hd->secret, 0);
+      rc = blob_store (hd, blob, NULL, NULL);
       _keybox_release_blob (blob);
       /*    if (!rc && !hd->secret && kb_offtbl) */
       /*      { */
@@ -419,6 +602,128 @@ keybox_update_cert (KEYBOX_HANDLE hd, ksba_cert_t cert,
 
 #endif /*KEYBOX_WITH_X509*/
 
+
+/* Insert the OpenPGP keyblock {IMAGE,IMAGELEN} into the keybox.
+   SIGSTATUS is a vector with the signature status values: its first
+   element gives the number of following elements.  */
+gpg_error_t
+keybox_insert_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen,
+                        u32 *sigstatus)
+{
+  gpg_error_t err;
+  const char *fname;
+  KEYBOXBLOB blob;
+  size_t nparsed;
+  struct _keybox_openpgp_info info;
+
+  if (!hd)
+    return gpg_error (GPG_ERR_INV_HANDLE);
+  if (!hd->kb)
+    return gpg_error (GPG_ERR_INV_HANDLE);
+  fname = hd->kb->fname;
+  if (!fname)
+    return gpg_error (GPG_ERR_INV_HANDLE);
+
+  /* Close this one otherwise we will mess up the position for a next
+     search.  Fixme: it would be better to adjust the position after
+     the write operation.  */
+  _keybox_close_file (hd);
+
+  err = _keybox_parse_openpgp (image, imagelen, &nparsed, &info);
+  if (err)
+    return err;
+  assert (nparsed <= imagelen);
+  err = _keybox_create_openpgp_blob (&blob, &info, image, imagelen,
+                                     sigstatus, hd->ephemeral);
+  _keybox_destroy_openpgp_info (&info);
+  if (!err)
+    {
+      err = blob_store (hd, blob, NULL, NULL);
+      _keybox_release_blob (blob);
+    }
+  return err;
+}
+
+
+/* Update the current OpenPGP keyblock, i.e. the one found by the last
+   search, with the keyblock {IMAGE,IMAGELEN}.  SIGSTATUS has the same
+   meaning as with keybox_insert_keyblock.  */
+gpg_error_t
+keybox_update_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen,
+                        u32 *sigstatus)
+{
+  gpg_error_t err;
+  const char *fname;
+  off_t off, newoff;
+  KEYBOXBLOB blob;
+  size_t nparsed;
+  struct _keybox_openpgp_info info;
+
+  if (!hd || !image || !imagelen)
+    return gpg_error (GPG_ERR_INV_VALUE);
+  if (!hd->found.blob)
+    return gpg_error (GPG_ERR_NOTHING_FOUND);
+  if (!hd->kb)
+    return gpg_error (GPG_ERR_INV_HANDLE);
+  fname = hd->kb->fname;
+  if (!fname)
+    return gpg_error (GPG_ERR_INV_HANDLE);
+
+  {
+    const unsigned char *buffer;
+    size_t length;
+
+    buffer = _keybox_get_blob_image (hd->found.blob, &length);
+    if (length < 5 || buffer[4] != BLOBTYPE_PGP)
+      return gpg_error (GPG_ERR_WRONG_BLOB_TYPE);
+  }
+
+  off = _keybox_get_blob_fileoffset (hd->found.blob);
+  if (off == (off_t)-1)
+    return gpg_error (GPG_ERR_GENERAL);
+
+  /* Close the file because we will replace it.  */
+  _keybox_close_file (hd);
+
+  err = _keybox_parse_openpgp (image, imagelen, &nparsed, &info);
+  if (err)
+    return err;
+  assert (nparsed <= imagelen);
+  err = _keybox_create_openpgp_blob (&blob, &info, image, imagelen,
+                                     sigstatus, hd->ephemeral);
+  _keybox_destroy_openpgp_info (&info);
+  if (!err)
+    {
+      err = blob_store (hd, blob, hd->found.blob, &newoff);
+      if (!err && newoff != (off_t)-1)
+        {
+          /* The found blob has moved; let it refer to the new one so
+             that further operations on it do not hit the deleted
+             blob.  */
+          const unsigned char *newimage;
+          unsigned char *copy;
+          size_t newlen;
+          KEYBOXBLOB newfound;
+
+          newimage = _keybox_get_blob_image (blob, &newlen);
+          copy = xtrymalloc (newlen);
+          if (copy)
+            {
+              memcpy (copy, newimage, newlen);
+              if (!_keybox_new_blob (&newfound, copy, newlen, newoff))
+                {
+                  _keybox_release_blob (hd->found.blob);
+                  hd->found.blob = newfound;
+                }
+              else
+                xfree (copy);
+            }
+        }
+      _keybox_release_blob (blob);
+    }
+  return err;
+}
+
 /* Note: We assume that the keybox has been locked before the current
    search was executed.  This is needed so that we can depend on the
    offset information of the flags. */
@@ -503,10 +808,7 @@ keybox_set_flags (KEYBOX_HANDLE hd, int what, int idx, unsigned int value)
 int
 keybox_delete (KEYBOX_HANDLE hd)
 {
-  off_t off;
   const char *fname;
-  FILE *fp;
-  int rc;
 
   if (!hd)
     return gpg_error (GPG_ERR_INV_VALUE);
@@ -518,35 +820,127 @@ keybox_delete (KEYBOX_HANDLE hd)
   if (!fname)
     return gpg_error (GPG_ERR_INV_HANDLE);
 
-  off = _keybox_get_blob_fileoffset (hd->found.blob);
-  if (off == (off_t)-1)
-    return gpg_error (GPG_ERR_GENERAL);
-  off += 4;
-
   _keybox_close_file (hd);
-  fp = fopen (hd->kb->fname, "r+b");
-  if (!fp)
-    return gpg_error_from_syserror ();
+  return blob_mark_deleted (fname, hd->found.blob, 0);
+}
 
-  if (fseeko (fp, off, SEEK_SET))
-    rc = gpg_error_from_syserror ();
-  else if (putc (0, fp) == EOF)
-    rc = gpg_error_from_syserror ();
+
+/* Return true if another handle of HD's keybox holds the offset of a
+   found blob.  */
+static int
+found_blob_p (KEYBOX_HANDLE hd)
+{
+  int idx;
+
+  if (!hd->kb->handle_table)
+    return 0;
+  for (idx=0; idx < hd->kb->handle_table_size; idx++)
+    if (hd->kb->handle_table[idx] && hd->kb->handle_table[idx] != hd
+        && hd->kb->handle_table[idx]->found.blob)
+      return 1;
+  return 0;
+}
+
+
+/* Return 1 if the blob {BUFFER,LENGTH} is an ephemeral blob created
+   before CUT_TIME, 0 if not and -1 if its flags can't be found.  */
+static int
+expired_blob_p (const unsigned char *buffer, size_t length, u32 cut_time)
+{
+  unsigned int blobflags;
+  size_t pos, size;
+  u32 created_at;
+
+  if (_keybox_get_flag_location (buffer, length,
+                                 KEYBOX_FLAG_BLOB, &pos, &size)
+      || size != 2)
+    return -1;
+  blobflags = ((buffer[pos] << 8) | (buffer[pos+1]));
+  if (!(blobflags & KEYBOX_FLAG_BLOB_EPHEMERAL))
+    return 0;
+
+  if (_keybox_get_flag_location (buffer, length,
+                                 KEYBOX_FLAG_CREATED_AT, &pos, &size)
+      || size != 4)
+    created_at = 0; /* oops. */
   else
-    rc = 0;
+    created_at = ((buffer[pos] << 24) | (buffer[pos+1] << 16)
+                  | (buffer[pos+2] << 8) | (buffer[pos+3]));
+  return created_at && created_at < cut_time;
+}
 
-  if (fclose (fp))
+
+/* Do the maintenance of the keybox FP, which must be open for update
+   and positioned after the header blob, without rewriting it: mark
+   expired ephemeral blobs as deleted and write the new maintenance
+   time stamp and garbage counter to the header blob.  GARBAGE is the
+   garbage counter read from the header blob; the updated value is
+   stored at R_GARBAGE.  */
+static int
+maintain_in_place (FILE *fp, u32 garbage, u32 *r_garbage)
+{
+  int rc, read_rc;
+  KEYBOXBLOB blob;
+  const unsigned char *buffer;
+  size_t length;
+  off_t off, next;
+  u32 cut_time, now;
+  unsigned char hdr[8];
+
+  now = (u32)time (NULL);
+  cut_time = now - 86400;
+  rc = 0;
+  while (!(read_rc = _keybox_read_blob (&blob, fp)))
     {
-      if (!rc)
-        rc = gpg_error_from_syserror ();
+      buffer = _keybox_get_blob_image (blob, &length);
+      if (length > 4 && buffer[4] != BLOBTYPE_HEADER
+          && expired_blob_p (buffer, length, cut_time) == 1)
+        {
+          off = _keybox_get_blob_fileoffset (blob);
+          next = ftello (fp);
+          if (next == (off_t)-1
+              || fseeko (fp, off + 4, SEEK_SET)
+              || putc (0, fp) == EOF
+              || fseeko (fp, next, SEEK_SET))
+            rc = gpg_error_from_syserror ();
+          else if (garbage + length < garbage)
+            garbage = 0xffffffff;
+          else
+            garbage += length;
+        }
+      _keybox_release_blob (blob);
+      if (rc)
+        return rc;
     }
+  if (read_rc != -1)
+    return read_rc;
+
+  hdr[0] = now >> 24;
+  hdr[1] = now >> 16;
+  hdr[2] = now >>  8;
+  hdr[3] = now;
+  hdr[4] = garbage >> 24;
+  hdr[5] = garbage >> 16;
+  hdr[6] = garbage >>  8;
+  hdr[7] = garbage;
+  if (fseeko (fp, 20, SEEK_SET)
+      || fwrite (hdr, 8, 1, fp) != 1
+      || fflush (fp))
+    return gpg_error_from_syserror ();
 
-  return rc;
+  *r_garbage = garbage;
+  return 0;
 }
 
 
 /* Compress the keybox file.  This should be run with the file
-   locked. */
+   locked.  If the last maintenance run is more than 3 hours ago,
+   expired ephemeral blobs are marked as deleted in place.  The file
+   is only rewritten if deleted and replaced blobs make up more than
+   half of it.  Nothing is done while another handle of the keybox
+   holds a found blob, because its file offset would be invalid after
+   rewriting the file.  The search of HD itself is reset by a
+   rewrite.  */
 int
 keybox_compress (KEYBOX_HANDLE hd)
 {
@@ -571,6 +965,9 @@ keybox_compress (KEYBOX_HANDLE hd)
   if (!fname)
     return gpg_error (GPG_ERR_INV_HANDLE);
 
+  if (found_blob_p (hd))
+    return 0; /* Try again later.  */
+
   _keybox_close_file (hd);
 
   /* Open the source file. Because we do a rename, we have to check the
@@ -578,7 +975,7 @@ keybox_compress (KEYBOX_HANDLE hd)
   if (access (fname, W_OK))
     return gpg_error_from_syserror ();
 
-  fp = fopen (fname, "rb");
+  fp = fopen (fname, "r+b");
   if (!fp && errno == ENOENT)
     return 0; /* Ready. File has been deleted right after the access above. */
   if (!fp)
@@ -587,31 +984,52 @@ keybox_compress (KEYBOX_HANDLE hd)
       return rc;
     }
 
-  /* A quick test to see if we need to compress the file at all.  We
-     schedule a compress run after 3 hours. */
+  /* A quick test to see if we need to do anything at all.  We
+     schedule a maintenance run after 3 hours and rewrite the file
+     only if there is too much garbage. */
   if ( !_keybox_read_blob (&blob, fp) )
     {
       const unsigned char *buffer;
       size_t length;
+      struct stat st;
 
       buffer = _keybox_get_blob_image (blob, &length);
-      if (length > 4 && buffer[4] == BLOBTYPE_HEADER)
+      if (length >= 32 && buffer[4] == BLOBTYPE_HEADER
+          && !fstat (fileno (fp), &st))
         {
           u32 last_maint = ((buffer[20] << 24) | (buffer[20+1] << 16)
                             | (buffer[20+2] << 8) | (buffer[20+3]));
+          u32 garbage = ((buffer[24] << 24) | (buffer[24+1] << 16)
+                         | (buffer[24+2] << 8) | (buffer[24+3]));
 
-          if ( (last_maint + 3*3600) > time (NULL) )
+          _keybox_release_blob (blob);
+          blob = NULL;
+          if (garbage <= st.st_size / 2
+              && (last_maint + 3*3600) > time (NULL))
             {
               fclose (fp);
-              _keybox_release_blob (blob);
               return 0; /* Compress run not yet needed. */
             }
+          if (garbage <= st.st_size / 2)
+            {
+              rc = maintain_in_place (fp, garbage, &garbage);
+              if (rc || garbage <= st.st_size / 2)
+                {
+                  if (fclose (fp) && !rc)
+                    rc = gpg_error_from_syserror ();
+                  return rc;
+                }
+            }
         }
       _keybox_release_blob (blob);
       fseek (fp, 0, SEEK_SET);
       clearerr (fp);
     }
 
+  /* The offsets of the blobs change; HD must not use its found blob
+     or search position anymore.  */
+  keybox_search_reset (hd);
+
   /* Create the new file. */
   rc = create_tmp_file (fname, &bakfname, &tmpfname, &newfp);
   if (rc)
@@ -631,10 +1049,8 @@ keybox_compress (KEYBOX_HANDLE hd)
   for (rc=0; !(read_rc = _keybox_read_blob2 (&blob, fp, &skipped_deleted));
        _keybox_release_blob (blob), blob = NULL )
     {
-      unsigned int blobflags;
       const unsigned char *buffer;
-      size_t length, pos, size;
-      u32 created_at;
+      size_t length;
 
       if (skipped_deleted)
         any_changes = 1;
@@ -665,31 +1081,17 @@ keybox_compress (KEYBOX_HANDLE hd)
           continue;
         }
 
-      if (_keybox_get_flag_location (buffer, length,
-                                     KEYBOX_FLAG_BLOB, &pos, &size)
-          || size != 2)
+      switch (expired_blob_p (buffer, length, cut_time))
         {
+        case -1:
           rc = gpg_error (GPG_ERR_BUG);
           break;
+        case 1:
+          any_changes = 1;
+          continue; /* Skip this blob. */
         }
-      blobflags = ((buffer[pos] << 8) | (buffer[pos+1]));
-      if ((blobflags & KEYBOX_FLAG_BLOB_EPHEMERAL))
-        {
-          /* This is an ephemeral blob. */
-          if (_keybox_get_flag_location (buffer, length,
-                                         KEYBOX_FLAG_CREATED_AT, &pos, &size)
-              || size != 4)
-            created_at = 0; /* oops. */
-          else
-            created_at = ((buffer[pos] << 24) | (buffer[pos+1] << 16)
-                          | (buffer[pos+2] << 8) | (buffer[pos+3]));
-
-          if (created_at && created_at < cut_time)
-            {
-              any_changes = 1;
-              continue; /* Skip this blob. */
-            }
-        }
+      if (rc)
+        break;
 
       rc = _keybox_write_blob (blob, newfp);
       if (rc)
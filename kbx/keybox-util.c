@@ -62,6 +62,15 @@ _keybox_calloc (size_t n, size_t m)
   return p;
 }
 
+char *
+_keybox_strdup (const char *string)
+{
+  char *p = _keybox_malloc (strlen (string)+1);
+  if (p)
+    strcpy (p, string);
+  return p;
+}
+
 void
 _keybox_free (void *p)
 {
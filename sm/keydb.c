@@ -456,6 +456,7 @@ lock_all (KEYDB_HANDLE hd)
 static void
 unlock_all (KEYDB_HANDLE hd)
 {
+  gpg_error_t rc;
   int i;
 
   if (!hd->locked)
@@ -468,6 +469,10 @@ unlock_all (KEYDB_HANDLE hd)
         case KEYDB_RESOURCE_TYPE_NONE:
           break;
         case KEYDB_RESOURCE_TYPE_KEYBOX:
+          if ((rc = keybox_update_name_index (hd->active[i].u.kr)))
+            log_info (_("error updating the name index of '%s': %s\n"),
+                      keybox_get_resource_name (hd->active[i].u.kr),
+                      gpg_strerror (rc));
           if (hd->active[i].lockhandle)
             dotlock_release (hd->active[i].lockhandle);
           break;
@@ -905,7 +910,8 @@ keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc, size_t ndesc)
           BUG(); /* we should never see it here */
           break;
         case KEYDB_RESOURCE_TYPE_KEYBOX:
-          rc = keybox_search (hd->active[hd->current].u.kr, desc, ndesc);
+          rc = keybox_search (hd->active[hd->current].u.kr,
+                              desc, ndesc, NULL);
           break;
         }
       if (rc == -1) /* EOF -> switch to next resource */